@@ -0,0 +1,505 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "logger.h"
+
+/*
+  ahead of time recompiler. translates a ROM into a C file that defines
+  `chip8_aot_run`, which the emulator links in when configured with
+  CHIP8_AOT_ROM
+
+  every address the ROM can reach from START_ADDRESS by falling through,
+  jumping, calling or skipping becomes a label. before running the
+  instruction at a label, the generated code checks memory still holds the
+  opcode it was translated from, so self-modifying code and other ROMs fall
+  back to the interpreter. so do returns and Bnnn, whose targets are only
+  known at run time, when they land on an address without a label
+*/
+
+typedef struct translation
+{
+  uint8_t memory[MEMORY_SIZE];      // the ROM, loaded at START_ADDRESS
+  uint16_t rom_end;                 // first address past the ROM
+  bool reachable[MEMORY_SIZE];      // addresses that get a label
+  uint16_t worklist[MEMORY_SIZE];   // reachable addresses not yet followed
+  uint16_t worklist_length;
+} translation_t;
+
+/* --------------------------- function prototypes -------------------------- */
+
+static void print_usage(FILE *out, const char *program);
+static int load_rom(translation_t *translation, const char *rom_path);
+static uint16_t read_opcode(const translation_t *translation, uint16_t address);
+static void mark_reachable(translation_t *translation, uint16_t address);
+static void find_reachable(translation_t *translation);
+static bool uses_dispatch(const translation_t *translation);
+static void emit_goto(FILE *out, const translation_t *translation, uint16_t address, int indent);
+static void emit_interpreted(FILE *out, uint16_t address);
+static bool emit_instruction(FILE *out, const translation_t *translation, uint16_t address);
+static int emit_translation(const translation_t *translation, const char *rom_path, const char *out_path);
+
+/* ---------------------------- helper functions ---------------------------- */
+
+/**
+ * @brief prints available flags
+ *
+ * @param out `stdout` or `stderr`
+ * @param program program name, which is `argv[0]`
+ */
+static void print_usage(FILE *out, const char *program)
+{
+  fprintf(out, "Usage: %s <rom_path> <output.c>\n", program);
+}
+
+/**
+ * @brief reads a ROM into the translation's memory image
+ *
+ * @param translation pointer to translation struct
+ * @param rom_path path to ROM
+ * @return `0` on success, `1` on failure
+ */
+static int load_rom(translation_t *translation, const char *rom_path)
+{
+  FILE *rom_file = fopen(rom_path, "rb");
+
+  if (rom_file == NULL)
+  {
+    LOG_ERROR("Could not open %s", rom_path);
+    return 1;
+  }
+
+  fseek(rom_file, 0, SEEK_END);
+  long rom_size = ftell(rom_file); // size of file in bytes
+  rewind(rom_file);
+
+  if (rom_size > MEMORY_SIZE - START_ADDRESS)
+  {
+    LOG_ERROR("%s is too large to fit in memory", rom_path);
+    fclose(rom_file);
+    return 1;
+  }
+
+  if (fread(&translation->memory[START_ADDRESS], 1, rom_size, rom_file) != (size_t)rom_size)
+  {
+    LOG_ERROR("Could not read %s", rom_path);
+    fclose(rom_file);
+    return 1;
+  }
+
+  fclose(rom_file);
+
+  translation->rom_end = START_ADDRESS + rom_size;
+  return 0;
+}
+
+/**
+ * @brief reads the two bytes of the opcode at an address
+ *
+ * @param translation pointer to translation struct
+ * @param address address of the first byte, inside the ROM
+ * @return the opcode
+ */
+static uint16_t read_opcode(const translation_t *translation, uint16_t address)
+{
+  return translation->memory[address] << 8 | translation->memory[address + 1];
+}
+
+/**
+ * @brief queues an address to be followed, unless it was already or lies outside the ROM
+ *
+ * @param translation pointer to translation struct
+ * @param address address of an instruction
+ */
+static void mark_reachable(translation_t *translation, uint16_t address)
+{
+  if (address < START_ADDRESS || address + 1 >= translation->rom_end || translation->reachable[address])
+  {
+    return; // only whole instructions inside the ROM are translated
+  }
+
+  translation->reachable[address] = true;
+  translation->worklist[translation->worklist_length++] = address;
+}
+
+/**
+ * @brief follows every statically known path through the ROM from START_ADDRESS
+ *
+ * @param translation pointer to translation struct
+ */
+static void find_reachable(translation_t *translation)
+{
+  mark_reachable(translation, START_ADDRESS);
+
+  while (translation->worklist_length > 0)
+  {
+    uint16_t address = translation->worklist[--translation->worklist_length];
+    uint16_t opcode = read_opcode(translation, address);
+    uint16_t nnn = opcode & 0x0FFF;
+
+    switch (opcode & 0xF000)
+    {
+    case 0x0000:
+      if (opcode != 0x00EE)
+      {
+        mark_reachable(translation, address + 2);
+      }
+      break; // where a return goes is only known at run time
+    case 0x1000:
+      mark_reachable(translation, nnn);
+      break;
+    case 0x2000:
+      mark_reachable(translation, nnn);
+      mark_reachable(translation, address + 2); // where the subroutine returns to
+      break;
+    case 0x3000:
+    case 0x4000:
+    case 0x5000:
+    case 0x9000:
+      mark_reachable(translation, address + 2);
+      mark_reachable(translation, address + 4);
+      break;
+    case 0xB000:
+      break; // the target depends on V0
+    case 0xE000:
+      mark_reachable(translation, address + 2);
+      if ((opcode & 0x00FF) == 0x009E || (opcode & 0x00FF) == 0x00A1)
+      {
+        mark_reachable(translation, address + 4);
+      }
+      break;
+    default:
+      mark_reachable(translation, address + 2);
+      break;
+    }
+  }
+}
+
+/* ---------------------------- code generation ---------------------------- */
+
+/**
+ * @brief checks whether any translated instruction jumps to an address only known at run time
+ *
+ * @param translation pointer to translation struct
+ * @return `true` if the generated code needs its `dispatch` label
+ */
+static bool uses_dispatch(const translation_t *translation)
+{
+  for (uint32_t address = START_ADDRESS; address < MEMORY_SIZE; ++address)
+  {
+    if (!translation->reachable[address])
+    {
+      continue;
+    }
+
+    uint16_t opcode = read_opcode(translation, address);
+    if (opcode == 0x00EE || (opcode & 0xF000) == 0xB000 || (opcode & 0xF0FF) == 0xF00A)
+    {
+      return true; // returns, jumps by V0 and key waits all go through `dispatch`
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @brief emits a jump to the code for an address, or a return to the interpreter if it has none
+ *
+ * @param out generated file
+ * @param translation pointer to translation struct
+ * @param address where PC goes next
+ * @param indent number of spaces before each line
+ */
+static void emit_goto(FILE *out, const translation_t *translation, uint16_t address, int indent)
+{
+  if (address < MEMORY_SIZE && translation->reachable[address])
+  {
+    fprintf(out, "%*sgoto L_%03X;\n", indent, "", address);
+  }
+  else
+  {
+    fprintf(out, "%*schip8->pc = 0x%03X;\n%*sreturn cycles;\n", indent, "", address, indent, "");
+  }
+}
+
+/**
+ * @brief emits a call into the interpreter for one instruction
+ *
+ * @param out generated file
+ * @param address address of the instruction
+ */
+static void emit_interpreted(FILE *out, uint16_t address)
+{
+  fprintf(out, "  chip8->pc = 0x%03X;\n  chip8_cycle(chip8);\n", address);
+}
+
+/**
+ * @brief emits the C code for the instruction at an address, after its label and guard
+ *
+ * mirrors the handlers in cpu.c, including the order VF and Vx are written in,
+ * so translated and interpreted code always agree
+ *
+ * @param out generated file
+ * @param translation pointer to translation struct
+ * @param address address of the instruction
+ * @return `true` if control can fall through to the instruction at `address + 2`
+ */
+static bool emit_instruction(FILE *out, const translation_t *translation, uint16_t address)
+{
+  uint16_t opcode = read_opcode(translation, address);
+  uint16_t nnn = opcode & 0x0FFF;
+  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t kk = opcode & 0x00FF;
+  uint16_t next = address + 2;
+
+  switch (opcode & 0xF000)
+  {
+  case 0x0000:
+    if (opcode == 0x00EE)
+    {
+      fprintf(out, "  chip8->pc = chip8->stack[--chip8->sp & (STACK_DEPTH - 1)];\n  goto dispatch;\n");
+      return false;
+    }
+    emit_interpreted(out, address); // 00E0 and invalid opcodes
+    return true;
+  case 0x1000:
+    emit_goto(out, translation, nnn, 2);
+    return false;
+  case 0x2000:
+    fprintf(out, "  chip8->stack[chip8->sp++ & (STACK_DEPTH - 1)] = 0x%03X;\n", next);
+    emit_goto(out, translation, nnn, 2);
+    return false;
+  case 0x3000:
+    fprintf(out, "  if (V[0x%X] == 0x%02X)\n  {\n", x, kk);
+    emit_goto(out, translation, address + 4, 4);
+    fprintf(out, "  }\n");
+    return true;
+  case 0x4000:
+    fprintf(out, "  if (V[0x%X] != 0x%02X)\n  {\n", x, kk);
+    emit_goto(out, translation, address + 4, 4);
+    fprintf(out, "  }\n");
+    return true;
+  case 0x5000:
+    fprintf(out, "  if (V[0x%X] == V[0x%X])\n  {\n", x, y);
+    emit_goto(out, translation, address + 4, 4);
+    fprintf(out, "  }\n");
+    return true;
+  case 0x6000:
+    fprintf(out, "  V[0x%X] = 0x%02X;\n", x, kk);
+    return true;
+  case 0x7000:
+    fprintf(out, "  V[0x%X] += 0x%02X;\n", x, kk);
+    return true;
+  case 0x8000:
+    switch (opcode & 0x000F)
+    {
+    case 0x0000:
+      fprintf(out, "  V[0x%X] = V[0x%X];\n", x, y);
+      return true;
+    case 0x0001:
+      fprintf(out, "  V[0x%X] |= V[0x%X];\n", x, y);
+      return true;
+    case 0x0002:
+      fprintf(out, "  V[0x%X] &= V[0x%X];\n", x, y);
+      return true;
+    case 0x0003:
+      fprintf(out, "  V[0x%X] ^= V[0x%X];\n", x, y);
+      return true;
+    case 0x0004:
+      fprintf(out, "  {\n    uint16_t sum = V[0x%X] + V[0x%X];\n    V[0xF] = sum > 255;\n    V[0x%X] = sum & 0xFF;\n  }\n", x, y, x);
+      return true;
+    case 0x0005:
+      fprintf(out, "  V[0xF] = V[0x%X] > V[0x%X];\n  V[0x%X] -= V[0x%X];\n", x, y, x, y);
+      return true;
+    case 0x0006:
+      fprintf(out, "  V[0xF] = V[0x%X] & 0x01;\n  V[0x%X] >>= 1;\n", x, x);
+      return true;
+    case 0x0007:
+      fprintf(out, "  V[0xF] = V[0x%X] > V[0x%X];\n  V[0x%X] = V[0x%X] - V[0x%X];\n", y, x, x, y, x);
+      return true;
+    case 0x000E:
+      fprintf(out, "  V[0xF] = (V[0x%X] & 0x80) >> 7;\n  V[0x%X] <<= 1;\n", x, x);
+      return true;
+    }
+    emit_interpreted(out, address);
+    return true;
+  case 0x9000:
+    fprintf(out, "  if (V[0x%X] != V[0x%X])\n  {\n", x, y);
+    emit_goto(out, translation, address + 4, 4);
+    fprintf(out, "  }\n");
+    return true;
+  case 0xA000:
+    fprintf(out, "  chip8->index = 0x%03X;\n", nnn);
+    return true;
+  case 0xB000:
+    fprintf(out, "  chip8->pc = 0x%03X + V[0x0];\n  goto dispatch;\n", nnn);
+    return false;
+  case 0xE000:
+    if (kk == 0x9E || kk == 0xA1)
+    {
+      // keys past the keypad read as released, like in the interpreter
+      if (kk == 0x9E)
+      {
+        fprintf(out, "  if (V[0x%X] < KEY_COUNT && chip8->keypad[V[0x%X]])\n  {\n", x, x);
+      }
+      else
+      {
+        fprintf(out, "  if (V[0x%X] >= KEY_COUNT || !chip8->keypad[V[0x%X]])\n  {\n", x, x);
+      }
+      emit_goto(out, translation, address + 4, 4);
+      fprintf(out, "  }\n");
+      return true;
+    }
+    emit_interpreted(out, address);
+    return true;
+  case 0xF000:
+    switch (kk)
+    {
+    case 0x07:
+      fprintf(out, "  V[0x%X] = chip8->delay_timer;\n", x);
+      return true;
+    case 0x0A:
+      emit_interpreted(out, address); // stays on this instruction until a key is down
+      fprintf(out, "  goto dispatch;\n");
+      return false;
+    case 0x15:
+      fprintf(out, "  chip8->delay_timer = V[0x%X];\n", x);
+      return true;
+    case 0x18:
+      fprintf(out, "  chip8->sound_timer = V[0x%X];\n", x);
+      return true;
+    case 0x1E:
+      fprintf(out, "  chip8->index += V[0x%X];\n", x);
+      return true;
+    case 0x29:
+      fprintf(out, "  chip8->index = FONTSET_START_ADDRESS + (V[0x%X] * 5);\n", x);
+      return true;
+    case 0x65:
+      for (int i = 0; i <= x; ++i)
+      {
+        fprintf(out, "  V[0x%X] = chip8->memory[(chip8->index + %d) & (MEMORY_SIZE - 1)];\n", i, i);
+      }
+      return true;
+    }
+    emit_interpreted(out, address); // Fx33, Fx55 and invalid opcodes
+    return true;
+  default:
+    emit_interpreted(out, address); // Cxkk and Dxyn
+    return true;
+  }
+}
+
+/**
+ * @brief writes the generated C file
+ *
+ * @param translation pointer to translation struct, with reachable addresses found
+ * @param rom_path path to ROM, only mentioned in the header comment
+ * @param out_path path to the C file
+ * @return `0` on success, `1` on failure
+ */
+static int emit_translation(const translation_t *translation, const char *rom_path, const char *out_path)
+{
+  FILE *out = fopen(out_path, "w");
+
+  if (out == NULL)
+  {
+    LOG_ERROR("Could not open %s for writing", out_path);
+    return 1;
+  }
+
+  fprintf(out, "/* generated by chip8_aot from %s, do not edit */\n\n", rom_path);
+  fprintf(out, "#include \"cpu.h\"\n\n");
+  fprintf(out, "#define V chip8->registers\n");
+  fprintf(out, "#define OPCODE(address) (chip8->memory[address] << 8 | chip8->memory[(address) + 1])\n\n");
+  fprintf(out, "// stops before the instruction at a label if the budget ran out or memory no longer holds the translated opcode\n");
+  fprintf(out, "#define ENTER(address, opcode)                    \\\n");
+  fprintf(out, "  if (cycles == 0 || OPCODE(address) != opcode) \\\n");
+  fprintf(out, "  {                                             \\\n");
+  fprintf(out, "    chip8->pc = address;                        \\\n");
+  fprintf(out, "    return cycles;                              \\\n");
+  fprintf(out, "  }                                             \\\n");
+  fprintf(out, "  cycles--\n\n");
+
+  fprintf(out, "uint32_t chip8_aot_run(chip8_t *chip8, uint32_t cycles)\n{\n");
+  if (uses_dispatch(translation))
+  {
+    fprintf(out, "dispatch:\n");
+  }
+  fprintf(out, "  switch (chip8->pc)\n  {\n");
+  for (uint32_t address = START_ADDRESS; address < MEMORY_SIZE; ++address)
+  {
+    if (translation->reachable[address])
+    {
+      fprintf(out, "  case 0x%03X:\n    goto L_%03X;\n", address, address);
+    }
+  }
+  fprintf(out, "  default:\n    return cycles;\n  }\n");
+
+  uint32_t count = 0;
+  for (uint32_t address = START_ADDRESS; address < MEMORY_SIZE; ++address)
+  {
+    if (!translation->reachable[address])
+    {
+      continue;
+    }
+
+    fprintf(out, "\nL_%03X:\n  ENTER(0x%03X, 0x%04X);\n", address, address, read_opcode(translation, address));
+    count++;
+
+    if (!emit_instruction(out, translation, address))
+    {
+      continue;
+    }
+
+    // the next label in the file is not always the next instruction, eg. when code overlaps at odd addresses
+    uint32_t next_label = address + 1;
+    while (next_label < MEMORY_SIZE && !translation->reachable[next_label])
+    {
+      next_label++;
+    }
+    if (next_label != address + 2U)
+    {
+      emit_goto(out, translation, address + 2, 2);
+    }
+  }
+
+  fprintf(out, "}\n");
+
+  if (fclose(out) != 0)
+  {
+    LOG_ERROR("Could not write %s", out_path);
+    return 1;
+  }
+
+  fprintf(stdout, "Translated %u instructions from %s into %s\n", count, rom_path, out_path);
+  return 0;
+}
+
+/* ---------------------------------- main ---------------------------------- */
+
+int main(int argc, char **argv)
+{
+  if (argc != 3)
+  {
+    print_usage(stderr, argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  static translation_t translation; // too large for the stack on some platforms
+
+  if (load_rom(&translation, argv[1]) != 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  find_reachable(&translation);
+
+  if (emit_translation(&translation, argv[1], argv[2]) != 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,750 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "logger.h"
+
+/*
+  runs a manifest of headless jobs across all cores. each line of the manifest is
+
+    <rom_path> <instructions> <seed> [<input_script>]
+
+  and blank lines or lines starting with # are skipped. an input script has
+  one key change per line, `<instruction> <key> <1|0>`, sorted by instruction,
+  where the key is a hex digit and 1 presses it. every job gets a fresh
+  instance seeded with `seed`, so the same manifest always gives the same
+  results, whatever the number of threads
+
+  jobs are dealt out to one deque per worker. a worker takes jobs from the back
+  of its own deque and, once that is empty, steals from the front of the
+  others', so a few long jobs don't leave the other threads idle. one result
+  line per job is streamed to the output as soon as it finishes
+*/
+
+#define ARENA_BLOCK_SIZE (1 << 20) // smallest block the arena asks malloc for
+#define ARENA_ALIGNMENT 64         // cache line, so instances on different threads never share one
+#define MANIFEST_LINE_LENGTH 1024
+#define MAX_THREADS 1024           // more workers than this only adds contention
+
+/* ---------------------------------- arena --------------------------------- */
+
+typedef struct arena_block
+{
+  struct arena_block *next;
+  size_t used;
+  size_t capacity;
+  _Alignas(ARENA_ALIGNMENT) uint8_t data[];
+} arena_block_t;
+
+typedef struct arena
+{
+  arena_block_t *blocks; // newest first, allocations come from the first one
+} arena_t;
+
+/* ---------------------------------- jobs ---------------------------------- */
+
+typedef struct key_event
+{
+  uint64_t instruction; // instructions executed before the change
+  uint8_t key;
+  uint8_t down;
+} key_event_t;
+
+typedef struct rom_image
+{
+  const char *path;
+  uint8_t *data;
+  size_t size;
+} rom_image_t;
+
+typedef struct input_script
+{
+  const char *path;
+  key_event_t *events;
+  size_t length;
+} input_script_t;
+
+typedef struct job
+{
+  const rom_image_t *rom;
+  const input_script_t *script; // NULL for no input
+  uint64_t instructions;
+  uint32_t seed;
+} job_t;
+
+typedef struct manifest
+{
+  job_t *jobs;
+  size_t length;
+  size_t capacity;
+  rom_image_t *roms[256]; // distinct ROMs, each loaded once
+  size_t rom_count;
+  input_script_t *scripts[256]; // distinct input scripts, each loaded once
+  size_t script_count;
+} manifest_t;
+
+/* ---------------------------------- pool ---------------------------------- */
+
+typedef struct deque
+{
+  pthread_mutex_t lock;
+  uint32_t *jobs; // job indices
+  uint32_t front; // thieves take from here
+  uint32_t back;  // the owner takes from here
+} deque_t;
+
+struct pool;
+
+typedef struct worker
+{
+  pthread_t thread;
+  uint32_t id;
+  deque_t deque;
+  chip8_t *chip8; // instance reused for every job this worker runs
+  struct pool *pool;
+} worker_t;
+
+typedef struct pool
+{
+  worker_t *workers;
+  uint32_t worker_count;
+  const manifest_t *manifest;
+  uint32_t cpu_hz;
+  FILE *out;
+  pthread_mutex_t out_lock;
+} pool_t;
+
+/* --------------------------- function prototypes -------------------------- */
+
+static void print_usage(FILE *out, const char *program);
+static long parse_number(const char *program, const char *text, long min, long max, const char *name);
+
+static void *arena_alloc(arena_t *arena, size_t size);
+static void arena_free(arena_t *arena);
+
+static char *read_file(arena_t *arena, const char *path, size_t max_size, size_t *size);
+static const rom_image_t *find_rom(manifest_t *manifest, arena_t *arena, const char *path);
+static const input_script_t *find_script(manifest_t *manifest, arena_t *arena, const char *path);
+static int parse_manifest(manifest_t *manifest, arena_t *arena, const char *path);
+
+static bool take_job(worker_t *worker, uint32_t *job);
+static void run_job(worker_t *worker, uint32_t index);
+static void *worker_main(void *arg);
+static uint64_t hash_display(const chip8_t *chip8);
+
+/* ---------------------------- helper functions ---------------------------- */
+
+/**
+ * @brief prints available flags
+ *
+ * @param out `stdout` or `stderr`
+ * @param program program name, which is `argv[0]`
+ */
+static void print_usage(FILE *out, const char *program)
+{
+  fprintf(out, "Usage: %s [-j <threads>] [--hz <n>] [-o <results_path>] <manifest_path>\n", program);
+}
+
+/**
+ * @brief parses a whole number argument, exiting with a usage error unless it is all digits and in range
+ *
+ * @param program program name, which is `argv[0]`
+ * @param text the argument
+ * @param min smallest value accepted
+ * @param max largest value accepted
+ * @param name what the number is, for the error message
+ * @return the number
+ */
+static long parse_number(const char *program, const char *text, long min, long max, const char *name)
+{
+  char *end;
+  errno = 0;
+  long value = strtol(text, &end, 10);
+
+  if (end == text || *end != '\0' || errno == ERANGE || value < min || value > max)
+  {
+    fprintf(stderr, "%s must be a whole number from %ld to %ld\n", name, min, max);
+    print_usage(stderr, program);
+    exit(EXIT_FAILURE);
+  }
+  return value;
+}
+
+/**
+ * @brief allocates from the arena, adding a block when the current one is full
+ *
+ * everything allocated lives until `arena_free`, so there is no per-allocation free
+ *
+ * @param arena pointer to arena struct
+ * @param size number of bytes
+ * @return zeroed memory aligned to ARENA_ALIGNMENT, `NULL` on failure
+ */
+static void *arena_alloc(arena_t *arena, size_t size)
+{
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  arena_block_t *block = arena->blocks;
+  if (block == NULL || block->capacity - block->used < size)
+  {
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+    block = aligned_alloc(ARENA_ALIGNMENT, sizeof(arena_block_t) + capacity);
+    if (block == NULL)
+    {
+      LOG_ERROR("Could not allocate %zu bytes", capacity);
+      return NULL;
+    }
+
+    block->next = arena->blocks;
+    block->used = 0;
+    block->capacity = capacity;
+    arena->blocks = block;
+  }
+
+  void *memory = &block->data[block->used];
+  block->used += size;
+
+  memset(memory, 0, size);
+  return memory;
+}
+
+/**
+ * @brief frees every block of the arena
+ *
+ * @param arena pointer to arena struct
+ */
+static void arena_free(arena_t *arena)
+{
+  while (arena->blocks != NULL)
+  {
+    arena_block_t *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+}
+
+/**
+ * @brief reads a whole file into the arena, with a terminating 0 byte after it
+ *
+ * @param arena pointer to arena struct
+ * @param path path to file
+ * @param max_size largest file accepted
+ * @param size set to the number of bytes read
+ * @return the contents, `NULL` on failure
+ */
+static char *read_file(arena_t *arena, const char *path, size_t max_size, size_t *size)
+{
+  FILE *file = fopen(path, "rb");
+
+  if (file == NULL)
+  {
+    LOG_ERROR("Could not open %s", path);
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long file_size = ftell(file); // size of file in bytes
+  rewind(file);
+
+  if (file_size < 0 || (size_t)file_size > max_size)
+  {
+    LOG_ERROR("%s is too large", path);
+    fclose(file);
+    return NULL;
+  }
+
+  char *contents = arena_alloc(arena, (size_t)file_size + 1);
+  if (contents == NULL || fread(contents, 1, file_size, file) != (size_t)file_size)
+  {
+    LOG_ERROR("Failed to read from %s", path);
+    fclose(file);
+    return NULL;
+  }
+
+  fclose(file);
+
+  *size = (size_t)file_size;
+  return contents;
+}
+
+/**
+ * @brief returns the ROM at a path, loading it the first time a job uses it
+ *
+ * @return the ROM, `NULL` on failure
+ */
+static const rom_image_t *find_rom(manifest_t *manifest, arena_t *arena, const char *path)
+{
+  for (size_t i = 0; i < manifest->rom_count; ++i)
+  {
+    if (strcmp(manifest->roms[i]->path, path) == 0)
+    {
+      return manifest->roms[i];
+    }
+  }
+
+  if (manifest->rom_count == sizeof(manifest->roms) / sizeof(manifest->roms[0]))
+  {
+    LOG_ERROR("Too many different ROMs in the manifest");
+    return NULL;
+  }
+
+  rom_image_t *rom = arena_alloc(arena, sizeof(rom_image_t));
+  char *rom_path = arena_alloc(arena, strlen(path) + 1);
+  if (rom == NULL || rom_path == NULL)
+  {
+    return NULL;
+  }
+
+  rom->path = strcpy(rom_path, path);
+  rom->data = (uint8_t *)read_file(arena, path, MEMORY_SIZE - START_ADDRESS, &rom->size);
+  if (rom->data == NULL)
+  {
+    return NULL;
+  }
+
+  manifest->roms[manifest->rom_count++] = rom;
+  return rom;
+}
+
+/**
+ * @brief returns the input script at a path, loading it the first time a job uses it
+ *
+ * @return the script, `NULL` on failure
+ */
+static const input_script_t *find_script(manifest_t *manifest, arena_t *arena, const char *path)
+{
+  for (size_t i = 0; i < manifest->script_count; ++i)
+  {
+    if (strcmp(manifest->scripts[i]->path, path) == 0)
+    {
+      return manifest->scripts[i];
+    }
+  }
+
+  if (manifest->script_count == sizeof(manifest->scripts) / sizeof(manifest->scripts[0]))
+  {
+    LOG_ERROR("Too many different input scripts in the manifest");
+    return NULL;
+  }
+
+  size_t size;
+  char *text = read_file(arena, path, (size_t)1 << 30, &size);
+  input_script_t *script = arena_alloc(arena, sizeof(input_script_t));
+  char *script_path = arena_alloc(arena, strlen(path) + 1);
+  if (text == NULL || script == NULL || script_path == NULL)
+  {
+    return NULL;
+  }
+
+  // every event needs at least 6 bytes of text, which bounds how many there can be
+  script->path = strcpy(script_path, path);
+  script->events = arena_alloc(arena, (size / 6 + 1) * sizeof(key_event_t));
+  if (script->events == NULL)
+  {
+    return NULL;
+  }
+
+  uint64_t last = 0;
+  for (char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n"))
+  {
+    uint64_t instruction;
+    unsigned key, down;
+
+    if (line[0] == '#' || line[strspn(line, " \t\r")] == '\0')
+    {
+      continue;
+    }
+
+    if (sscanf(line, "%" SCNu64 " %x %u", &instruction, &key, &down) != 3 || key >= KEY_COUNT || down > 1 ||
+        instruction < last)
+    {
+      LOG_ERROR("%s: bad key event \"%s\", expected <instruction> <key> <1|0> in instruction order", path, line);
+      return NULL;
+    }
+
+    script->events[script->length++] = (key_event_t){.instruction = instruction, .key = key, .down = down};
+    last = instruction;
+  }
+
+  manifest->scripts[manifest->script_count++] = script;
+  return script;
+}
+
+/**
+ * @brief reads the manifest, along with every ROM and input script it names
+ *
+ * @param manifest pointer to manifest struct, empty
+ * @param arena pointer to arena struct, for the ROMs and scripts
+ * @param path path to manifest
+ * @return `0` on success, `1` on failure
+ */
+static int parse_manifest(manifest_t *manifest, arena_t *arena, const char *path)
+{
+  FILE *file = fopen(path, "r");
+
+  if (file == NULL)
+  {
+    LOG_ERROR("Could not open %s", path);
+    return 1;
+  }
+
+  char line[MANIFEST_LINE_LENGTH];
+  int line_number = 0;
+
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    line_number++;
+
+    char rom_path[MANIFEST_LINE_LENGTH];
+    char script_path[MANIFEST_LINE_LENGTH];
+    uint64_t instructions;
+    uint32_t seed;
+
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+    {
+      continue;
+    }
+
+    int fields = sscanf(line, "%1023s %" SCNu64 " %" SCNu32 " %1023s", rom_path, &instructions, &seed, script_path);
+    if (fields < 3)
+    {
+      LOG_ERROR("%s:%d: expected <rom_path> <instructions> <seed> [<input_script>]", path, line_number);
+      fclose(file);
+      return 1;
+    }
+
+    if (manifest->length == manifest->capacity)
+    {
+      manifest->capacity = manifest->capacity == 0 ? 64 : manifest->capacity * 2;
+      job_t *jobs = realloc(manifest->jobs, manifest->capacity * sizeof(job_t));
+      if (jobs == NULL)
+      {
+        LOG_ERROR("Could not allocate the job list");
+        fclose(file);
+        return 1;
+      }
+      manifest->jobs = jobs;
+    }
+
+    job_t *job = &manifest->jobs[manifest->length];
+    job->rom = find_rom(manifest, arena, rom_path);
+    job->script = fields == 4 ? find_script(manifest, arena, script_path) : NULL;
+    job->instructions = instructions;
+    job->seed = seed;
+
+    if (job->rom == NULL || (fields == 4 && job->script == NULL))
+    {
+      fclose(file);
+      return 1;
+    }
+
+    manifest->length++;
+  }
+
+  fclose(file);
+  return 0;
+}
+
+/* ------------------------------ work stealing ----------------------------- */
+
+/**
+ * @brief takes the next job from the worker's own deque, or steals one from another worker
+ *
+ * no jobs are added once the workers start, so when every deque is empty the batch is done
+ *
+ * @param worker pointer to worker struct
+ * @param job set to the index of the job taken
+ * @return `true` if a job was taken, `false` when there are none left
+ */
+static bool take_job(worker_t *worker, uint32_t *job)
+{
+  pool_t *pool = worker->pool;
+
+  for (uint32_t i = 0; i < pool->worker_count; ++i)
+  {
+    worker_t *victim = &pool->workers[(worker->id + i) % pool->worker_count];
+    deque_t *deque = &victim->deque;
+    bool taken = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->front != deque->back)
+    {
+      // the owner works from the back, in the order jobs were dealt out. thieves take the
+      // front, which the owner would have got to last
+      *job = victim == worker ? deque->jobs[--deque->back] : deque->jobs[deque->front++];
+      taken = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if (taken)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @brief FNV-1a hash of the display
+ *
+ * @param chip8 pointer to chip8 struct
+ * @return the hash
+ */
+static uint64_t hash_display(const chip8_t *chip8)
+{
+  uint64_t hash = 14695981039346656037u;
+
+  for (int row = 0; row < DISPLAY_HEIGHT; ++row)
+  {
+    for (int byte = 0; byte < 8; ++byte)
+    {
+      hash = (hash ^ (uint8_t)(chip8->display[row] >> (8 * byte))) * 1099511628211u;
+    }
+  }
+  return hash;
+}
+
+/**
+ * @brief runs one job on the worker's instance and writes its result line
+ *
+ * the timers tick once per 60Hz frame of `cpu_hz / 60` instructions, the same
+ * way `chip8 --headless --hz <cpu_hz>` runs, and key changes land on exactly
+ * the instruction the script gives
+ *
+ * @param worker pointer to worker struct
+ * @param index index of the job in the manifest
+ */
+static void run_job(worker_t *worker, uint32_t index)
+{
+  pool_t *pool = worker->pool;
+  const job_t *job = &pool->manifest->jobs[index];
+  chip8_t *chip8 = worker->chip8;
+
+  const chip8_config_t config = {
+      .cpu_hz = pool->cpu_hz,
+  };
+
+  if (chip8_initialise(chip8, &config) != 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+  chip8_load_rom_data(chip8, job->rom->data, job->rom->size);
+  chip8_seed(chip8, job->seed);
+
+  size_t next_event = 0;
+  size_t event_count = job->script != NULL ? job->script->length : 0;
+  uint64_t executed = 0;
+
+  while (executed < job->instructions)
+  {
+    while (next_event < event_count && job->script->events[next_event].instruction <= executed)
+    {
+      const key_event_t *event = &job->script->events[next_event++];
+      chip8->keypad[event->key] = event->down;
+    }
+
+    // the core ticks the timers itself, runs are only split where a key changes
+    uint64_t stop = job->instructions;
+    if (next_event < event_count && job->script->events[next_event].instruction < stop)
+    {
+      stop = job->script->events[next_event].instruction;
+    }
+
+    chip8_run_timed(chip8, stop - executed);
+    executed = stop;
+  }
+
+  char registers[2 * REGISTER_COUNT + 1];
+  for (int i = 0; i < REGISTER_COUNT; ++i)
+  {
+    snprintf(&registers[2 * i], 3, "%02X", chip8->registers[i]);
+  }
+
+  pthread_mutex_lock(&pool->out_lock);
+  fprintf(pool->out, "%" PRIu32 "\t%s\t%" PRIu32 "\t%" PRIu64 "\t%016" PRIX64 "\t%03X\t%03X\t%s\n", index,
+          job->rom->path, job->seed, executed, hash_display(chip8), chip8->pc, chip8->index, registers);
+  fflush(pool->out);
+  pthread_mutex_unlock(&pool->out_lock);
+
+  chip8_release(chip8);
+}
+
+/**
+ * @brief thread entry point, runs jobs until there are none left anywhere
+ *
+ * @param arg pointer to worker struct
+ * @return `NULL`
+ */
+static void *worker_main(void *arg)
+{
+  worker_t *worker = arg;
+  uint32_t job;
+
+  while (take_job(worker, &job))
+  {
+    run_job(worker, job);
+  }
+  return NULL;
+}
+
+/* ---------------------------------- main ---------------------------------- */
+
+int main(int argc, char **argv)
+{
+  const char *program = argv[0];
+  const char *manifest_path = NULL;
+  const char *out_path = NULL;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t cpu_hz = CHIP8_DEFAULT_CPU_HZ;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+    {
+      threads = parse_number(program, argv[++i], 1, MAX_THREADS, "Thread count");
+      continue;
+    }
+
+    if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc)
+    {
+      cpu_hz = (uint32_t)parse_number(program, argv[++i], CHIP8_TIMER_HZ, INT32_MAX, "Instruction rate");
+      continue;
+    }
+
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+    {
+      out_path = argv[++i];
+      continue;
+    }
+
+    if (argv[i][0] == '-' || manifest_path != NULL)
+    {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      print_usage(stderr, program);
+      exit(EXIT_FAILURE);
+    }
+
+    manifest_path = argv[i];
+  }
+
+  if (manifest_path == NULL)
+  {
+    fprintf(stderr, "Manifest path not provided\n");
+    print_usage(stderr, program);
+    exit(EXIT_FAILURE);
+  }
+
+  if (threads < 1)
+  {
+    threads = 1; // sysconf couldn't tell
+  }
+  else if (threads > MAX_THREADS)
+  {
+    threads = MAX_THREADS;
+  }
+
+  arena_t arena = {0};
+  manifest_t manifest = {0};
+
+  if (parse_manifest(&manifest, &arena, manifest_path) != 0)
+  {
+    arena_free(&arena);
+    free(manifest.jobs);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((size_t)threads > manifest.length)
+  {
+    threads = manifest.length > 0 ? (long)manifest.length : 1;
+  }
+
+  pool_t pool = {
+      .worker_count = (uint32_t)threads,
+      .manifest = &manifest,
+      .cpu_hz = cpu_hz,
+      .out = out_path != NULL ? fopen(out_path, "w") : stdout,
+  };
+
+  if (pool.out == NULL)
+  {
+    LOG_ERROR("Could not open %s for writing", out_path);
+    arena_free(&arena);
+    free(manifest.jobs);
+    exit(EXIT_FAILURE);
+  }
+
+  // one instance per worker, allocated up front and reused for each job it runs
+  pool.workers = arena_alloc(&arena, pool.worker_count * sizeof(worker_t));
+  uint32_t *deque_jobs = arena_alloc(&arena, (manifest.length + 1) * sizeof(uint32_t));
+  if (pool.workers == NULL || deque_jobs == NULL)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  // deal contiguous runs of jobs to each worker, reversed so its own jobs run in manifest order
+  uint32_t dealt = 0;
+  for (uint32_t id = 0; id < pool.worker_count; ++id)
+  {
+    worker_t *worker = &pool.workers[id];
+    uint32_t share = (uint32_t)((manifest.length * (id + 1)) / pool.worker_count) - dealt;
+
+    worker->id = id;
+    worker->pool = &pool;
+    worker->chip8 = arena_alloc(&arena, sizeof(chip8_t));
+    if (worker->chip8 == NULL)
+    {
+      exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&worker->deque.lock, NULL);
+    worker->deque.jobs = &deque_jobs[dealt];
+    worker->deque.front = 0;
+    worker->deque.back = share;
+    for (uint32_t i = 0; i < share; ++i)
+    {
+      worker->deque.jobs[i] = dealt + share - 1 - i;
+    }
+    dealt += share;
+  }
+
+  pthread_mutex_init(&pool.out_lock, NULL);
+  fprintf(pool.out, "# job\trom\tseed\tinstructions\tdisplay_hash\tpc\tindex\tregisters\n");
+
+  for (uint32_t id = 0; id < pool.worker_count; ++id)
+  {
+    if (pthread_create(&pool.workers[id].thread, NULL, worker_main, &pool.workers[id]) != 0)
+    {
+      LOG_ERROR("Could not start worker thread %" PRIu32, id);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (uint32_t id = 0; id < pool.worker_count; ++id)
+  {
+    pthread_join(pool.workers[id].thread, NULL);
+  }
+
+  // only once every worker has stopped, since any of them may still be stealing from any deque
+  for (uint32_t id = 0; id < pool.worker_count; ++id)
+  {
+    pthread_mutex_destroy(&pool.workers[id].deque.lock);
+  }
+
+  pthread_mutex_destroy(&pool.out_lock);
+  if (pool.out != stdout)
+  {
+    fclose(pool.out);
+  }
+
+  fprintf(stderr, "Ran %zu jobs on %" PRIu32 " threads\n", manifest.length, pool.worker_count);
+
+  arena_free(&arena);
+  free(manifest.jobs);
+  return EXIT_SUCCESS;
+}
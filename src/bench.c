@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "cpu.h"
+#include "lockstep.h"
+
+/*
+  throughput benchmark for the core. runs each ROM for a fixed number of
+  instructions, in 60Hz sized frames with the timers ticking and a fixed
+  pattern of key presses, and reports instructions per second over several
+  repetitions. no window, audio or real time pacing is involved, so runs of
+  different dispatch modes, compilers or flags can be compared directly
+*/
+
+#ifndef CHIP8_ROMS_DIR
+#define CHIP8_ROMS_DIR "roms"
+#endif
+
+#define DEFAULT_CYCLES 20000000
+#define DEFAULT_REPETITIONS 5
+#define DEFAULT_CYCLES_PER_FRAME 1000
+#define MAX_REPETITIONS 100
+#define KEY_PERIOD 30   // frames between key presses
+#define KEY_HOLD 10     // frames each key is held down for
+#define RAND_SEED 1     // Cxkk gets the same numbers on every run, instance i is seeded with RAND_SEED + i
+
+static const char *const default_roms[] = {
+    "PONG.ch8",
+    "TETRIS.ch8",
+    "TANK.ch8",
+    "corax_test.ch8",
+    "ibm_logo.ch8",
+};
+
+typedef struct bench_options
+{
+  uint64_t cycles;           // instructions per repetition, shared between the instances
+  int repetitions;           // runs per ROM
+  uint32_t cycles_per_frame; // instructions between timer ticks and key changes
+  uint32_t lanes;            // instances of the ROM run side by side
+  bool jit;                  // run through the jit, needs a build with CHIP8_JIT
+  bool lockstep;             // run the instances in the lockstep engine instead of one by one
+} bench_options_t;
+
+typedef struct bench_result
+{
+  double seconds;         // wall time of the run
+  uint64_t instructions;  // instructions executed by all instances together
+  uint32_t checksum;      // hash of the final machine state, identical across builds if behaviour is
+} bench_result_t;
+
+/* --------------------------- function prototypes -------------------------- */
+
+static void print_usage(FILE *out, const char *program);
+static uint64_t now_ns(void);
+static uint32_t hash_state(const chip8_t *chip8);
+static uint32_t combine_hashes(uint32_t hash, uint32_t instance_hash);
+static int scripted_key(uint64_t frame);
+static void press_scripted_keys(chip8_t *chip8, uint64_t frame);
+static int run_once(const char *rom_path, const bench_options_t *options, bench_result_t *result);
+static int run_lockstep(const chip8_t *loaded, const bench_options_t *options, bench_result_t *result);
+static int compare_doubles(const void *a, const void *b);
+static int bench_rom(const char *rom_path, const bench_options_t *options);
+
+/* ---------------------------- helper functions ---------------------------- */
+
+/**
+ * @brief prints available flags
+ *
+ * @param out `stdout` or `stderr`
+ * @param program program name, which is `argv[0]`
+ */
+static void print_usage(FILE *out, const char *program)
+{
+  fprintf(out, "Usage: %s [--cycles <n>] [--reps <n>] [--ipf <n>] [--lanes <n>] [--lockstep] [--jit] [rom_path...]\n",
+          program);
+}
+
+/**
+ * @brief reads a monotonic clock
+ *
+ * @return the time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+  struct timespec now;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+  timespec_get(&now, TIME_UTC);
+#endif
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**
+ * @brief FNV-1a hash of everything an instruction can change
+ *
+ * @param chip8 pointer to chip8 struct
+ * @return the hash
+ */
+static uint32_t hash_state(const chip8_t *chip8)
+{
+  uint32_t hash = 2166136261u;
+
+#define HASH_BYTES(field)                                      \
+  for (size_t i = 0; i < sizeof(field); ++i)                   \
+  {                                                            \
+    hash = (hash ^ ((const uint8_t *)&(field))[i]) * 16777619u; \
+  }
+  HASH_BYTES(chip8->memory)
+  HASH_BYTES(chip8->registers)
+  HASH_BYTES(chip8->index)
+  HASH_BYTES(chip8->pc)
+  HASH_BYTES(chip8->stack)
+  HASH_BYTES(chip8->sp)
+  HASH_BYTES(chip8->display)
+  HASH_BYTES(chip8->delay_timer)
+  HASH_BYTES(chip8->sound_timer)
+#undef HASH_BYTES
+
+  return hash;
+}
+
+/**
+ * @brief folds the hash of one more instance into the hash of a run
+ *
+ * @param hash hash of the instances so far
+ * @param instance_hash hash of the next instance
+ * @return the combined hash
+ */
+static uint32_t combine_hashes(uint32_t hash, uint32_t instance_hash)
+{
+  return (hash ^ instance_hash) * 16777619u;
+}
+
+/**
+ * @brief holds one key down for KEY_HOLD frames out of every KEY_PERIOD, going through all 16 in turn
+ *
+ * @param frame frames run so far
+ * @return the key held down during `frame`, `-1` for none
+ */
+static int scripted_key(uint64_t frame)
+{
+  return frame % KEY_PERIOD < KEY_HOLD ? (int)((frame / KEY_PERIOD) % KEY_COUNT) : -1;
+}
+
+/**
+ * @brief sets the keypad to the scripted keys of a frame
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param frame frames run so far
+ */
+static void press_scripted_keys(chip8_t *chip8, uint64_t frame)
+{
+  int key = scripted_key(frame);
+
+  memset(chip8->keypad, 0, sizeof(chip8->keypad));
+  if (key >= 0)
+  {
+    chip8->keypad[key] = 1;
+  }
+}
+
+/**
+ * @brief loads a ROM into `options->lanes` fresh machines and times them for `options->cycles` instructions
+ *
+ * the instances are stepped one after another, a frame each at a time
+ *
+ * @param rom_path path to ROM
+ * @param options benchmark options
+ * @param result filled with the run's time and final state hash
+ * @return `0` on success, `1` on failure
+ */
+static int run_once(const char *rom_path, const bench_options_t *options, bench_result_t *result)
+{
+  chip8_t *instances = malloc(options->lanes * sizeof(chip8_t)); // too large for the stack on some platforms
+
+  if (instances == NULL)
+  {
+    fprintf(stderr, "Could not allocate %" PRIu32 " instances\n", options->lanes);
+    return 1;
+  }
+
+  if (chip8_initialise(&instances[0], NULL) != 0 || chip8_load_rom(&instances[0], rom_path) != 0)
+  {
+    chip8_release(&instances[0]);
+    free(instances);
+    return 1;
+  }
+  if (options->lockstep)
+  {
+    int status = run_lockstep(&instances[0], options, result);
+    chip8_release(&instances[0]);
+    free(instances);
+    return status;
+  }
+
+  // every lane loads what the first one read, each instance keeps its own caches
+  uint32_t ready = 1;
+  bool failed = false;
+  for (; ready < options->lanes && !failed; ++ready)
+  {
+    failed = chip8_initialise(&instances[ready], NULL) != 0 ||
+             chip8_load_rom_data(&instances[ready], &instances[0].memory[START_ADDRESS], MEMORY_SIZE - START_ADDRESS) != 0;
+  }
+  for (uint32_t i = 0; i < ready && !failed; ++i)
+  {
+    chip8_seed(&instances[i], RAND_SEED + i);
+    failed = options->jit && chip8_jit_enable(&instances[i]) != 0;
+  }
+  if (failed)
+  {
+    for (uint32_t i = 0; i < ready; ++i)
+    {
+      chip8_release(&instances[i]);
+    }
+    free(instances);
+    return 1;
+  }
+
+  const uint64_t instance_cycles = options->cycles / options->lanes;
+  uint64_t cycles = 0;
+  uint64_t frame = 0;
+  const uint64_t start = now_ns();
+
+  while (cycles < instance_cycles)
+  {
+    uint64_t frame_cycles = instance_cycles - cycles;
+    if (frame_cycles > options->cycles_per_frame)
+    {
+      frame_cycles = options->cycles_per_frame;
+    }
+
+    for (uint32_t i = 0; i < options->lanes; ++i)
+    {
+      chip8_t *chip8 = &instances[i];
+
+      press_scripted_keys(chip8, frame);
+      chip8_run(chip8, (uint32_t)frame_cycles);
+
+      if (chip8->delay_timer > 0)
+      {
+        chip8->delay_timer--;
+      }
+      if (chip8->sound_timer > 0)
+      {
+        chip8->sound_timer--;
+      }
+    }
+
+    cycles += frame_cycles;
+    frame++;
+  }
+
+  const uint64_t end = now_ns();
+
+  result->seconds = (double)(end - start) / 1e9;
+  result->instructions = instance_cycles * options->lanes;
+  result->checksum = hash_state(&instances[0]);
+  for (uint32_t i = 0; i < options->lanes; ++i)
+  {
+    if (i > 0)
+    {
+      result->checksum = combine_hashes(result->checksum, hash_state(&instances[i]));
+    }
+    chip8_release(&instances[i]);
+  }
+
+  free(instances);
+  return 0;
+}
+
+/**
+ * @brief same as `run_once`, with every instance stepped together in the lockstep engine
+ *
+ * @param loaded a machine with the ROM loaded, copied into every lane
+ * @param options benchmark options
+ * @param result filled with the run's time and final state hash
+ * @return `0` on success, `1` on failure
+ */
+static int run_lockstep(const chip8_t *loaded, const bench_options_t *options, bench_result_t *result)
+{
+  lockstep_t *lockstep = lockstep_create(options->lanes);
+  chip8_t *lane_state = malloc(sizeof(chip8_t));
+
+  if (lockstep == NULL || lane_state == NULL ||
+      lockstep_load_rom(lockstep, &loaded->memory[START_ADDRESS], MEMORY_SIZE - START_ADDRESS) != 0)
+  {
+    lockstep_destroy(lockstep);
+    free(lane_state);
+    return 1;
+  }
+
+  for (uint32_t lane = 0; lane < options->lanes; ++lane)
+  {
+    lockstep->rand_state[lane] = chip8_seed_state(RAND_SEED + lane);
+  }
+
+  const uint64_t instance_cycles = options->cycles / options->lanes;
+  uint64_t cycles = 0;
+  uint64_t frame = 0;
+  const uint64_t start = now_ns();
+
+  while (cycles < instance_cycles)
+  {
+    uint64_t frame_cycles = instance_cycles - cycles;
+    if (frame_cycles > options->cycles_per_frame)
+    {
+      frame_cycles = options->cycles_per_frame;
+    }
+
+    int key = scripted_key(frame);
+    for (int k = 0; k < KEY_COUNT; ++k)
+    {
+      memset(lockstep->keypad[k], k == key, options->lanes);
+    }
+
+    lockstep_run(lockstep, (uint32_t)frame_cycles);
+    lockstep_tick_timers(lockstep);
+
+    cycles += frame_cycles;
+    frame++;
+  }
+
+  const uint64_t end = now_ns();
+
+  result->seconds = (double)(end - start) / 1e9;
+  result->instructions = instance_cycles * options->lanes;
+  if (chip8_initialise(lane_state, NULL) != 0)
+  {
+    lockstep_destroy(lockstep);
+    free(lane_state);
+    return 1;
+  }
+  lockstep_get_lane(lockstep, 0, lane_state);
+  result->checksum = hash_state(lane_state);
+  for (uint32_t lane = 1; lane < options->lanes; ++lane)
+  {
+    lockstep_get_lane(lockstep, lane, lane_state);
+    result->checksum = combine_hashes(result->checksum, hash_state(lane_state));
+  }
+
+  lockstep_destroy(lockstep);
+  chip8_release(lane_state);
+  free(lane_state);
+  return 0;
+}
+
+/**
+ * @brief orders doubles ascending, for `qsort`
+ */
+static int compare_doubles(const void *a, const void *b)
+{
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+/**
+ * @brief runs one ROM `options->repetitions` times and prints a line of results
+ *
+ * @param rom_path path to ROM
+ * @param options benchmark options
+ * @return `0` on success, `1` on failure
+ */
+static int bench_rom(const char *rom_path, const bench_options_t *options)
+{
+  double ips[MAX_REPETITIONS];
+  uint32_t checksum = 0;
+
+  for (int rep = 0; rep < options->repetitions; ++rep)
+  {
+    bench_result_t result;
+    if (run_once(rom_path, options, &result) != 0)
+    {
+      return 1;
+    }
+
+    if (rep > 0 && result.checksum != checksum)
+    {
+      fprintf(stderr, "%s: state differs between repetitions, the benchmark is not deterministic\n", rom_path);
+      return 1;
+    }
+    checksum = result.checksum;
+
+    ips[rep] = result.seconds > 0 ? (double)result.instructions / result.seconds : 0.0;
+  }
+
+  qsort(ips, options->repetitions, sizeof(double), compare_doubles);
+
+  double min = ips[0];
+  double median = ips[options->repetitions / 2];
+  double max = ips[options->repetitions - 1];
+
+  const char *name = strrchr(rom_path, '/');
+  name = name != NULL ? name + 1 : rom_path;
+
+  fprintf(stdout, "%-16s %10.2f %10.2f %10.2f %10.3f   %08" PRIX32 "\n", name, min / 1e6, median / 1e6, max / 1e6,
+          median > 0 ? 1e9 / median : 0.0, checksum);
+  return 0;
+}
+
+/* ---------------------------------- main ---------------------------------- */
+
+int main(int argc, char **argv)
+{
+  const char *program = argv[0];
+  bench_options_t options = {
+      .cycles = DEFAULT_CYCLES,
+      .repetitions = DEFAULT_REPETITIONS,
+      .cycles_per_frame = DEFAULT_CYCLES_PER_FRAME,
+      .lanes = 1,
+      .jit = false,
+      .lockstep = false,
+  };
+  const char *roms[64];
+  int rom_count = 0;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+    {
+      options.cycles = strtoull(argv[++i], NULL, 10);
+      continue;
+    }
+
+    if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+    {
+      options.repetitions = atoi(argv[++i]);
+      if (options.repetitions < 1 || options.repetitions > MAX_REPETITIONS)
+      {
+        fprintf(stderr, "Repetitions must be between 1 and %d\n", MAX_REPETITIONS);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)
+    {
+      options.cycles_per_frame = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (options.cycles_per_frame == 0)
+      {
+        fprintf(stderr, "Instructions per frame must be at least 1\n");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc)
+    {
+      options.lanes = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (options.lanes == 0)
+      {
+        fprintf(stderr, "Lanes must be at least 1\n");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--lockstep") == 0)
+    {
+      options.lockstep = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--jit") == 0)
+    {
+      options.jit = true;
+      continue;
+    }
+
+    if (argv[i][0] == '-' || rom_count == (int)(sizeof(roms) / sizeof(roms[0])))
+    {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      print_usage(stderr, program);
+      exit(EXIT_FAILURE);
+    }
+
+    roms[rom_count++] = argv[i];
+  }
+
+  if (options.lockstep && options.jit)
+  {
+    fprintf(stderr, "--lockstep and --jit can't be used together\n");
+    exit(EXIT_FAILURE);
+  }
+  if (options.cycles / options.lanes == 0)
+  {
+    fprintf(stderr, "Every lane needs at least 1 instruction, raise --cycles\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // without ROMs on the command line, run the ones shipped in roms/
+  static char default_paths[sizeof(default_roms) / sizeof(default_roms[0])][512];
+  if (rom_count == 0)
+  {
+    for (size_t i = 0; i < sizeof(default_roms) / sizeof(default_roms[0]); ++i)
+    {
+      snprintf(default_paths[i], sizeof(default_paths[i]), "%s/%s", CHIP8_ROMS_DIR, default_roms[i]);
+      roms[rom_count++] = default_paths[i];
+    }
+  }
+
+  fprintf(stdout, "%" PRIu64 " instructions per run, %d runs per ROM, %" PRIu32 " instructions per frame%s\n",
+          options.cycles, options.repetitions, options.cycles_per_frame, options.jit ? ", jit" : "");
+  if (options.lanes > 1 || options.lockstep)
+  {
+    fprintf(stdout, "%" PRIu32 " instances per ROM, %s\n", options.lanes,
+            options.lockstep ? "stepped together in the lockstep engine" : "stepped one by one");
+  }
+  fprintf(stdout, "\n");
+  fprintf(stdout, "%-16s %10s %10s %10s %10s   %s\n", "rom", "min MIPS", "median", "max", "ns/instr", "state");
+
+  for (int i = 0; i < rom_count; ++i)
+  {
+    if (bench_rom(roms[i], &options) != 0)
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
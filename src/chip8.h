@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+  public header of the chip8core library, all a program embedding the
+  emulator needs to include. the core has no SDL dependency and reads no
+  process-wide settings: each chip8_t carries its own `config`, and instances
+  share nothing. windowing, audio, pacing and command line flags are left to
+  the program, see main.c
+*/
+
+#include "cpu.h"      // the machine: initialising, loading ROMs, running, seeding, save states, jit and profiler
+#include "trace.h"    // recording executed instructions, attach one to `chip8_t.trace`
+#include "rewind.h"   // per-frame history of a machine, to step back through
+#include "movie.h"    // recording and loading keypad changes keyed by instruction count
+#include "lockstep.h" // many instances of one ROM stepped together
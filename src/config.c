@@ -1,9 +1,25 @@
 #include "config.h"
+#include "rewind.h"
+#include <stddef.h>
 
 config_t g_config = {
     .verbose_logging = false,
     .window_scale = 10,
-    .cycle_delay = 1,
+    .cpu_hz = 700,
+    .headless = false,
+    .max_cycles = 0,
+    .max_frames = 0,
+    .jit = false,
+    .seeded = false,
+    .seed = 0,
+    .trace_path = NULL,
+    .profile_path = NULL,
+    .profile_timed = false,
+    .rewind_budget = REWIND_DEFAULT_BUDGET,
+    .record_path = NULL,
+    .replay_path = NULL,
+    .audio_buffer = 512,
+    .vsync = false,
     .bg_color = {
         .r = 0,
         .g = 0,
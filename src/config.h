@@ -1,6 +1,7 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct Color
 {
@@ -14,7 +15,21 @@ typedef struct config
 {
   bool verbose_logging;
   int window_scale;
-  int cycle_delay;
+  int cpu_hz; // instructions executed per second, spread over 60 frames
+  bool headless;       // run without window, renderer or audio
+  uint64_t max_cycles; // headless only: stop after this many instructions, 0 for no limit
+  uint64_t max_frames; // headless only: stop after this many 60Hz frames, 0 for no limit
+  bool jit;            // run basic blocks as native code, needs a build with CHIP8_JIT
+  bool seeded;         // seed Cxkk's generator with `seed` instead of the clock
+  uint32_t seed;       // seed for Cxkk's generator when `seeded` is set
+  const char *trace_path; // record executed instructions and write them here on exit, NULL to not trace
+  const char *profile_path; // count executions per opcode and address and write them here as JSON on exit, NULL to not profile
+  bool profile_timed;       // also time each opcode handler while profiling
+  size_t rewind_budget;     // bytes of rewind history kept in the window, 0 to turn rewinding off
+  const char *record_path;  // write the run's keypad changes here as a movie, NULL to not record
+  const char *replay_path;  // run headless, feeding in the keypad changes of this movie, NULL to not replay
+  int audio_buffer;         // samples per audio device buffer, a power of 2. smaller is less latency
+  bool vsync;               // present frames in step with the display's refresh rather than sleeping between them
   color_t bg_color;
   color_t fg_color;
 } config_t;
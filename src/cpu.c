@@ -1,319 +1,1868 @@
 #include "logger.h"
 #include "cpu.h"
+#include "trace.h"
+#ifdef CHIP8_JIT
+#include "jit.h"
+#endif
+#ifdef CHIP8_PROFILE
+#include "profile.h"
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <stdbool.h>
+
+#define STATE_MAGIC "C8ST"
+#define STATE_MAGIC_SIZE 4
+#define STATE_RUN_GAP 4 // unchanged bytes stored to join two runs of changed ones, cheaper than another run header
+#define STATE_HEADER_SIZE (STATE_MAGIC_SIZE + 1 + 4)
+#define STATE_MACHINE_SIZE (REGISTER_COUNT + 2 + 2 + 1 + 2 * STACK_DEPTH + 1 + 1 + 4 + 4 + 1 + 2)
+#define STATE_LARGEST_MEMORY (2 + 2 + 2 + MEMORY_SIZE)      // run count and a single run covering all of memory
+#define STATE_LARGEST_DISPLAY (4 + 8 * DISPLAY_HEIGHT)      // row mask and every row
+_Static_assert(STATE_HEADER_SIZE + STATE_MACHINE_SIZE + STATE_LARGEST_MEMORY + STATE_LARGEST_DISPLAY <=
+                   CHIP8_STATE_MAX_SIZE,
+               "CHIP8_STATE_MAX_SIZE is too small for the save state format");
+
+#define IDLE_CHECK_INTERVAL 64 // instructions run between looks for an idle loop, doubling while they find none
+#define IDLE_MAX_INTERVAL 1024 // most instructions run between looks, about a frame at 60kHz
+#define IDLE_PROBE_LENGTH 32   // instructions stepped through in each search, the longest idle loop found
+#define IDLE_NO_LOOP 0xFF      // `idle_state` of an address that isn't in a loop an idle search could find
+#define IDLE_MAX_BACKOFF 10    // failed searches at an address after which the looks between searches stop doubling
+
+typedef struct state_reader
+{
+  const uint8_t *bytes; // the save state
+  size_t length;        // bytes in the save state
+  size_t offset;        // bytes read so far
+  bool overrun;         // a read went past the end, the state is truncated
+} state_reader_t;
+
+typedef struct idle_snapshot
+{
+  uint8_t registers[REGISTER_COUNT];
+  uint32_t rand_state;
+  uint16_t index;
+  uint16_t pc;
+  uint8_t sp;
+} idle_snapshot_t; // what a loop that writes no memory can change, compared with memcmp so padding is zeroed
+
+/* --------------------------- forward declaration -------------------------- */
+static void chip8_load_fontset(chip8_t *chip8);
+static void remember_image(chip8_t *chip8);
+
+static uint8_t decode_opcode(uint16_t opcode);
+static void decode_instruction(uint16_t opcode, instruction_t *instruction);
+static void invalidate_code(chip8_t *chip8, uint16_t address, uint16_t length);
+static void run_traced(chip8_t *chip8, uint32_t cycles);
+#ifdef CHIP8_PROFILE
+static void run_profiled(chip8_t *chip8, uint32_t cycles);
+#endif
+static uint8_t build_block(chip8_t *chip8, uint16_t address);
+#ifdef CHIP8_JIT
+static void run_native(chip8_t *chip8, uint32_t cycles);
+#endif
+#ifdef CHIP8_AOT
+static void run_translated(chip8_t *chip8, uint32_t cycles);
+#endif
+static void execute_instruction(chip8_t *chip8, const instruction_t *instruction);
+static bool may_idle(uint8_t id);
+static bool loops_back(chip8_t *chip8, uint16_t address, uint32_t byte, uint32_t *steps);
+static bool in_short_loop(chip8_t *chip8, uint16_t address);
+static void take_idle_snapshot(const chip8_t *chip8, idle_snapshot_t *snapshot);
+static uint32_t find_idle_loop(chip8_t *chip8, uint32_t *cycles);
+static bool skip_idle_loop(chip8_t *chip8, uint32_t *cycles);
+static void run_skipping_idle(chip8_t *chip8, uint32_t cycles);
+static inline uint8_t *put_u16(uint8_t *out, uint16_t value);
+static inline uint8_t *put_u32(uint8_t *out, uint32_t value);
+static inline uint8_t *put_u64(uint8_t *out, uint64_t value);
+static inline const uint8_t *take(state_reader_t *reader, size_t length);
+static inline uint16_t take_u16(state_reader_t *reader);
+static inline uint32_t take_u32(state_reader_t *reader);
+static inline uint64_t take_u64(state_reader_t *reader);
+
+static void op_invalid(chip8_t *chip8, const instruction_t *instruction);
+static void op_00E0(chip8_t *chip8, const instruction_t *instruction);
+static void op_00EE(chip8_t *chip8, const instruction_t *instruction);
+static void op_1nnn(chip8_t *chip8, const instruction_t *instruction);
+static void op_2nnn(chip8_t *chip8, const instruction_t *instruction);
+static void op_3xkk(chip8_t *chip8, const instruction_t *instruction);
+static void op_4xkk(chip8_t *chip8, const instruction_t *instruction);
+static void op_5xy0(chip8_t *chip8, const instruction_t *instruction);
+static void op_6xkk(chip8_t *chip8, const instruction_t *instruction);
+static void op_7xkk(chip8_t *chip8, const instruction_t *instruction);
+static void op_8xy0(chip8_t *chip8, const instruction_t *instruction);
+static void op_8xy1(chip8_t *chip8, const instruction_t *instruction);
+static void op_8xy2(chip8_t *chip8, const instruction_t *instruction);
+static void op_8xy3(chip8_t *chip8, const instruction_t *instruction);
+static void op_8xy4(chip8_t *chip8, const instruction_t *instruction);
+static void op_8xy5(chip8_t *chip8, const instruction_t *instruction);
+static void op_8xy6(chip8_t *chip8, const instruction_t *instruction);
+static void op_8xy7(chip8_t *chip8, const instruction_t *instruction);
+static void op_8xyE(chip8_t *chip8, const instruction_t *instruction);
+static void op_9xy0(chip8_t *chip8, const instruction_t *instruction);
+static void op_Annn(chip8_t *chip8, const instruction_t *instruction);
+static void op_Bnnn(chip8_t *chip8, const instruction_t *instruction);
+static void op_Cxkk(chip8_t *chip8, const instruction_t *instruction);
+static void op_Dxyn(chip8_t *chip8, const instruction_t *instruction);
+static void op_Ex9E(chip8_t *chip8, const instruction_t *instruction);
+static void op_ExA1(chip8_t *chip8, const instruction_t *instruction);
+static void op_Fx07(chip8_t *chip8, const instruction_t *instruction);
+static void op_Fx0A(chip8_t *chip8, const instruction_t *instruction);
+static void op_Fx15(chip8_t *chip8, const instruction_t *instruction);
+static void op_Fx18(chip8_t *chip8, const instruction_t *instruction);
+static void op_Fx1E(chip8_t *chip8, const instruction_t *instruction);
+static void op_Fx29(chip8_t *chip8, const instruction_t *instruction);
+static void op_Fx33(chip8_t *chip8, const instruction_t *instruction);
+static void op_Fx55(chip8_t *chip8, const instruction_t *instruction);
+static void op_Fx65(chip8_t *chip8, const instruction_t *instruction);
+
+/* -------------------------------- dispatch -------------------------------- */
+
+/*
+  every instruction the cpu knows, in the order of Cowgod's reference. the list is
+  expanded into the opcode ids, the handler table and the computed goto labels below,
+  so adding an instruction only means adding it here and writing its op_* function
+*/
+#define OPCODE_LIST(X) \
+  X(00E0)              \
+  X(00EE)              \
+  X(1nnn)              \
+  X(2nnn)              \
+  X(3xkk)              \
+  X(4xkk)              \
+  X(5xy0)              \
+  X(6xkk)              \
+  X(7xkk)              \
+  X(8xy0)              \
+  X(8xy1)              \
+  X(8xy2)              \
+  X(8xy3)              \
+  X(8xy4)              \
+  X(8xy5)              \
+  X(8xy6)              \
+  X(8xy7)              \
+  X(8xyE)              \
+  X(9xy0)              \
+  X(Annn)              \
+  X(Bnnn)              \
+  X(Cxkk)              \
+  X(Dxyn)              \
+  X(Ex9E)              \
+  X(ExA1)              \
+  X(Fx07)              \
+  X(Fx0A)              \
+  X(Fx15)              \
+  X(Fx18)              \
+  X(Fx1E)              \
+  X(Fx29)              \
+  X(Fx33)              \
+  X(Fx55)              \
+  X(Fx65)
+
+#define OPCODE_ID(name) OP_##name,
+typedef enum opcode_id
+{
+  OP_UNDECODED, // empty decode cache slot, never produced by decode_opcode
+  OP_INVALID,   // anything that isn't a CHIP-8 instruction traps here
+  OPCODE_LIST(OPCODE_ID)
+  OP_COUNT
+} opcode_id_t;
+#undef OPCODE_ID
+
+typedef void (*op_handler_t)(chip8_t *chip8, const instruction_t *instruction);
+
+#if defined(CHIP8_DISPATCH_TABLE) || defined(CHIP8_DISPATCH_GOTO)
+#define OPCODE_HANDLER(name) [OP_##name] = op_##name,
+static const op_handler_t op_handlers[OP_COUNT] = {
+    [OP_INVALID] = op_invalid,
+    OPCODE_LIST(OPCODE_HANDLER)
+};
+#undef OPCODE_HANDLER
+#endif
+
+#ifdef CHIP8_PROFILE
+#define OPCODE_NAME(name) [OP_##name] = #name,
+static const char *const op_names[OP_COUNT] = {
+    [OP_INVALID] = "invalid",
+    OPCODE_LIST(OPCODE_NAME)
+};
+#undef OPCODE_NAME
+
+_Static_assert(OP_COUNT <= PROFILE_MAX_OPS, "PROFILE_MAX_OPS is too small for every opcode id");
+#endif
+
+/*
+  instructions that end a basic block. besides jumps, calls, returns and skips,
+  Fx0A can rewind PC, and Fx33/Fx55 can overwrite the very block they are in
+*/
+static const bool ends_block[OP_COUNT] = {
+    [OP_00EE] = true,
+    [OP_1nnn] = true,
+    [OP_2nnn] = true,
+    [OP_3xkk] = true,
+    [OP_4xkk] = true,
+    [OP_5xy0] = true,
+    [OP_9xy0] = true,
+    [OP_Bnnn] = true,
+    [OP_Ex9E] = true,
+    [OP_ExA1] = true,
+    [OP_Fx0A] = true,
+    [OP_Fx33] = true,
+    [OP_Fx55] = true,
+};
+
+/*
+  instructions that may skip the one after them, so whether that one runs
+  depends on the machine
+*/
+static const bool skips_next[OP_COUNT] = {
+    [OP_3xkk] = true,
+    [OP_4xkk] = true,
+    [OP_5xy0] = true,
+    [OP_9xy0] = true,
+    [OP_Ex9E] = true,
+    [OP_ExA1] = true,
+};
+
+static const uint8_t fontset[FONTSET_SIZE] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+};
+
+/* ---------------------------- initialisation/cycle functions ---------------------------- */
+/**
+ * @brief loads fontset into memory, starting from 0x50
+ *
+ * @param chip8 pointer to chip8 struct
+ */
+static void chip8_load_fontset(chip8_t *chip8)
+{
+  // load font into memory
+  memcpy(&chip8->memory[FONTSET_START_ADDRESS], fontset, FONTSET_SIZE);
+
+  LOG_OK_IF(chip8->config.verbose_logging, "Fontset loaded into memory");
+}
+
+/**
+ * @brief records memory as it is now as the image save states are compared against
+ *
+ * @param chip8 pointer to chip8 struct
+ */
+static void remember_image(chip8_t *chip8)
+{
+  memcpy(chip8->code->image, chip8->memory, sizeof(chip8->code->image));
+
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (int address = 0; address < MEMORY_SIZE; ++address)
+  {
+    hash = (hash ^ chip8->code->image[address]) * 16777619u;
+  }
+  chip8->image_hash = hash;
+}
+
+int chip8_load_rom(chip8_t *chip8, const char *rom_path)
+{
+  FILE *rom_file = fopen(rom_path, "rb");
+
+  if (rom_file == NULL)
+  {
+    LOG_ERROR("Could not open %s", rom_path);
+    return 1;
+  }
+
+  fseek(rom_file, 0, SEEK_END);
+  long rom_size = ftell(rom_file); // size of file in bytes
+  rewind(rom_file);
+
+  if (rom_size > MEMORY_SIZE - START_ADDRESS)
+  {
+    LOG_ERROR("%s is too large to fit in memory", rom_path);
+    fclose(rom_file);
+    return 1;
+  }
+
+  uint8_t rom[MEMORY_SIZE - START_ADDRESS];
+  size_t bytes_read = fread(rom, 1, rom_size, rom_file);
+
+  if (bytes_read != rom_size)
+  {
+    // number of bytes read doesnt match the file size, ROM not loaded properly
+    LOG_ERROR("Failed to read from %s", rom_path);
+    fclose(rom_file);
+    return 1;
+  }
+  else
+  {
+    LOG_OK_IF(chip8->config.verbose_logging, "Read from %s successfully", rom_path);
+  }
+
+  fclose(rom_file);
+
+  return chip8_load_rom_data(chip8, rom, (size_t)rom_size);
+}
+
+int chip8_load_rom_data(chip8_t *chip8, const uint8_t *rom, size_t rom_size)
+{
+  if (rom_size > MEMORY_SIZE - START_ADDRESS)
+  {
+    LOG_ERROR("ROM of %zu bytes is too large to fit in memory", rom_size);
+    return 1;
+  }
+
+  memcpy(&chip8->memory[START_ADDRESS], rom, rom_size);
+  remember_image(chip8);
+
+  memset(chip8->code->decode_cache, 0, sizeof(chip8->code->decode_cache)); // every slot back to OP_UNDECODED
+  memset(chip8->code->block_length, 0, sizeof(chip8->code->block_length));
+  memset(chip8->code->idle_state, 0, sizeof(chip8->code->idle_state));
+#ifdef CHIP8_JIT
+  if (chip8->jit != NULL)
+  {
+    jit_flush(chip8->jit);
+  }
+#endif
+  return 0;
+}
+
+int chip8_initialise(chip8_t *chip8, const chip8_config_t *config)
+{
+  memset(chip8, 0, sizeof(chip8_t)); // clear memory
+
+  // the caches are as large as the rest of the machine put together, so they live apart from it
+  chip8->code = calloc(1, sizeof(chip8_code_t));
+  if (chip8->code == NULL)
+  {
+    LOG_ERROR("Could not allocate the decode cache");
+    return 1;
+  }
+
+  if (config != NULL)
+  {
+    chip8->config = *config;
+  }
+  if (chip8->config.cpu_hz == 0)
+  {
+    chip8->config.cpu_hz = CHIP8_DEFAULT_CPU_HZ;
+  }
+
+  chip8_load_fontset(chip8);
+  remember_image(chip8);
+
+  // every instance has its own generator, so instances on different threads never share state
+  chip8_seed(chip8, (uint32_t)time(NULL));
+
+  chip8->pc = 0x200;
+  chip8->dirty_rows = ALL_ROWS_DIRTY; // nothing has been drawn yet
+  return 0;
+}
+
+void chip8_release(chip8_t *chip8)
+{
+  chip8_jit_disable(chip8);
+  chip8_profile_disable(chip8);
+  free(chip8->code);
+  chip8->code = NULL;
+}
+
+/**
+ * @brief reads the two bytes of the opcode at an address
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param address address of the first byte
+ * @return the opcode
+ */
+static inline uint16_t fetch_opcode(const chip8_t *chip8, uint16_t address)
+{
+  return chip8->memory[address & (MEMORY_SIZE - 1)] << 8 | chip8->memory[(address + 1) & (MEMORY_SIZE - 1)];
+}
+
+/**
+ * @brief fetches the instruction at PC, only decoding it the first time PC gets there
+ *
+ * @param chip8 pointer to chip8 struct
+ * @return the decoded instruction
+ */
+static inline const instruction_t *fetch_instruction(chip8_t *chip8)
+{
+  instruction_t *instruction = &chip8->code->decode_cache[chip8->pc & (MEMORY_SIZE - 1)];
+
+  if (instruction->id == OP_UNDECODED)
+  {
+    decode_instruction(fetch_opcode(chip8, chip8->pc), instruction);
+  }
+  return instruction;
+}
+
+void chip8_cycle(chip8_t *chip8)
+{
+  const instruction_t *instruction = fetch_instruction(chip8); // fetch and decode
+
+  chip8->pc += 2; // increment PC before executing anything
+
+  LOG_TRACE(chip8, "PC: %x", chip8->pc);
+  LOG_TRACE(chip8, "Opcode: %x", instruction->opcode);
+
+  execute_instruction(chip8, instruction);
+}
+
+/**
+ * @brief looks up the basic block at PC, building it on first use
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles what is left of the cycle budget
+ * @return number of instructions in the block, `0` if no block fits in the budget
+ */
+static inline uint8_t lookup_block(chip8_t *chip8, uint32_t cycles)
+{
+  uint16_t pc = chip8->pc & (MEMORY_SIZE - 1);
+  uint8_t length = chip8->code->block_length[pc];
+
+  if (length == 0)
+  {
+    length = build_block(chip8, pc);
+  }
+
+  return length <= cycles ? length : 0;
+}
+
+#if defined(CHIP8_DISPATCH_GOTO) && defined(__GNUC__)
+
+void chip8_run(chip8_t *chip8, uint32_t cycles)
+{
+  if (chip8->trace != NULL)
+  {
+    run_traced(chip8, cycles);
+    return;
+  }
+
+#ifdef CHIP8_PROFILE
+  if (chip8->profile != NULL)
+  {
+    run_profiled(chip8, cycles);
+    return;
+  }
+#endif
+
+#ifdef CHIP8_AOT
+  run_translated(chip8, cycles);
+  return;
+#endif
+#ifdef CHIP8_JIT
+  if (chip8->jit != NULL)
+  {
+    run_native(chip8, cycles);
+    return;
+  }
+#endif
+
+  /*
+    direct threading: every handler ends with its own copy of the dispatch, jumping
+    straight to the next handler through a label address. each handler then gets
+    its own indirect branch, which the branch predictor learns far better than the
+    single shared one of a switch. at the end of a basic block the next one is
+    looked up by PC without leaving the function
+  */
+#define OPCODE_LABEL(name) [OP_##name] = &&label_##name,
+  static const void *labels[OP_COUNT] = {
+      [OP_INVALID] = &&label_invalid,
+      OPCODE_LIST(OPCODE_LABEL)};
+#undef OPCODE_LABEL
+
+  const instruction_t *instruction = NULL;
+  uint8_t length = 0;
+
+  // instructions are 2 bytes apart and the decode cache has a slot per byte
+#define DISPATCH()                                                                 \
+  do                                                                               \
+  {                                                                                \
+    if (length-- == 0)                                                             \
+    {                                                                              \
+      length = lookup_block(chip8, cycles);                                        \
+      if (length-- == 0)                                                           \
+      {                                                                            \
+        goto single_step;                                                          \
+      }                                                                            \
+      cycles -= length + 1;                                                        \
+      instruction = &chip8->code->decode_cache[chip8->pc & (MEMORY_SIZE - 1)];     \
+    }                                                                              \
+    chip8->pc += 2;                                                                \
+    LOG_TRACE(chip8, "PC: %x", chip8->pc);                                         \
+    LOG_TRACE(chip8, "Opcode: %x", instruction->opcode);                           \
+    goto *labels[instruction->id];                                                 \
+  } while (0)
+
+  DISPATCH();
+
+single_step:
+  // no block fits in what is left of the budget, finish it one instruction at a time
+  while (cycles > 0)
+  {
+    chip8_cycle(chip8);
+    cycles--;
+  }
+  return;
+
+label_invalid:
+  op_invalid(chip8, instruction);
+  instruction += 2;
+  DISPATCH();
+
+#define OPCODE_BODY(name)        \
+  label_##name:                  \
+  op_##name(chip8, instruction); \
+  instruction += 2;              \
+  DISPATCH();
+  OPCODE_LIST(OPCODE_BODY)
+#undef OPCODE_BODY
+#undef DISPATCH
+}
+
+#else
+
+void chip8_run(chip8_t *chip8, uint32_t cycles)
+{
+  if (chip8->trace != NULL)
+  {
+    run_traced(chip8, cycles);
+    return;
+  }
+
+#ifdef CHIP8_PROFILE
+  if (chip8->profile != NULL)
+  {
+    run_profiled(chip8, cycles);
+    return;
+  }
+#endif
+
+#ifdef CHIP8_AOT
+  run_translated(chip8, cycles);
+  return;
+#endif
+#ifdef CHIP8_JIT
+  if (chip8->jit != NULL)
+  {
+    run_native(chip8, cycles);
+    return;
+  }
+#endif
+
+  /*
+    straight-line code runs a basic block at a time: one lookup by PC finds the
+    block, then its instructions execute back to back without checking the
+    decode cache or the cycle budget in between
+  */
+  while (cycles > 0)
+  {
+    uint8_t length = lookup_block(chip8, cycles);
+
+    if (length == 0)
+    {
+      // no block fits in what is left of the budget, finish it one instruction at a time
+      chip8_cycle(chip8);
+      cycles--;
+      continue;
+    }
+
+    cycles -= length;
+
+    // instructions are 2 bytes apart and the decode cache has a slot per byte
+    const instruction_t *instruction = &chip8->code->decode_cache[chip8->pc & (MEMORY_SIZE - 1)];
+    for (const instruction_t *end = instruction + 2 * length; instruction != end; instruction += 2)
+    {
+      chip8->pc += 2;
+
+      LOG_TRACE(chip8, "PC: %x", chip8->pc);
+      LOG_TRACE(chip8, "Opcode: %x", instruction->opcode);
+
+      execute_instruction(chip8, instruction);
+    }
+  }
+}
+
+#endif
+
+/**
+ * @brief `chip8_run` while a trace is attached
+ *
+ * steps one instruction at a time, since blocks, native and translated code
+ * don't stop between instructions to record them
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles number of instructions to execute
+ */
+static void run_traced(chip8_t *chip8, uint32_t cycles)
+{
+  for (; cycles > 0; --cycles)
+  {
+    uint8_t registers[REGISTER_COUNT];
+    memcpy(registers, chip8->registers, sizeof(registers));
+
+    trace_entry_t entry = {
+        .pc = chip8->pc,
+        .opcode = fetch_opcode(chip8, chip8->pc),
+        .reg = TRACE_NO_REGISTER,
+    };
+
+    chip8_cycle(chip8);
+
+    entry.index = chip8->index;
+    for (uint8_t reg = 0; reg < REGISTER_COUNT; ++reg)
+    {
+      if (chip8->registers[reg] != registers[reg])
+      {
+        entry.reg = reg;
+        entry.value = chip8->registers[reg];
+        break;
+      }
+    }
+
+    trace_record(chip8->trace, &entry);
+  }
+}
+
+#ifdef CHIP8_PROFILE
+
+/**
+ * @brief `chip8_run` with the profiler enabled
+ *
+ * steps one instruction at a time through the interpreter, so the counts are
+ * per instruction whichever dispatch, jit or translated code would otherwise run
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles number of instructions to execute
+ */
+static void run_profiled(chip8_t *chip8, uint32_t cycles)
+{
+  profile_t *profile = chip8->profile;
+
+  profile->instructions += cycles;
+
+  for (; cycles > 0; --cycles)
+  {
+    const instruction_t *instruction = fetch_instruction(chip8);
+    uint8_t id = instruction->id; // read now, Fx33 and Fx55 can empty the decode cache slot
+
+    profile->pc_count[chip8->pc & (MEMORY_SIZE - 1)]++;
+    profile->op_count[id]++;
+
+    chip8->pc += 2;
+
+    if (profile->timed)
+    {
+      uint64_t start = profile_now_ns();
+      execute_instruction(chip8, instruction);
+      profile->op_ns[id] += profile_now_ns() - start;
+    }
+    else
+    {
+      execute_instruction(chip8, instruction);
+    }
+  }
+}
+
+int chip8_profile_enable(chip8_t *chip8, bool timed)
+{
+  if (chip8->profile == NULL)
+  {
+    chip8->profile = profile_create(timed);
+  }
+  return chip8->profile != NULL ? 0 : 1;
+}
+
+int chip8_profile_report(const chip8_t *chip8, const char *json_path)
+{
+  if (chip8->profile == NULL)
+  {
+    return 0;
+  }
+  return profile_report(chip8->profile, op_names, OP_COUNT, chip8->memory, stdout, json_path);
+}
+
+void chip8_profile_disable(chip8_t *chip8)
+{
+  profile_destroy(chip8->profile);
+  chip8->profile = NULL;
+}
+
+#else
+
+int chip8_profile_enable(chip8_t *chip8, bool timed)
+{
+  (void)chip8;
+  (void)timed;
+  LOG_ERROR("Built without the profiler, reconfigure with -DCHIP8_PROFILE=ON");
+  return 1;
+}
+
+int chip8_profile_report(const chip8_t *chip8, const char *json_path)
+{
+  (void)chip8;
+  (void)json_path;
+  return 0;
+}
+
+void chip8_profile_disable(chip8_t *chip8)
+{
+  (void)chip8;
+}
+
+#endif
+
+#ifdef CHIP8_AOT
+
+/**
+ * @brief `chip8_run` with a ROM translated ahead of time linked in
+ *
+ * the translated code runs for as long as it can, and the interpreter steps
+ * over whatever it stops at
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles number of instructions to execute
+ */
+static void run_translated(chip8_t *chip8, uint32_t cycles)
+{
+  while (cycles > 0)
+  {
+    uint32_t left = chip8_aot_run(chip8, cycles);
+
+    if (left == cycles)
+    { // no translated code at PC, or the ROM overwrote it
+      chip8_cycle(chip8);
+      left--;
+    }
+
+    cycles = left;
+  }
+}
+
+#endif
+
+#ifdef CHIP8_JIT
+
+/**
+ * @brief `chip8_run` with the jit enabled
+ *
+ * native code runs from block to block on its own as far as it can, and comes
+ * back here when PC is only known at run time or a block doesn't fit in what is
+ * left of the budget. the interpreter finishes the budget one instruction at a time
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles number of instructions to execute
+ */
+static void run_native(chip8_t *chip8, uint32_t cycles)
+{
+  while (cycles > 0)
+  {
+    uint8_t length = lookup_block(chip8, cycles);
+    jit_block_t code = NULL;
+
+    // native code has the block's addresses baked in, so PC must already be inside memory
+    if (length != 0 && chip8->pc < MEMORY_SIZE)
+    {
+      code = jit_lookup(chip8->jit, chip8, chip8->pc, length);
+    }
+
+    if (code == NULL)
+    {
+      chip8_cycle(chip8);
+      cycles--;
+      continue;
+    }
+
+    cycles = jit_run(chip8->jit, chip8, code, cycles);
+  }
+}
+
+int chip8_jit_enable(chip8_t *chip8)
+{
+  if (chip8->jit == NULL)
+  {
+    chip8->jit = jit_create(execute_instruction);
+    LOG_OK_IF(chip8->jit != NULL && chip8->config.verbose_logging, "JIT code buffer mapped");
+  }
+  return chip8->jit != NULL ? 0 : 1;
+}
+
+void chip8_jit_disable(chip8_t *chip8)
+{
+  if (chip8->jit != NULL)
+  {
+    jit_destroy(chip8->jit);
+    chip8->jit = NULL;
+  }
+}
+
+#else
+
+int chip8_jit_enable(chip8_t *chip8)
+{
+  (void)chip8;
+  LOG_ERROR("Built without the JIT, reconfigure with -DCHIP8_JIT=ON");
+  return 1;
+}
+
+void chip8_jit_disable(chip8_t *chip8)
+{
+  (void)chip8;
+}
+
+#endif
+
+/**
+ * @brief decodes the basic block starting at an address and records its length
+ *
+ * a block runs up to and including the first instruction in `ends_block`, and is
+ * at most BLOCK_MAX_LENGTH instructions long. it never wraps past the end of memory
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param address first byte of the block
+ * @return number of instructions in the block, `0` if none fit before the end of memory
+ */
+static uint8_t build_block(chip8_t *chip8, uint16_t address)
+{
+  uint8_t length = 0;
+
+  for (uint16_t byte = address; length < BLOCK_MAX_LENGTH && byte + 1 < MEMORY_SIZE; byte += 2)
+  {
+    instruction_t *instruction = &chip8->code->decode_cache[byte];
+    if (instruction->id == OP_UNDECODED)
+    {
+      decode_instruction(fetch_opcode(chip8, byte), instruction);
+    }
+
+    length++;
+
+    if (ends_block[instruction->id])
+    {
+      break;
+    }
+  }
+
+  chip8->code->block_length[address] = length;
+  return length;
+}
+
+/**
+ * @brief works out which instruction an opcode is
+ *
+ * @param opcode the opcode to decode
+ * @return the `opcode_id_t` of the instruction, `OP_INVALID` if there is none
+ */
+static uint8_t decode_opcode(uint16_t opcode)
+{
+  switch (opcode & 0xF000)
+  {
+  case 0x0000:
+    switch (opcode & 0x00FF)
+    {
+    case 0x00E0:
+      return OP_00E0;
+    case 0x00EE:
+      return OP_00EE;
+    }
+    break;
+  case 0x1000:
+    return OP_1nnn;
+  case 0x2000:
+    return OP_2nnn;
+  case 0x3000:
+    return OP_3xkk;
+  case 0x4000:
+    return OP_4xkk;
+  case 0x5000:
+    return OP_5xy0;
+  case 0x6000:
+    return OP_6xkk;
+  case 0x7000:
+    return OP_7xkk;
+  case 0x8000:
+    switch (opcode & 0x000F)
+    {
+    case 0x0000:
+      return OP_8xy0;
+    case 0x0001:
+      return OP_8xy1;
+    case 0x0002:
+      return OP_8xy2;
+    case 0x0003:
+      return OP_8xy3;
+    case 0x0004:
+      return OP_8xy4;
+    case 0x0005:
+      return OP_8xy5;
+    case 0x0006:
+      return OP_8xy6;
+    case 0x0007:
+      return OP_8xy7;
+    case 0x000E:
+      return OP_8xyE;
+    }
+    break;
+  case 0x9000:
+    return OP_9xy0;
+  case 0xA000:
+    return OP_Annn;
+  case 0xB000:
+    return OP_Bnnn;
+  case 0xC000:
+    return OP_Cxkk;
+  case 0xD000:
+    return OP_Dxyn;
+  case 0xE000:
+    switch (opcode & 0x00FF)
+    {
+    case 0x009E:
+      return OP_Ex9E;
+    case 0x00A1:
+      return OP_ExA1;
+    }
+    break;
+  case 0xF000:
+    switch (opcode & 0x00FF)
+    {
+    case 0x0007:
+      return OP_Fx07;
+    case 0x000A:
+      return OP_Fx0A;
+    case 0x0015:
+      return OP_Fx15;
+    case 0x0018:
+      return OP_Fx18;
+    case 0x001E:
+      return OP_Fx1E;
+    case 0x0029:
+      return OP_Fx29;
+    case 0x0033:
+      return OP_Fx33;
+    case 0x0055:
+      return OP_Fx55;
+    case 0x0065:
+      return OP_Fx65;
+    }
+    break;
+  }
+  return OP_INVALID;
+}
+
+/**
+ * @brief unpacks an opcode into its instruction id and all of its operands
+ *
+ * @param opcode the opcode to decode
+ * @param instruction where to store the decoded instruction
+ */
+static void decode_instruction(uint16_t opcode, instruction_t *instruction)
+{
+  instruction->opcode = opcode;
+  instruction->id = decode_opcode(opcode);
+  instruction->x = (opcode & 0x0F00) >> 8;
+  instruction->y = (opcode & 0x00F0) >> 4;
+  instruction->n = opcode & 0x000F;
+  instruction->kk = opcode & 0x00FF;
+  instruction->nnn = opcode & 0x0FFF;
+}
+
+/**
+ * @brief drops decoded instructions and basic blocks that overlap memory which was just written to
+ *
+ * an instruction is 2 bytes long, so the one starting a byte before `address` is dropped too.
+ * a block can start up to 2 * BLOCK_MAX_LENGTH - 1 bytes before `address` and still cover it
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param address first byte written
+ * @param length number of bytes written
+ */
+static void invalidate_code(chip8_t *chip8, uint16_t address, uint16_t length)
+{
+  // writes wrap around the end of memory the same way they're masked, so the part past it is invalidated from 0
+  address &= MEMORY_SIZE - 1;
+  if (address + length > MEMORY_SIZE)
+  {
+    invalidate_code(chip8, 0, address + length - MEMORY_SIZE);
+    length = MEMORY_SIZE - address;
+  }
+
+  for (uint32_t byte = address > 0 ? address - 1 : 0; byte < (uint32_t)address + length; ++byte)
+  {
+    chip8->code->decode_cache[byte & (MEMORY_SIZE - 1)].id = OP_UNDECODED;
+  }
+
+  uint32_t first_block = address >= 2 * BLOCK_MAX_LENGTH ? address - (2 * BLOCK_MAX_LENGTH - 1) : 0;
+  for (uint32_t block = first_block; block < (uint32_t)address + length && block < MEMORY_SIZE; ++block)
+  {
+    if (block + 2 * chip8->code->block_length[block] > address)
+    {
+      chip8->code->block_length[block] = 0;
+    }
+  }
+
+  // whether an address is in a loop depends on the IDLE_PROBE_LENGTH instructions from it on
+  uint32_t first_loop = address >= 2 * IDLE_PROBE_LENGTH ? address - (2 * IDLE_PROBE_LENGTH - 1) : 0;
+  memset(&chip8->code->idle_state[first_loop], 0, (uint32_t)address + length - first_loop);
+
+#ifdef CHIP8_JIT
+  if (chip8->jit != NULL)
+  {
+    jit_invalidate(chip8->jit, address, length);
+  }
+#endif
+}
+
+#if defined(CHIP8_DISPATCH_TABLE) || defined(CHIP8_DISPATCH_GOTO)
+
+/**
+ * @brief executes a decoded instruction through the handler table
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param instruction the current instruction, already decoded
+ */
+static void execute_instruction(chip8_t *chip8, const instruction_t *instruction)
+{
+  op_handlers[instruction->id](chip8, instruction);
+}
+
+#else
+
+/**
+ * @brief executes a decoded instruction with a switch over its id
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param instruction the current instruction, already decoded
+ */
+static void execute_instruction(chip8_t *chip8, const instruction_t *instruction)
+{
+  switch (instruction->id)
+  {
+  case OP_00E0:
+    LOG_TRACE(chip8, "00E0 - CLS");
+    op_00E0(chip8, instruction);
+    break;
+  case OP_00EE:
+    LOG_TRACE(chip8, "00EE - RET");
+    op_00EE(chip8, instruction);
+    break;
+  case OP_1nnn:
+    LOG_TRACE(chip8, "1nnn - JP 0x%03X", instruction->nnn);
+    op_1nnn(chip8, instruction);
+    break;
+  case OP_2nnn:
+    LOG_TRACE(chip8, "2nnn - CALL 0x%03X", instruction->nnn);
+    op_2nnn(chip8, instruction);
+    break;
+  case OP_3xkk:
+    LOG_TRACE(chip8, "3xkk - SE V%X, 0x%02X", instruction->x, instruction->kk);
+    op_3xkk(chip8, instruction);
+    break;
+  case OP_4xkk:
+    LOG_TRACE(chip8, "4xkk - SNE V%X, 0x%02X", instruction->x, instruction->kk);
+    op_4xkk(chip8, instruction);
+    break;
+  case OP_5xy0:
+    LOG_TRACE(chip8, "5xy0 - SE V%X, V%X", instruction->x, instruction->y);
+    op_5xy0(chip8, instruction);
+    break;
+  case OP_6xkk:
+    LOG_TRACE(chip8, "6xkk - LD V%X, 0x%02X", instruction->x, instruction->kk);
+    op_6xkk(chip8, instruction);
+    break;
+  case OP_7xkk:
+    LOG_TRACE(chip8, "7xkk - ADD V%X, 0x%02X", instruction->x, instruction->kk);
+    op_7xkk(chip8, instruction);
+    break;
+  case OP_8xy0:
+    LOG_TRACE(chip8, "8xy0 - LD V%X, V%X", instruction->x, instruction->y);
+    op_8xy0(chip8, instruction);
+    break;
+  case OP_8xy1:
+    LOG_TRACE(chip8, "8xy1 - OR V%X, V%X", instruction->x, instruction->y);
+    op_8xy1(chip8, instruction);
+    break;
+  case OP_8xy2:
+    LOG_TRACE(chip8, "8xy2 - AND V%X, V%X", instruction->x, instruction->y);
+    op_8xy2(chip8, instruction);
+    break;
+  case OP_8xy3:
+    LOG_TRACE(chip8, "8xy3 - XOR V%X, V%X", instruction->x, instruction->y);
+    op_8xy3(chip8, instruction);
+    break;
+  case OP_8xy4:
+    LOG_TRACE(chip8, "8xy4 - ADD V%X, V%X", instruction->x, instruction->y);
+    op_8xy4(chip8, instruction);
+    break;
+  case OP_8xy5:
+    LOG_TRACE(chip8, "8xy5 - SUB V%X, V%X", instruction->x, instruction->y);
+    op_8xy5(chip8, instruction);
+    break;
+  case OP_8xy6:
+    LOG_TRACE(chip8, "8xy6 - SHR V%X", instruction->x);
+    op_8xy6(chip8, instruction);
+    break;
+  case OP_8xy7:
+    LOG_TRACE(chip8, "8xy7 - SUBN V%X, V%X", instruction->x, instruction->y);
+    op_8xy7(chip8, instruction);
+    break;
+  case OP_8xyE:
+    LOG_TRACE(chip8, "8xyE - SHL V%X", instruction->x);
+    op_8xyE(chip8, instruction);
+    break;
+  case OP_9xy0:
+    LOG_TRACE(chip8, "9xy0 - SNE V%X, V%X", instruction->x, instruction->y);
+    op_9xy0(chip8, instruction);
+    break;
+  case OP_Annn:
+    LOG_TRACE(chip8, "Annn - LD I, 0x%03X", instruction->nnn);
+    op_Annn(chip8, instruction);
+    break;
+  case OP_Bnnn:
+    LOG_TRACE(chip8, "Bnnn - JP V0, 0x%03X", instruction->nnn);
+    op_Bnnn(chip8, instruction);
+    break;
+  case OP_Cxkk:
+    LOG_TRACE(chip8, "Cxkk - RND V%X, 0x%02X", instruction->x, instruction->kk);
+    op_Cxkk(chip8, instruction);
+    break;
+  case OP_Dxyn:
+    LOG_TRACE(chip8, "Dxyn - DRW V%X, V%X, %d", instruction->x, instruction->y, instruction->n);
+    op_Dxyn(chip8, instruction);
+    break;
+  case OP_Ex9E:
+    LOG_TRACE(chip8, "Ex9E - SKP V%X", instruction->x);
+    op_Ex9E(chip8, instruction);
+    break;
+  case OP_ExA1:
+    LOG_TRACE(chip8, "ExA1 - SKNP V%X", instruction->x);
+    op_ExA1(chip8, instruction);
+    break;
+  case OP_Fx07:
+    LOG_TRACE(chip8, "Fx07 - LD V%X, DT", instruction->x);
+    op_Fx07(chip8, instruction);
+    break;
+  case OP_Fx0A:
+    LOG_TRACE(chip8, "Fx0A - LD V%X, K", instruction->x);
+    op_Fx0A(chip8, instruction);
+    break;
+  case OP_Fx15:
+    LOG_TRACE(chip8, "Fx15 - LD DT, V%X", instruction->x);
+    op_Fx15(chip8, instruction);
+    break;
+  case OP_Fx18:
+    LOG_TRACE(chip8, "Fx18 - LD ST, V%X", instruction->x);
+    op_Fx18(chip8, instruction);
+    break;
+  case OP_Fx1E:
+    LOG_TRACE(chip8, "Fx1E - ADD I, V%X", instruction->x);
+    op_Fx1E(chip8, instruction);
+    break;
+  case OP_Fx29:
+    LOG_TRACE(chip8, "Fx29 - LD F, V%X", instruction->x);
+    op_Fx29(chip8, instruction);
+    break;
+  case OP_Fx33:
+    LOG_TRACE(chip8, "Fx33 - LD B, V%X", instruction->x);
+    op_Fx33(chip8, instruction);
+    break;
+  case OP_Fx55:
+    LOG_TRACE(chip8, "Fx55 - LD [I], V%X", instruction->x);
+    op_Fx55(chip8, instruction);
+    break;
+  case OP_Fx65:
+    LOG_TRACE(chip8, "Fx65 - LD V%X, [I]", instruction->x);
+    op_Fx65(chip8, instruction);
+    break;
+  default:
+    op_invalid(chip8, instruction);
+    break;
+  }
+}
+
+#endif
+
+/**
+ * @brief tells whether an instruction leaves alone everything that could end an idle loop
+ *
+ * @param id the `opcode_id_t` of the instruction
+ * @return `false` if it writes memory, the display, the stack, the timers or the random state
+ */
+static bool may_idle(uint8_t id)
+{
+  switch (id)
+  {
+  case OP_INVALID:
+  case OP_00E0:
+  case OP_00EE:
+  case OP_2nnn:
+  case OP_Cxkk:
+  case OP_Dxyn:
+  case OP_Fx15:
+  case OP_Fx18:
+  case OP_Fx33:
+  case OP_Fx55:
+    return false;
+  default:
+    return true;
+  }
+}
+
+/**
+ * @brief tells whether the code from `byte` on jumps back to or before `address`, without running anything
+ *
+ * unconditional forward jumps are followed. both ways out of an instruction
+ * that may be skipped are followed, whatever it is, since the loop may well be
+ * the way that skips it. anything else that would end the loop or leave it
+ * rules `address` out
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param address the address the loop has to take in
+ * @param byte where to look from
+ * @param steps instructions left to look at, shared by every way followed
+ * @return `true` if a jump back was found
+ */
+static bool loops_back(chip8_t *chip8, uint16_t address, uint32_t byte, uint32_t *steps)
+{
+  bool conditional = false; // the instruction looked at may be skipped
+
+  for (; *steps > 0 && byte + 1 < MEMORY_SIZE; --*steps, byte += 2)
+  {
+    instruction_t *instruction = &chip8->code->decode_cache[byte];
+    if (instruction->id == OP_UNDECODED)
+    {
+      decode_instruction(fetch_opcode(chip8, (uint16_t)byte), instruction);
+    }
+
+    if (instruction->id == OP_1nnn)
+    {
+      if (instruction->nnn <= address)
+      {
+        return true;
+      }
+      if (instruction->nnn > byte && !conditional)
+      {
+        byte = instruction->nnn - 2u;
+      }
+      else if (instruction->nnn > byte)
+      {
+        if (loops_back(chip8, address, instruction->nnn, steps))
+        {
+          return true;
+        }
+      }
+      else if (!conditional)
+      {
+        return false; // a loop that doesn't take in the address
+      }
+    }
+    else if (!conditional && (instruction->id == OP_00EE || instruction->id == OP_Bnnn || !may_idle(instruction->id)))
+    {
+      return false;
+    }
+
+    conditional = skips_next[instruction->id];
+    if (*steps == 0)
+    {
+      break;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief tells whether an address is in a loop that find_idle_loop could find
+ *
+ * that is `Fx0A`, which waits on itself, or code that gets back to the address
+ * within IDLE_PROBE_LENGTH instructions, eg. `Fx07; 3x00; 1nnn` waiting for the
+ * delay timer
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param address the address to look from
+ * @return `true` if searching for an idle loop there could succeed
+ */
+static bool in_short_loop(chip8_t *chip8, uint16_t address)
+{
+  uint32_t steps = IDLE_PROBE_LENGTH;
+
+  if ((fetch_opcode(chip8, address) & 0xF0FF) == 0xF00A)
+  {
+    return true;
+  }
+  return loops_back(chip8, address, address, &steps);
+}
+
+/**
+ * @brief copies what an idle loop could change
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param snapshot where the copy goes
+ */
+static void take_idle_snapshot(const chip8_t *chip8, idle_snapshot_t *snapshot)
+{
+  memset(snapshot, 0, sizeof(idle_snapshot_t));
+  memcpy(snapshot->registers, chip8->registers, REGISTER_COUNT);
+  snapshot->rand_state = chip8->rand_state;
+  snapshot->index = chip8->index;
+  snapshot->pc = chip8->pc;
+  snapshot->sp = chip8->sp;
+}
+
+/**
+ * @brief steps one instruction at a time looking for a loop that can't end before the run does
+ *
+ * within one run the timers and keypad never change, so once the machine comes
+ * back round to the same PC with the same registers, index register, stack
+ * pointer and random state, having written nothing on the way, it will go
+ * round the same way until the run ends. this catches the usual ways of
+ * waiting: a jump to itself, `Fx0A` with no key down, `Fx07; 3xkk; 1nnn` until
+ * the delay timer runs out and loops polling keys with `Ex9E` and `ExA1`
+ *
+ * the instructions stepped are really executed, and taken off `cycles`
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles what is left of the run, updated in place
+ * @return length of the loop in instructions, `0` if none was found within IDLE_PROBE_LENGTH instructions
+ */
+static uint32_t find_idle_loop(chip8_t *chip8, uint32_t *cycles)
+{
+  idle_snapshot_t start;
+  uint32_t length = 0;
+
+  take_idle_snapshot(chip8, &start);
+  for (uint32_t step = 0; step < IDLE_PROBE_LENGTH && *cycles > 0; ++step)
+  {
+    if (!may_idle(fetch_instruction(chip8)->id))
+    {
+      return 0;
+    }
+
+    chip8_cycle(chip8);
+    --*cycles;
+    ++length;
+
+    if (chip8->pc == start.pc)
+    {
+      idle_snapshot_t now;
+      take_idle_snapshot(chip8, &now);
+      if (memcmp(&now, &start, sizeof(idle_snapshot_t)) == 0)
+      {
+        return length;
+      }
+      // back at the start but a register changed, eg. `Fx07` loading the delay timer on the first pass
+      memcpy(&start, &now, sizeof(idle_snapshot_t));
+      length = 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief looks at PC for an idle loop and skips what is left of the run if it finds one
+ *
+ * PC is only searched from if in_short_loop says it is in a loop, which is
+ * cached in `idle_state` until the code there changes. after k searches from
+ * an address fail in a row, it is only searched from on every 2^k-th look, so
+ * a busy loop soon stops being searched while the ROM's idle loops elsewhere
+ * are still found. each look that skips nothing doubles the instructions run
+ * before the next, up to IDLE_MAX_INTERVAL, so busy code is split into few runs
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles what is left of the run, updated in place
+ * @return `true` if the rest of the run was skipped
+ */
+static bool skip_idle_loop(chip8_t *chip8, uint32_t *cycles)
+{
+  uint16_t pc = chip8->pc & (MEMORY_SIZE - 1);
+  uint8_t *state = &chip8->code->idle_state[pc];
+  if (*state == 0)
+  {
+    *state = in_short_loop(chip8, pc) ? 1 : IDLE_NO_LOOP;
+  }
+
+  chip8->idle_looks++;
+  uint32_t length = 0;
+
+  // `state` is one more than the searches here that failed in a row
+  if (*state != IDLE_NO_LOOP && (chip8->idle_looks & ((1u << (*state - 1)) - 1)) == 0)
+  {
+    length = find_idle_loop(chip8, cycles);
+    *state = length != 0 ? 1 : *state + (*state <= IDLE_MAX_BACKOFF);
+  }
+
+  if (length == 0)
+  {
+    chip8->idle_interval = chip8->idle_interval == 0 ? IDLE_CHECK_INTERVAL : chip8->idle_interval * 2;
+    chip8->idle_interval = chip8->idle_interval < IDLE_MAX_INTERVAL ? chip8->idle_interval : IDLE_MAX_INTERVAL;
+    chip8->idle_wait = chip8->idle_interval;
+    return false;
+  }
+
+  // the timers or keys the loop waits on change between runs, so the next run starts by looking again
+  chip8->idle_interval = 0;
+  chip8->idle_wait = 0;
+  chip8->idle_skipped += *cycles - *cycles % length;
+  chip8_run(chip8, *cycles % length);
+  *cycles = 0;
+  return true;
+}
+
+/**
+ * @brief `chip8_run` for the timed runs, skipping the rest of the run once the ROM is waiting in a loop
+ *
+ * ROMs spend much of their time waiting for the delay timer or a key, so this
+ * is where headless runs gain the most. a loop found by find_idle_loop is
+ * skipped a whole number of times round, leaving the machine exactly as
+ * running it would. skip_idle_loop looks for one every `idle_wait`
+ * instructions, counted across runs, and not at all while tracing or
+ * profiling, which should see every instruction that runs
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles number of instructions to execute
+ */
+static void run_skipping_idle(chip8_t *chip8, uint32_t cycles)
+{
+  if (chip8->trace == NULL && chip8->profile == NULL)
+  {
+    while (cycles > chip8->idle_wait)
+    {
+      chip8_run(chip8, chip8->idle_wait);
+      cycles -= chip8->idle_wait;
+      if (skip_idle_loop(chip8, &cycles))
+      {
+        return;
+      }
+    }
+    chip8->idle_wait -= cycles;
+  }
+
+  chip8_run(chip8, cycles);
+}
+
+bool chip8_waiting_for_key(const chip8_t *chip8)
+{
+  if ((fetch_opcode(chip8, chip8->pc) & 0xF0FF) != 0xF00A || chip8->delay_timer != 0 || chip8->sound_timer != 0)
+  {
+    return false;
+  }
+
+  for (int key = 0; key < KEY_COUNT; ++key)
+  {
+    if (chip8->keypad[key] != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint32_t chip8_cycles_to_tick(const chip8_t *chip8)
+{
+  uint32_t budget = (chip8->config.cpu_hz + chip8->tick_remainder) / CHIP8_TIMER_HZ;
+  return budget > chip8->frame_cycles ? budget - chip8->frame_cycles : 0; // cpu_hz may have been lowered mid-frame
+}
+
+uint32_t chip8_run_frame(chip8_t *chip8)
+{
+  uint32_t cycles = chip8_cycles_to_tick(chip8);
+  run_skipping_idle(chip8, cycles);
+
+  if (chip8->delay_timer > 0)
+  {
+    chip8->delay_timer--;
+  }
+  if (chip8->sound_timer > 0)
+  {
+    chip8->sound_timer--;
+  }
+
+  // cpu_hz rarely divides evenly by 60 (700Hz is 11.67 instructions per frame), so the leftover goes into the next frame
+  chip8->tick_remainder = (chip8->config.cpu_hz + chip8->tick_remainder) % CHIP8_TIMER_HZ;
+  chip8->frame_cycles = 0;
+  return cycles;
+}
+
+uint64_t chip8_run_timed(chip8_t *chip8, uint64_t cycles)
+{
+  uint64_t ticks = 0;
+
+  for (uint32_t left = chip8_cycles_to_tick(chip8); cycles >= left; left = chip8_cycles_to_tick(chip8))
+  {
+    cycles -= chip8_run_frame(chip8);
+    ticks++;
+  }
+
+  run_skipping_idle(chip8, (uint32_t)cycles);
+  chip8->frame_cycles += (uint32_t)cycles;
+  return ticks;
+}
 
-/* --------------------------- forward declaration -------------------------- */
-static void chip8_load_fontset(chip8_t *chip8);
+uint32_t chip8_seed_state(uint32_t seed)
+{
+  // the finaliser of murmur3, so consecutive seeds start far apart
+  seed ^= seed >> 16;
+  seed *= 0x85EBCA6Bu;
+  seed ^= seed >> 13;
+  seed *= 0xC2B2AE35u;
+  seed ^= seed >> 16;
+  return seed != 0 ? seed : 0x9E3779B9u; // xorshift never leaves zero
+}
 
-static void op_00E0(chip8_t *chip8);
-static void op_00EE(chip8_t *chip8);
-static void op_1nnn(chip8_t *chip8, uint16_t opcode);
-static void op_2nnn(chip8_t *chip8, uint16_t opcode);
-static void op_3xkk(chip8_t *chip8, uint16_t opcode);
-static void op_4xkk(chip8_t *chip8, uint16_t opcode);
-static void op_5xy0(chip8_t *chip8, uint16_t opcode);
-static void op_6xkk(chip8_t *chip8, uint16_t opcode);
-static void op_7xkk(chip8_t *chip8, uint16_t opcode);
-static void op_8xy0(chip8_t *chip8, uint16_t opcode);
-static void op_8xy1(chip8_t *chip8, uint16_t opcode);
-static void op_8xy2(chip8_t *chip8, uint16_t opcode);
-static void op_8xy3(chip8_t *chip8, uint16_t opcode);
-static void op_8xy4(chip8_t *chip8, uint16_t opcode);
-static void op_8xy5(chip8_t *chip8, uint16_t opcode);
-static void op_8xy6(chip8_t *chip8, uint16_t opcode);
-static void op_8xy7(chip8_t *chip8, uint16_t opcode);
-static void op_8xyE(chip8_t *chip8, uint16_t opcode);
-static void op_9xy0(chip8_t *chip8, uint16_t opcode);
-static void op_Annn(chip8_t *chip8, uint16_t opcode);
-static void op_Bnnn(chip8_t *chip8, uint16_t opcode);
-static void op_Cxkk(chip8_t *chip8, uint16_t opcode);
-static void op_Dxyn(chip8_t *chip8, uint16_t opcode);
-static void op_Ex9E(chip8_t *chip8, uint16_t opcode);
-static void op_ExA1(chip8_t *chip8, uint16_t opcode);
-static void op_Fx07(chip8_t *chip8, uint16_t opcode);
-static void op_Fx0A(chip8_t *chip8, uint16_t opcode);
-static void op_Fx15(chip8_t *chip8, uint16_t opcode);
-static void op_Fx18(chip8_t *chip8, uint16_t opcode);
-static void op_Fx1E(chip8_t *chip8, uint16_t opcode);
-static void op_Fx29(chip8_t *chip8, uint16_t opcode);
-static void op_Fx33(chip8_t *chip8, uint16_t opcode);
-static void op_Fx55(chip8_t *chip8, uint16_t opcode);
-static void op_Fx65(chip8_t *chip8, uint16_t opcode);
-
-static uint8_t fontset[FONTSET_SIZE] = {
-    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-    0x20, 0x60, 0x20, 0x20, 0x70, // 1
-    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-};
+void chip8_seed(chip8_t *chip8, uint32_t seed)
+{
+  chip8->rand_state = chip8_seed_state(seed);
+}
+
+void chip8_write_memory(chip8_t *chip8, uint16_t address, const uint8_t *bytes, uint16_t length)
+{
+  memcpy(&chip8->memory[address], bytes, length);
+  invalidate_code(chip8, address, length);
+}
+
+/* ------------------------------- save states ------------------------------ */
+
+/*
+  a save state, every number little endian:
+
+    "C8ST", u8 version, u32 hash of the loaded image
+    V0-VF, u16 I, u16 PC, u8 SP, u16 stack[16], u8 DT, u8 ST, u32 random state, u16 keypad bits
+    u16 run count, then per run: u16 address, u16 length, the bytes of memory from address on
+    u32 mask of the display rows with pixels lit, then a u64 per row in the mask, top row first
+
+  the runs are where memory differs from the image. a run carries up to
+  STATE_RUN_GAP unchanged bytes to join changes that are close together
+*/
 
-/* ---------------------------- initialisation/cycle functions ---------------------------- */
 /**
- * @brief loads fontset into memory, starting from 0x50
+ * @brief writes a little endian number to a save state
  *
- * @param chip8 pointer to chip8 struct
+ * @param out where the number goes
+ * @param value the number
+ * @return the byte after it
  */
-static void chip8_load_fontset(chip8_t *chip8)
+static inline uint8_t *put_u16(uint8_t *out, uint16_t value)
 {
-  // load font into memory
-  memcpy(&chip8->memory[FONTSET_START_ADDRESS], fontset, FONTSET_SIZE);
+  out[0] = value & 0xFF;
+  out[1] = value >> 8;
+  return out + 2;
+}
 
-  LOG_OK("Fontset loaded into memory");
+/**
+ * @brief 32 bit version of `put_u16`
+ */
+static inline uint8_t *put_u32(uint8_t *out, uint32_t value)
+{
+  out = put_u16(out, value & 0xFFFF);
+  return put_u16(out, value >> 16);
 }
 
-int chip8_load_rom(chip8_t *chip8, const char *rom_path)
+/**
+ * @brief 64 bit version of `put_u16`
+ */
+static inline uint8_t *put_u64(uint8_t *out, uint64_t value)
 {
-  FILE *rom_file = fopen(rom_path, "rb");
+  out = put_u32(out, value & 0xFFFFFFFFu);
+  return put_u32(out, value >> 32);
+}
 
-  if (rom_file == NULL)
+/**
+ * @brief steps over the next `length` bytes of a save state
+ *
+ * @param reader the save state being read
+ * @param length number of bytes
+ * @return the bytes, or a run of zeros with `reader->overrun` set when the state ends first
+ */
+static inline const uint8_t *take(state_reader_t *reader, size_t length)
+{
+  static const uint8_t zeros[REGISTER_COUNT]; // as long as the longest read of a fixed size
+
+  if (reader->overrun || length > reader->length - reader->offset)
   {
-    LOG_ERROR("Could not open %s", rom_path);
-    return 1;
+    reader->overrun = true;
+    return zeros;
   }
 
-  fseek(rom_file, 0, SEEK_END);
-  long rom_size = ftell(rom_file); // size of file in bytes
-  rewind(rom_file);
+  const uint8_t *bytes = &reader->bytes[reader->offset];
+  reader->offset += length;
+  return bytes;
+}
 
-  if (rom_size > MEMORY_SIZE - START_ADDRESS)
+/**
+ * @brief reads a little endian number from a save state
+ *
+ * @param reader the save state being read
+ * @return the number, `0` once the state has ended
+ */
+static inline uint16_t take_u16(state_reader_t *reader)
+{
+  const uint8_t *bytes = take(reader, 2);
+  return bytes[0] | bytes[1] << 8;
+}
+
+/**
+ * @brief 32 bit version of `take_u16`
+ */
+static inline uint32_t take_u32(state_reader_t *reader)
+{
+  uint32_t low = take_u16(reader);
+  return low | (uint32_t)take_u16(reader) << 16;
+}
+
+/**
+ * @brief 64 bit version of `take_u16`
+ */
+static inline uint64_t take_u64(state_reader_t *reader)
+{
+  uint64_t low = take_u32(reader);
+  return low | (uint64_t)take_u32(reader) << 32;
+}
+
+size_t chip8_save_state(const chip8_t *chip8, uint8_t *buffer, size_t buffer_size)
+{
+  if (buffer_size < CHIP8_STATE_MAX_SIZE)
   {
-    LOG_ERROR("%s is too large to fit in memory", rom_path);
-    fclose(rom_file);
-    return 1;
+    LOG_ERROR("A save state needs a buffer of %d bytes, got %zu", CHIP8_STATE_MAX_SIZE, buffer_size);
+    return 0;
   }
 
-  size_t bytes_read = fread(&chip8->memory[START_ADDRESS], 1, rom_size, rom_file);
+  uint8_t *out = buffer;
 
-  if (bytes_read != rom_size)
+  memcpy(out, STATE_MAGIC, STATE_MAGIC_SIZE);
+  out += STATE_MAGIC_SIZE;
+  *out++ = CHIP8_STATE_VERSION;
+  out = put_u32(out, chip8->image_hash);
+
+  memcpy(out, chip8->registers, REGISTER_COUNT);
+  out += REGISTER_COUNT;
+  out = put_u16(out, chip8->index);
+  out = put_u16(out, chip8->pc);
+  *out++ = chip8->sp;
+  for (int i = 0; i < STACK_DEPTH; ++i)
   {
-    // number of bytes read doesnt match the file size, ROM not loaded properly
-    LOG_ERROR("Failed to read from %s", rom_path);
-    fclose(rom_file);
-    return 1;
+    out = put_u16(out, chip8->stack[i]);
   }
-  else
+  *out++ = chip8->delay_timer;
+  *out++ = chip8->sound_timer;
+  out = put_u32(out, chip8->rand_state);
+  out = put_u32(out, chip8->frame_cycles);
+  *out++ = chip8->tick_remainder;
+
+  uint16_t keys = 0;
+  for (int key = 0; key < KEY_COUNT; ++key)
   {
-    LOG_OK("Read from %s successfully", rom_path);
+    keys |= (chip8->keypad[key] != 0) << key;
   }
+  out = put_u16(out, keys);
 
-  fclose(rom_file);
-  return 0;
-}
+  uint8_t *run_count = out;
+  uint16_t runs = 0;
+  out += 2;
 
-void chip8_initialise(chip8_t *chip8)
-{
-  memset(chip8, 0, sizeof(chip8_t)); // clear memory
+  uint32_t address = 0;
+  while (address < MEMORY_SIZE)
+  {
+    if (chip8->memory[address] == chip8->code->image[address])
+    {
+      address++;
+      continue;
+    }
 
-  chip8_load_fontset(chip8);
+    // grow the run until STATE_RUN_GAP bytes in a row are unchanged
+    uint32_t end = address + 1;
+    for (uint32_t next = end; next < MEMORY_SIZE && next <= end + STATE_RUN_GAP; ++next)
+    {
+      if (chip8->memory[next] != chip8->code->image[next])
+      {
+        end = next + 1;
+      }
+    }
 
-  // seed ONCE only. see https://stackoverflow.com/questions/7343833/srand-why-call-it-only-once
-  srand((unsigned)time(NULL));
+    out = put_u16(out, address);
+    out = put_u16(out, end - address);
+    memcpy(out, &chip8->memory[address], end - address);
+    out += end - address;
+    runs++;
+    address = end;
+  }
+  put_u16(run_count, runs);
 
-  chip8->pc = 0x200;
+  uint32_t lit_rows = 0;
+  for (int row = 0; row < DISPLAY_HEIGHT; ++row)
+  {
+    lit_rows |= (uint32_t)(chip8->display[row] != 0) << row;
+  }
+  out = put_u32(out, lit_rows);
+  for (int row = 0; row < DISPLAY_HEIGHT; ++row)
+  {
+    if (chip8->display[row] != 0)
+    {
+      out = put_u64(out, chip8->display[row]);
+    }
+  }
+
+  return out - buffer;
 }
 
-void chip8_cycle(chip8_t *chip8)
+int chip8_load_state(chip8_t *chip8, const uint8_t *buffer, size_t buffer_size)
 {
-  uint16_t opcode = chip8->memory[chip8->pc] << 8 | chip8->memory[chip8->pc + 1]; // fetch opcode
-
-  chip8->pc += 2; // increment PC before executing anything
+  state_reader_t reader = {.bytes = buffer, .length = buffer_size};
 
-  LOG_INFO("PC: %x", chip8->pc);
-  LOG_INFO("Opcode: %x", opcode);
+  if (memcmp(take(&reader, STATE_MAGIC_SIZE), STATE_MAGIC, STATE_MAGIC_SIZE) != 0)
+  {
+    LOG_ERROR("Not a save state");
+    return 1;
+  }
+  uint8_t version = *take(&reader, 1);
+  if (version != CHIP8_STATE_VERSION)
+  {
+    LOG_ERROR("Save state version %u is not supported, expected %u", version, CHIP8_STATE_VERSION);
+    return 1;
+  }
+  if (take_u32(&reader) != chip8->image_hash)
+  {
+    LOG_ERROR("Save state was made with a different ROM");
+    return 1;
+  }
 
-  // decode and execute
-  switch (opcode & 0xF000)
+  // read everything into locals first, so a bad state leaves the machine untouched
+  uint8_t registers[REGISTER_COUNT];
+  memcpy(registers, take(&reader, REGISTER_COUNT), REGISTER_COUNT);
+  uint16_t index = take_u16(&reader);
+  uint16_t pc = take_u16(&reader);
+  uint8_t sp = *take(&reader, 1);
+  uint16_t stack[STACK_DEPTH];
+  for (int i = 0; i < STACK_DEPTH; ++i)
   {
-  case 0x0000:
-    switch (opcode & 0x00FF)
-    {
-    case 0x00E0:
-      LOG_INFO("00E0 - CLS");
-      op_00E0(chip8);
-      break;
-    case 0x00EE:
-      LOG_INFO("00EE - RET");
-      op_00EE(chip8);
-      break;
-    }
-    break;
-  case 0x1000:
-    LOG_INFO("1nnn - JP 0x%03X", opcode & 0x0FFF);
-    op_1nnn(chip8, opcode);
-    break;
-  case 0x2000:
-    LOG_INFO("2nnn - CALL 0x%03X", opcode & 0x0FFF);
-    op_2nnn(chip8, opcode);
-    break;
-  case 0x3000:
-    LOG_INFO("3xkk - SE V%X, 0x%02X", (opcode & 0x0F00) >> 8, opcode & 0x00FF);
-    op_3xkk(chip8, opcode);
-    break;
-  case 0x4000:
-    LOG_INFO("4xkk - SNE V%X, 0x%02X", (opcode & 0x0F00) >> 8, opcode & 0x00FF);
-    op_4xkk(chip8, opcode);
-    break;
-  case 0x5000:
-    LOG_INFO("5xy0 - SE V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-    op_5xy0(chip8, opcode);
-    break;
-  case 0x6000:
-    LOG_INFO("6xkk - LD V%X, 0x%02X", (opcode & 0x0F00) >> 8, opcode & 0x00FF);
-    op_6xkk(chip8, opcode);
-    break;
-  case 0x7000:
-    LOG_INFO("7xkk - ADD V%X, 0x%02X", (opcode & 0x0F00) >> 8, opcode & 0x00FF);
-    op_7xkk(chip8, opcode);
-    break;
-  case 0x8000:
-    switch (opcode & 0x000F)
+    stack[i] = take_u16(&reader);
+  }
+  uint8_t delay_timer = *take(&reader, 1);
+  uint8_t sound_timer = *take(&reader, 1);
+  uint32_t rand_state = take_u32(&reader);
+  uint32_t frame_cycles = take_u32(&reader);
+  uint8_t tick_remainder = *take(&reader, 1);
+  uint16_t keys = take_u16(&reader);
+
+  uint8_t memory[MEMORY_SIZE];
+  memcpy(memory, chip8->code->image, MEMORY_SIZE);
+
+  uint16_t runs = take_u16(&reader);
+  for (uint16_t run = 0; run < runs && !reader.overrun; ++run)
+  {
+    uint16_t address = take_u16(&reader);
+    uint16_t length = take_u16(&reader);
+    if ((uint32_t)address + length > MEMORY_SIZE)
     {
-    case 0x0000:
-      LOG_INFO("8xy0 - LD V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-      op_8xy0(chip8, opcode);
-      break;
-    case 0x0001:
-      LOG_INFO("8xy1 - OR V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-      op_8xy1(chip8, opcode);
-      break;
-    case 0x0002:
-      LOG_INFO("8xy2 - AND V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-      op_8xy2(chip8, opcode);
-      break;
-    case 0x0003:
-      LOG_INFO("8xy3 - XOR V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-      op_8xy3(chip8, opcode);
-      break;
-    case 0x0004:
-      LOG_INFO("8xy4 - ADD V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-      op_8xy4(chip8, opcode);
-      break;
-    case 0x0005:
-      LOG_INFO("8xy5 - SUB V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-      op_8xy5(chip8, opcode);
-      break;
-    case 0x0006:
-      LOG_INFO("8xy6 - SHR V%X", (opcode & 0x0F00) >> 8);
-      op_8xy6(chip8, opcode);
-      break;
-    case 0x0007:
-      LOG_INFO("8xy7 - SUBN V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-      op_8xy7(chip8, opcode);
-      break;
-    case 0x000E:
-      LOG_INFO("8xyE - SHL V%X", (opcode & 0x0F00) >> 8);
-      op_8xyE(chip8, opcode);
-      break;
+      LOG_ERROR("Save state is corrupt, a run of memory goes past 0x%X", MEMORY_SIZE);
+      return 1;
     }
-    break;
-  case 0x9000:
-    LOG_INFO("9xy0 - SNE V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-    op_9xy0(chip8, opcode);
-    break;
-  case 0xA000:
-    LOG_INFO("Annn - LD I, 0x%03X", opcode & 0x0FFF);
-    op_Annn(chip8, opcode);
-    break;
-  case 0xB000:
-    LOG_INFO("Bnnn - JP V0, 0x%03X", opcode & 0x0FFF);
-    op_Bnnn(chip8, opcode);
-    break;
-  case 0xC000:
-    LOG_INFO("Cxkk - RND V%X, 0x%02X", (opcode & 0x0F00) >> 8, opcode & 0x00FF);
-    op_Cxkk(chip8, opcode);
-    break;
-  case 0xD000:
-    LOG_INFO("Dxyn - DRW V%X, V%X, %d", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4, opcode & 0x000F);
-    op_Dxyn(chip8, opcode);
-    break;
-  case 0xE000:
-    switch (opcode & 0x00FF)
+    memcpy(&memory[address], take(&reader, length), reader.overrun ? 0 : length);
+  }
+
+  uint64_t display[DISPLAY_HEIGHT];
+  uint32_t lit_rows = take_u32(&reader);
+  for (int row = 0; row < DISPLAY_HEIGHT; ++row)
+  {
+    display[row] = lit_rows >> row & 1 ? take_u64(&reader) : 0;
+  }
+
+  if (reader.overrun)
+  {
+    LOG_ERROR("Save state is truncated");
+    return 1;
+  }
+
+  if (rand_state == 0)
+  {
+    LOG_ERROR("Save state is corrupt, its random number generator is stuck at zero");
+    return 1;
+  }
+
+  if (tick_remainder >= CHIP8_TIMER_HZ)
+  {
+    LOG_ERROR("Save state is corrupt, the timers' carried fraction is out of range");
+    return 1;
+  }
+
+  // only drop decoded code where memory actually changes
+  uint32_t address = 0;
+  while (address < MEMORY_SIZE)
+  {
+    if (memory[address] == chip8->memory[address])
     {
-    case 0x009E:
-      LOG_INFO("Ex9E - SKP V%X", (opcode & 0x0F00) >> 8);
-      op_Ex9E(chip8, opcode);
-      break;
-    case 0x00A1:
-      LOG_INFO("ExA1 - SKNP V%X", (opcode & 0x0F00) >> 8);
-      op_ExA1(chip8, opcode);
-      break;
+      address++;
+      continue;
     }
-    break;
-  case 0xF000:
-    switch (opcode & 0x00FF)
+
+    uint32_t end = address + 1;
+    while (end < MEMORY_SIZE && memory[end] != chip8->memory[end])
     {
-    case 0x0007:
-      LOG_INFO("Fx07 - LD V%X, DT", (opcode & 0x0F00) >> 8);
-      op_Fx07(chip8, opcode);
-      break;
-    case 0x000A:
-      LOG_INFO("Fx0A - LD V%X, K", (opcode & 0x0F00) >> 8);
-      op_Fx0A(chip8, opcode);
-      break;
-    case 0x0015:
-      LOG_INFO("Fx15 - LD DT, V%X", (opcode & 0x0F00) >> 8);
-      op_Fx15(chip8, opcode);
-      break;
-    case 0x0018:
-      LOG_INFO("Fx18 - LD ST, V%X", (opcode & 0x0F00) >> 8);
-      op_Fx18(chip8, opcode);
-      break;
-    case 0x001E:
-      LOG_INFO("Fx1E - ADD I, V%X", (opcode & 0x0F00) >> 8);
-      op_Fx1E(chip8, opcode);
-      break;
-    case 0x0029:
-      LOG_INFO("Fx29 - LD F, V%X", (opcode & 0x0F00) >> 8);
-      op_Fx29(chip8, opcode);
-      break;
-    case 0x0033:
-      LOG_INFO("Fx33 - LD B, V%X", (opcode & 0x0F00) >> 8);
-      op_Fx33(chip8, opcode);
-      break;
-    case 0x0055:
-      LOG_INFO("Fx55 - LD [I], V%X", (opcode & 0x0F00) >> 8);
-      op_Fx55(chip8, opcode);
-      break;
-    case 0x0065:
-      LOG_INFO("Fx65 - LD V%X, [I]", (opcode & 0x0F00) >> 8);
-      op_Fx65(chip8, opcode);
-      break;
+      end++;
     }
-    break;
-  default:
-    // invalid opcode
-    LOG_ERROR("Invalid opcode: 0x%X", opcode);
-    break;
+    chip8_write_memory(chip8, address, &memory[address], end - address);
+    address = end;
+  }
+
+  memcpy(chip8->registers, registers, REGISTER_COUNT);
+  chip8->index = index;
+  chip8->pc = pc;
+  chip8->sp = sp;
+  memcpy(chip8->stack, stack, sizeof(stack));
+  chip8->delay_timer = delay_timer;
+  chip8->sound_timer = sound_timer;
+  chip8->rand_state = rand_state;
+  chip8->frame_cycles = frame_cycles;
+  chip8->tick_remainder = tick_remainder;
+  for (int key = 0; key < KEY_COUNT; ++key)
+  {
+    chip8->keypad[key] = keys >> key & 1;
   }
+  memcpy(chip8->display, display, sizeof(display));
+  chip8->dirty_rows = ALL_ROWS_DIRTY;
+
+  return 0;
 }
 
 /* ------------------------- opcode implementations ------------------------- */
 
+/**
+ * @brief traps any opcode that isn't a CHIP-8 instruction
+ *
+ * it does nothing but count. a ROM that runs into empty memory traps on every
+ * instruction, so only the first one is logged
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param instruction the current instruction, already decoded
+ */
+static void op_invalid(chip8_t *chip8, const instruction_t *instruction)
+{
+  if (chip8->invalid_opcodes++ == 0)
+  {
+    LOG_ERROR("Invalid opcode: 0x%X at 0x%03X, any more are only counted", instruction->opcode, (chip8->pc - 2) & (MEMORY_SIZE - 1));
+  }
+}
+
 /**
  * @brief 00E0 - CLS
  *
  * Clear the display.
  *
  * @param chip8 pointer to chip8 struct
+ * @param instruction the current instruction, already decoded
  */
-static void op_00E0(chip8_t *chip8)
+static void op_00E0(chip8_t *chip8, const instruction_t *instruction)
 {
   memset(chip8->display, 0, sizeof(chip8->display));
+  chip8->dirty_rows = ALL_ROWS_DIRTY;
 }
 
 /**
@@ -322,10 +1871,11 @@ static void op_00E0(chip8_t *chip8)
  * Returns from a subroutine.
  *
  * @param chip8 pointer to chip8 struct
+ * @param instruction the current instruction, already decoded
  */
-static void op_00EE(chip8_t *chip8)
+static void op_00EE(chip8_t *chip8, const instruction_t *instruction)
 {
-  chip8->pc = chip8->stack[--chip8->sp];
+  chip8->pc = chip8->stack[--chip8->sp & (STACK_DEPTH - 1)]; // a stack underflow wraps around instead of reading past the stack
 }
 
 /**
@@ -334,11 +1884,11 @@ static void op_00EE(chip8_t *chip8)
  * Jump to location nnn.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_1nnn(chip8_t *chip8, uint16_t opcode)
+static void op_1nnn(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint16_t nnn = opcode & 0x0FFF;
+  uint16_t nnn = instruction->nnn;
   chip8->pc = nnn;
 }
 
@@ -348,13 +1898,13 @@ static void op_1nnn(chip8_t *chip8, uint16_t opcode)
  * Call subroutine at nnn.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_2nnn(chip8_t *chip8, uint16_t opcode)
+static void op_2nnn(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint16_t nnn = opcode & 0x0FFF;
+  uint16_t nnn = instruction->nnn;
 
-  chip8->stack[chip8->sp++] = chip8->pc;
+  chip8->stack[chip8->sp++ & (STACK_DEPTH - 1)] = chip8->pc; // a stack overflow wraps around instead of writing past the stack
   chip8->pc = nnn;
 }
 
@@ -364,12 +1914,12 @@ static void op_2nnn(chip8_t *chip8, uint16_t opcode)
  * Skip next instruction if Vx = kk.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_3xkk(chip8_t *chip8, uint16_t opcode)
+static void op_3xkk(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t kk = opcode & 0x00FF;
+  uint8_t x = instruction->x;
+  uint8_t kk = instruction->kk;
 
   if (chip8->registers[x] == kk)
   {
@@ -383,12 +1933,12 @@ static void op_3xkk(chip8_t *chip8, uint16_t opcode)
  * Skip next instruction if Vx != kk.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_4xkk(chip8_t *chip8, uint16_t opcode)
+static void op_4xkk(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t kk = opcode & 0x00FF;
+  uint8_t x = instruction->x;
+  uint8_t kk = instruction->kk;
 
   if (chip8->registers[x] != kk)
   {
@@ -402,12 +1952,12 @@ static void op_4xkk(chip8_t *chip8, uint16_t opcode)
  * Skip next instruction if Vx = Vy.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_5xy0(chip8_t *chip8, uint16_t opcode)
+static void op_5xy0(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
 
   if (chip8->registers[x] == chip8->registers[y])
   {
@@ -421,12 +1971,12 @@ static void op_5xy0(chip8_t *chip8, uint16_t opcode)
  * Set Vx = kk.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_6xkk(chip8_t *chip8, uint16_t opcode)
+static void op_6xkk(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t kk = opcode & 0x00FF;
+  uint8_t x = instruction->x;
+  uint8_t kk = instruction->kk;
 
   chip8->registers[x] = kk;
 }
@@ -437,12 +1987,12 @@ static void op_6xkk(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vx + kk.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_7xkk(chip8_t *chip8, uint16_t opcode)
+static void op_7xkk(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t kk = opcode & 0x00FF;
+  uint8_t x = instruction->x;
+  uint8_t kk = instruction->kk;
 
   chip8->registers[x] += kk;
 }
@@ -453,12 +2003,12 @@ static void op_7xkk(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vy.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_8xy0(chip8_t *chip8, uint16_t opcode)
+static void op_8xy0(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
 
   chip8->registers[x] = chip8->registers[y];
 }
@@ -469,12 +2019,12 @@ static void op_8xy0(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vx OR Vy.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_8xy1(chip8_t *chip8, uint16_t opcode)
+static void op_8xy1(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
 
   chip8->registers[x] |= chip8->registers[y];
 }
@@ -485,12 +2035,12 @@ static void op_8xy1(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vx AND Vy.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_8xy2(chip8_t *chip8, uint16_t opcode)
+static void op_8xy2(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
 
   chip8->registers[x] &= chip8->registers[y];
 }
@@ -501,12 +2051,12 @@ static void op_8xy2(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vx XOR Vy.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_8xy3(chip8_t *chip8, uint16_t opcode)
+static void op_8xy3(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
 
   chip8->registers[x] ^= chip8->registers[y];
 }
@@ -517,12 +2067,12 @@ static void op_8xy3(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vx + Vy, set VF = carry.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_8xy4(chip8_t *chip8, uint16_t opcode)
+static void op_8xy4(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
 
   uint16_t sum = chip8->registers[x] + chip8->registers[y];
 
@@ -544,12 +2094,12 @@ static void op_8xy4(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vx - Vy, set VF = NOT borrow.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_8xy5(chip8_t *chip8, uint16_t opcode)
+static void op_8xy5(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
 
   if (chip8->registers[x] > chip8->registers[y])
   {
@@ -569,11 +2119,11 @@ static void op_8xy5(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vx SHR 1.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_8xy6(chip8_t *chip8, uint16_t opcode)
+static void op_8xy6(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
 
   chip8->registers[0xF] = chip8->registers[x] & 0x01; // store LSB in VF
 
@@ -586,12 +2136,12 @@ static void op_8xy6(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vy - Vx, set VF = NOT borrow.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_8xy7(chip8_t *chip8, uint16_t opcode)
+static void op_8xy7(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
 
   if (chip8->registers[y] > chip8->registers[x])
   {
@@ -611,11 +2161,11 @@ static void op_8xy7(chip8_t *chip8, uint16_t opcode)
  * Set Vx = Vx SHL 1.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_8xyE(chip8_t *chip8, uint16_t opcode)
+static void op_8xyE(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
 
   chip8->registers[0xF] = (chip8->registers[x] & 0x80) >> 7; // store MSB in VF
 
@@ -628,12 +2178,12 @@ static void op_8xyE(chip8_t *chip8, uint16_t opcode)
  * Skip next instruction if Vx != Vy.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_9xy0(chip8_t *chip8, uint16_t opcode)
+static void op_9xy0(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
 
   if (chip8->registers[x] != chip8->registers[y])
   {
@@ -647,11 +2197,11 @@ static void op_9xy0(chip8_t *chip8, uint16_t opcode)
  * Set I = nnn.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Annn(chip8_t *chip8, uint16_t opcode)
+static void op_Annn(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint16_t nnn = opcode & 0x0FFF;
+  uint16_t nnn = instruction->nnn;
   chip8->index = nnn;
 }
 
@@ -661,11 +2211,11 @@ static void op_Annn(chip8_t *chip8, uint16_t opcode)
  * Jump to location nnn + V0.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Bnnn(chip8_t *chip8, uint16_t opcode)
+static void op_Bnnn(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint16_t nnn = opcode & 0x0FFF;
+  uint16_t nnn = instruction->nnn;
   chip8->pc = nnn + chip8->registers[0];
 }
 
@@ -675,15 +2225,20 @@ static void op_Bnnn(chip8_t *chip8, uint16_t opcode)
  * Set Vx = random byte AND kk.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Cxkk(chip8_t *chip8, uint16_t opcode)
+static void op_Cxkk(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t kk = opcode & 0x00FF;
-
-  // generate a random byte and AND it with kk
-  chip8->registers[x] = (rand() % 256) & kk;
+  uint8_t x = instruction->x;
+  uint8_t kk = instruction->kk;
+
+  // generate a random byte and AND it with kk. the generator is a 32 bit xorshift, its top byte is the least correlated
+  uint32_t state = chip8->rand_state;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  chip8->rand_state = state;
+  chip8->registers[x] = (state >> 24) & kk;
 }
 
 /**
@@ -692,13 +2247,13 @@ static void op_Cxkk(chip8_t *chip8, uint16_t opcode)
  * Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Dxyn(chip8_t *chip8, uint16_t opcode)
+static void op_Dxyn(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
-  uint8_t y = (opcode & 0x00F0) >> 4;
-  uint8_t n = opcode & 0x000F; // height of sprite in pixels; sprites are ALWAYS 8 pixels wide
+  uint8_t x = instruction->x;
+  uint8_t y = instruction->y;
+  uint8_t n = instruction->n; // height of sprite in pixels; sprites are ALWAYS 8 pixels wide
 
   uint8_t pos_x = chip8->registers[x] % DISPLAY_WIDTH;
   uint8_t pos_y = chip8->registers[y] % DISPLAY_HEIGHT;
@@ -707,23 +2262,25 @@ static void op_Dxyn(chip8_t *chip8, uint16_t opcode)
 
   for (int row = 0; row < n; ++row)
   {
-    uint8_t sprite_byte = chip8->memory[chip8->index + row];
-
-    for (int col = 0; col < 8; ++col)
+    uint8_t screen_row = pos_y + row;
+    if (screen_row >= DISPLAY_HEIGHT)
     {
-      uint8_t sprite_pixel = sprite_byte & (0x80 >> col);
-      uint16_t screen_index = ((pos_y + row) * DISPLAY_WIDTH) + (pos_x + col);
-      uint16_t screen_pixel = chip8->display[screen_index];
+      break; // sprites are clipped at the bottom edge
+    }
 
-      if (sprite_pixel != 0)
-      {
-        if (screen_pixel)
-        { // set collision to true
-          chip8->registers[0xF] = 1;
-        }
+    // line the 8 sprite pixels up with the screen row, pixels past the right edge fall off
+    uint64_t sprite_row = ((uint64_t)chip8->memory[(chip8->index + row) & (MEMORY_SIZE - 1)] << (DISPLAY_WIDTH - 8)) >> pos_x;
 
-        chip8->display[screen_index] ^= 1; // flip screen pixel with XOR
-      }
+    if (chip8->display[screen_row] & sprite_row)
+    { // set collision to true
+      chip8->registers[0xF] = 1;
+    }
+
+    chip8->display[screen_row] ^= sprite_row; // flip screen pixels with XOR
+
+    if (sprite_row != 0)
+    {
+      chip8->dirty_rows |= 1u << screen_row;
     }
   }
 }
@@ -731,16 +2288,17 @@ static void op_Dxyn(chip8_t *chip8, uint16_t opcode)
 /**
  * @brief Ex9E - SKP Vx
  *
- * Skip next instruction if key with the value of Vx is pressed.
+ * Skip next instruction if key with the value of Vx is pressed. Keys past
+ * the keypad read as released.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Ex9E(chip8_t *chip8, uint16_t opcode)
+static void op_Ex9E(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t key = chip8->registers[instruction->x];
 
-  if (chip8->keypad[chip8->registers[x]])
+  if (key < KEY_COUNT && chip8->keypad[key])
   { // key is activated
     chip8->pc += 2;
   }
@@ -749,16 +2307,17 @@ static void op_Ex9E(chip8_t *chip8, uint16_t opcode)
 /**
  * @brief ExA1 - SKNP Vx
  *
- * Skip next instruction if key with the value of Vx is not pressed.
+ * Skip next instruction if key with the value of Vx is not pressed. Keys
+ * past the keypad read as released.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_ExA1(chip8_t *chip8, uint16_t opcode)
+static void op_ExA1(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t key = chip8->registers[instruction->x];
 
-  if (!chip8->keypad[chip8->registers[x]])
+  if (key >= KEY_COUNT || !chip8->keypad[key])
   { // key is not activated
     chip8->pc += 2;
   }
@@ -770,11 +2329,11 @@ static void op_ExA1(chip8_t *chip8, uint16_t opcode)
  * Set Vx = delay timer value.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Fx07(chip8_t *chip8, uint16_t opcode)
+static void op_Fx07(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
   chip8->registers[x] = chip8->delay_timer;
 }
 
@@ -784,11 +2343,11 @@ static void op_Fx07(chip8_t *chip8, uint16_t opcode)
  * Wait for a key press, store the value of the key in Vx.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Fx0A(chip8_t *chip8, uint16_t opcode)
+static void op_Fx0A(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
 
   for (int key = 0; key < KEY_COUNT; ++key)
   {
@@ -810,11 +2369,11 @@ static void op_Fx0A(chip8_t *chip8, uint16_t opcode)
  * Set delay timer = Vx.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Fx15(chip8_t *chip8, uint16_t opcode)
+static void op_Fx15(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
   chip8->delay_timer = chip8->registers[x];
 }
 
@@ -824,11 +2383,11 @@ static void op_Fx15(chip8_t *chip8, uint16_t opcode)
  * Set sound timer = Vx.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Fx18(chip8_t *chip8, uint16_t opcode)
+static void op_Fx18(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
   chip8->sound_timer = chip8->registers[x];
 }
 
@@ -838,11 +2397,11 @@ static void op_Fx18(chip8_t *chip8, uint16_t opcode)
  * Set I = I + Vx.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Fx1E(chip8_t *chip8, uint16_t opcode)
+static void op_Fx1E(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
   chip8->index += chip8->registers[x];
 }
 
@@ -852,11 +2411,11 @@ static void op_Fx1E(chip8_t *chip8, uint16_t opcode)
  * Set I = location of sprite for digit Vx.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Fx29(chip8_t *chip8, uint16_t opcode)
+static void op_Fx29(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
   uint8_t digit = chip8->registers[x];
 
   // fontset start at 0x50 and each character is 5 bytes
@@ -870,21 +2429,23 @@ static void op_Fx29(chip8_t *chip8, uint16_t opcode)
  * Store BCD representation of Vx in memory locations I, I+1, and I+2.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Fx33(chip8_t *chip8, uint16_t opcode)
+static void op_Fx33(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
   uint8_t value = chip8->registers[x];
 
   // hundreds digit
-  chip8->memory[chip8->index] = value / 100;
+  chip8->memory[chip8->index & (MEMORY_SIZE - 1)] = value / 100;
 
   // tens digit
-  chip8->memory[chip8->index + 1] = (value / 10) % 10;
+  chip8->memory[(chip8->index + 1) & (MEMORY_SIZE - 1)] = (value / 10) % 10;
 
   // ones digit
-  chip8->memory[chip8->index + 2] = value % 10;
+  chip8->memory[(chip8->index + 2) & (MEMORY_SIZE - 1)] = value % 10;
+
+  invalidate_code(chip8, chip8->index, 3); // the ROM may have patched itself
 }
 
 /**
@@ -893,16 +2454,18 @@ static void op_Fx33(chip8_t *chip8, uint16_t opcode)
  * Store registers V0 through Vx in memory starting at location I.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Fx55(chip8_t *chip8, uint16_t opcode)
+static void op_Fx55(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
 
   for (int i = 0; i <= x; ++i)
   {
-    chip8->memory[chip8->index + i] = chip8->registers[i];
+    chip8->memory[(chip8->index + i) & (MEMORY_SIZE - 1)] = chip8->registers[i];
   }
+
+  invalidate_code(chip8, chip8->index, x + 1); // the ROM may have patched itself
 }
 
 /**
@@ -911,14 +2474,14 @@ static void op_Fx55(chip8_t *chip8, uint16_t opcode)
  * Read registers V0 through Vx from memory starting at location I.
  *
  * @param chip8 pointer to chip8 struct
- * @param opcode the current opcode
+ * @param instruction the current instruction, already decoded
  */
-static void op_Fx65(chip8_t *chip8, uint16_t opcode)
+static void op_Fx65(chip8_t *chip8, const instruction_t *instruction)
 {
-  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t x = instruction->x;
 
   for (int i = 0; i <= x; ++i)
   {
-    chip8->registers[i] = chip8->memory[chip8->index + i];
+    chip8->registers[i] = chip8->memory[(chip8->index + i) & (MEMORY_SIZE - 1)];
   }
 }
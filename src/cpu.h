@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 #define MEMORY_SIZE 4096
 #define REGISTER_COUNT 16
@@ -11,6 +13,41 @@
 #define FONTSET_SIZE 80
 #define FONTSET_START_ADDRESS 0x50
 #define START_ADDRESS 0x200
+#define ALL_ROWS_DIRTY 0xFFFFFFFFu // one bit per display row
+#define BLOCK_MAX_LENGTH 32          // longest basic block, in instructions
+#define CHIP8_TIMER_HZ 60            // the delay and sound timers count down this many times a second
+#define CHIP8_DEFAULT_CPU_HZ 700     // instructions per second when the config leaves `cpu_hz` at 0
+#define CHIP8_STATE_VERSION 3        // bumped whenever the save state format changes
+#define CHIP8_STATE_MAX_SIZE 4608    // no save state is larger than this, whatever the machine holds
+
+typedef struct instruction
+{
+  uint16_t opcode; // raw opcode
+  uint16_t nnn;    // lowest 12 bits, an address
+  uint8_t id;      // which instruction it is, 0 while a decode cache slot is empty
+  uint8_t x;       // lower 4 bits of the high byte, a register
+  uint8_t y;       // upper 4 bits of the low byte, a register
+  uint8_t n;       // lowest 4 bits
+  uint8_t kk;      // lowest 8 bits, a byte
+} instruction_t;
+
+typedef struct chip8_config
+{
+  bool verbose_logging; // log loading, and every instruction executed in a build with CHIP8_TRACE_LOG
+  uint32_t cpu_hz;      // instructions per second, so the timers tick every cpu_hz / CHIP8_TIMER_HZ instructions
+} chip8_config_t;       // settings each instance carries, zeroed settings are the defaults
+
+typedef struct chip8_code
+{
+  uint8_t image[MEMORY_SIZE];              // memory as loaded, fontset and ROM, save states only store what differs
+  instruction_t decode_cache[MEMORY_SIZE]; // instructions decoded on first use, one slot per address
+  uint8_t block_length[MEMORY_SIZE];       // instructions in the basic block starting at each address, 0 until built
+  uint8_t idle_state[MEMORY_SIZE];         // whether each address is in a loop worth searching for idling, 0 until checked
+} chip8_code_t;                            // what the core works out from the code in memory, kept apart from the machine state
+
+struct jit;
+struct trace;
+struct profile;
 
 typedef struct chip8
 {
@@ -21,9 +58,24 @@ typedef struct chip8
   uint16_t stack[STACK_DEPTH];                     // stack for subroutine calls
   uint8_t sp;                                      // stack pointer
   uint8_t keypad[KEY_COUNT];                       // keypad state for 16 keys
-  uint8_t display[DISPLAY_WIDTH * DISPLAY_HEIGHT]; // 64 by 32 display
+  uint64_t display[DISPLAY_HEIGHT];                // 64 by 32 display, one word per row, bit 63 is the leftmost pixel
+  uint32_t dirty_rows;                             // bit n is set when display row n changed since it was last drawn
   uint8_t delay_timer;                             // delay timer
   uint8_t sound_timer;                             // sound timer
+  uint32_t rand_state;                             // state of the Cxkk xorshift generator, never 0
+  uint32_t frame_cycles;                           // instructions executed since the timers last ticked
+  uint8_t tick_remainder;                          // what's left of cpu_hz / CHIP8_TIMER_HZ, carried into the next frame
+  uint32_t image_hash;                             // hash of the memory as loaded, a save state only loads into the ROM it came from
+  chip8_config_t config;                           // this instance's settings, nothing in the core reads process-wide ones
+  chip8_code_t *code;                              // decoded instructions and the other caches, allocated by chip8_initialise
+  uint32_t idle_wait;                              // instructions the timed runs execute before looking for an idle loop again
+  uint32_t idle_interval;                          // what `idle_wait` was last set to, 0 after an idle loop was skipped
+  uint32_t idle_looks;                             // times the timed runs have looked for an idle loop
+  uint64_t idle_skipped;                           // instructions the timed runs skipped in idle loops instead of executing
+  uint64_t invalid_opcodes;                        // invalid opcodes executed, only the first one is logged
+  struct jit *jit;                                 // native code for basic blocks, NULL unless chip8_jit_enable was called
+  struct trace *trace;                             // every instruction `chip8_run` executes is recorded here, NULL unless tracing
+  struct profile *profile;                         // execution counts, NULL unless chip8_profile_enable was called
 } chip8_t;
 
 /* --------------------------- function prototypes -------------------------- */
@@ -37,12 +89,36 @@ typedef struct chip8
  */
 int chip8_load_rom(chip8_t *chip8, const char *rom_path);
 
+/**
+ * @brief loads a ROM that is already in memory, eg. one shared by many instances
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param rom the ROM's bytes
+ * @param rom_size number of bytes in `rom`
+ * @return `0` on success, `1` on failure
+ */
+int chip8_load_rom_data(chip8_t *chip8, const uint8_t *rom, size_t rom_size);
+
 /**
  * @brief initialises the chip8 struct
  *
+ * instances share nothing, so separate instances can be initialised and run
+ * on separate threads. call chip8_release before initialising it again
+ *
  * @param chip8 pointer to chip8 struct
+ * @param config settings for this instance, copied, `NULL` for the defaults
+ * @return `0` on success, `1` on failure
  */
-void chip8_initialise(chip8_t *chip8);
+int chip8_initialise(chip8_t *chip8, const chip8_config_t *config);
+
+/**
+ * @brief frees everything the instance allocated: its caches, the jit and the profile
+ *
+ * the chip8 struct itself belongs to the caller
+ *
+ * @param chip8 pointer to chip8 struct, initialised
+ */
+void chip8_release(chip8_t *chip8);
 
 /**
  * @brief executes a single chip8 cycle
@@ -50,3 +126,175 @@ void chip8_initialise(chip8_t *chip8);
  * @param chip8 pointer to chip8 struct
  */
 void chip8_cycle(chip8_t *chip8);
+
+/**
+ * @brief executes `cycles` chip8 cycles back to back, leaving the timers alone
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles number of instructions to execute
+ */
+void chip8_run(chip8_t *chip8, uint32_t cycles);
+
+/**
+ * @brief seeds the instance's Cxkk random number generator
+ *
+ * `chip8_initialise` seeds from the clock, seed after it for a run that
+ * repeats exactly. the same seed always gives the same numbers
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param seed any value, 0 included
+ */
+void chip8_seed(chip8_t *chip8, uint32_t seed);
+
+/**
+ * @brief the generator state `chip8_seed` starts from, for engines that keep it outside a chip8 struct
+ *
+ * @param seed any value, 0 included
+ * @return the state, never 0
+ */
+uint32_t chip8_seed_state(uint32_t seed);
+
+/**
+ * @brief executes one frame: the instructions left before the timers tick, then the tick
+ *
+ * a frame is cpu_hz / CHIP8_TIMER_HZ instructions, the fraction carried from
+ * frame to frame, so every second of frames adds up to exactly `cpu_hz`. the
+ * timers depend on nothing but the instruction count, so a run gives the same
+ * result however fast or busy the host is. once the ROM is spinning in a loop
+ * waiting for the delay timer or a key, the rest of the frame is skipped
+ * rather than executed, with the same result
+ *
+ * @param chip8 pointer to chip8 struct
+ * @return number of instructions executed
+ */
+uint32_t chip8_run_frame(chip8_t *chip8);
+
+/**
+ * @brief executes `cycles` instructions, ticking the timers at every frame boundary they cross
+ *
+ * splitting a run into any number of calls gives the same result as one call,
+ * eg. to change keys on an exact instruction
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles number of instructions to execute
+ * @return number of times the timers ticked
+ */
+uint64_t chip8_run_timed(chip8_t *chip8, uint64_t cycles);
+
+/**
+ * @brief counts the instructions left before the timers next tick
+ *
+ * @param chip8 pointer to chip8 struct
+ * @return number of instructions, 0 when the next tick is due before any
+ */
+uint32_t chip8_cycles_to_tick(const chip8_t *chip8);
+
+/**
+ * @brief checks whether the machine is waiting on `Fx0A` with nothing else to do
+ *
+ * true when PC is on `Fx0A`, no key is down and both timers have run out, so
+ * frames change nothing until a key goes down and the caller may sleep until then
+ *
+ * @param chip8 pointer to chip8 struct
+ * @return `true` if only a key press can change anything
+ */
+bool chip8_waiting_for_key(const chip8_t *chip8);
+
+/**
+ * @brief stores bytes into memory from outside the CPU, eg. to restore an earlier state
+ *
+ * decoded instructions, basic blocks and native code overlapping the bytes are dropped
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param address first address written
+ * @param bytes the bytes to store
+ * @param length number of bytes, which must fit below MEMORY_SIZE
+ */
+void chip8_write_memory(chip8_t *chip8, uint16_t address, const uint8_t *bytes, uint16_t length);
+
+/**
+ * @brief writes the machine's state to a buffer, in a compact versioned format
+ *
+ * only the bytes of memory that differ from the loaded ROM and fontset are
+ * stored, and only the display rows with pixels lit, so a state is usually a
+ * few hundred bytes. the keypad is saved, the jit, tracer and profiler aren't
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param buffer where the state goes
+ * @param buffer_size bytes available in `buffer`, at least CHIP8_STATE_MAX_SIZE
+ * @return number of bytes written, `0` on failure
+ */
+size_t chip8_save_state(const chip8_t *chip8, uint8_t *buffer, size_t buffer_size);
+
+/**
+ * @brief restores a state written by `chip8_save_state`
+ *
+ * the same ROM must be loaded. decoded instructions and native code are only
+ * dropped where memory changes, and nothing is modified if the state is invalid
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param buffer the state
+ * @param buffer_size number of bytes in `buffer`
+ * @return `0` on success, `1` on failure
+ */
+int chip8_load_state(chip8_t *chip8, const uint8_t *buffer, size_t buffer_size);
+
+#ifdef CHIP8_AOT
+/**
+ * @brief runs the ROM translated ahead of time by chip8_aot, defined in the generated file
+ *
+ * stops when the budget runs out, or before an instruction it has no code for
+ * or whose bytes in memory changed since translation
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param cycles number of instructions to execute at most
+ * @return what is left of `cycles`
+ */
+uint32_t chip8_aot_run(chip8_t *chip8, uint32_t cycles);
+#endif
+
+/**
+ * @brief makes `chip8_run` execute basic blocks as native x86-64 code
+ *
+ * only available when built with `CHIP8_JIT`. instructions the jit doesn't
+ * translate are called into the interpreter from the native code
+ *
+ * @param chip8 pointer to chip8 struct, already initialised
+ * @return `0` on success, `1` on failure
+ */
+int chip8_jit_enable(chip8_t *chip8);
+
+/**
+ * @brief frees the native code and goes back to interpreting every instruction
+ *
+ * @param chip8 pointer to chip8 struct
+ */
+void chip8_jit_disable(chip8_t *chip8);
+
+/**
+ * @brief makes `chip8_run` count executions per opcode and per address
+ *
+ * only available when built with `CHIP8_PROFILE`. while profiling, every
+ * instruction goes through the interpreter
+ *
+ * @param chip8 pointer to chip8 struct, already initialised
+ * @param timed also time each handler, which slows execution down a lot more
+ * @return `0` on success, `1` on failure
+ */
+int chip8_profile_enable(chip8_t *chip8, bool timed);
+
+/**
+ * @brief prints the profile to `stdout`, sorted by execution count
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param json_path also write the profile here as JSON, `NULL` for none
+ * @return `0` on success, `1` on failure
+ */
+int chip8_profile_report(const chip8_t *chip8, const char *json_path);
+
+/**
+ * @brief frees the profile and stops counting
+ *
+ * @param chip8 pointer to chip8 struct
+ */
+void chip8_profile_disable(chip8_t *chip8);
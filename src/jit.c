@@ -0,0 +1,1003 @@
+#include "jit.h"
+#include "logger.h"
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE (256 * 1024)
+#define JIT_MAX_INSTRUCTION_SIZE 448                                    // FF65, 28 bytes per register loaded, is the longest instruction
+#define JIT_MAX_BLOCK_SIZE (BLOCK_MAX_LENGTH * JIT_MAX_INSTRUCTION_SIZE + 512) // upper bound on the code for one block, entry and exit stubs included
+#define JIT_MAX_LINKS 8192                                              // exits patched to jump straight to another block, everything is flushed past that
+#define JIT_MAX_EXITS 2                                                 // exits of a block that can be linked, both ways out of a skip
+
+// x86-64 register numbers, as used in ModRM/SIB bytes
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3 // holds the chip8 pointer while native code runs
+#define RBP 5 // holds what is left of the cycle budget
+#define RSI 6
+#define RDI 7
+
+#define IN_MEMORY -1                    // guest register the block has no host register for
+#define INDEX_SLOT REGISTER_COUNT       // slot of the index register, after V0-VF
+#define SLOT_COUNT (REGISTER_COUNT + 1) // guest registers a block can keep in host registers
+
+// struct offsets baked into the generated code
+#define MEMORY_OFFSET offsetof(chip8_t, memory)
+#define REGISTER_OFFSET(x) (offsetof(chip8_t, registers) + (x))
+#define INDEX_OFFSET offsetof(chip8_t, index)
+#define PC_OFFSET offsetof(chip8_t, pc)
+#define STACK_OFFSET offsetof(chip8_t, stack)
+#define SP_OFFSET offsetof(chip8_t, sp)
+#define KEYPAD_OFFSET offsetof(chip8_t, keypad)
+#define DELAY_TIMER_OFFSET offsetof(chip8_t, delay_timer)
+#define SOUND_TIMER_OFFSET offsetof(chip8_t, sound_timer)
+#define CODE_OFFSET offsetof(chip8_t, code)
+#define DECODE_CACHE_OFFSET(address) (offsetof(chip8_code_t, decode_cache) + (address) * sizeof(instruction_t))
+
+typedef struct link
+{
+  uint8_t *site; // rel32 of an exit patched to jump straight to a block
+  uint8_t *stub; // where the exit jumped before
+  uint32_t next; // next link into the same block, as an index + 1, 0 for none
+} link_t;
+
+typedef struct native_exit
+{
+  uint8_t *link;   // rel32 of the exit native code left through, `NULL` if it can't be linked
+  uint64_t cycles; // what is left of the cycle budget
+} native_exit_t;   // comes back in rax and rdx
+
+typedef native_exit_t (*native_entry_t)(chip8_t *chip8, jit_block_t code, uint32_t cycles);
+
+struct jit
+{
+  uint8_t *buffer;                  // mmap'd code buffer, writable while compiling or linking and executable otherwise
+  size_t used;                      // bytes of the buffer holding code
+  size_t entry_size;                // bytes at the start of the buffer holding the entry and exit, kept across flushes
+  const uint8_t *exit;              // where native code jumps to go back to jit_run
+  jit_interpret_t interpret;        // runs the instructions native code doesn't
+  jit_block_t code[MEMORY_SIZE];    // native code for the block starting at each address
+  uint8_t length[MEMORY_SIZE];      // instructions the native code at each address executes, 0 if none
+  bool uncompilable[MEMORY_SIZE];   // the block at this address could not be compiled
+  uint32_t links_to[MEMORY_SIZE];   // first link into the block at each address, as an index + 1, 0 for none
+  link_t links[JIT_MAX_LINKS];      // exits linked since the last flush
+  uint32_t link_count;              // links in use
+};
+
+typedef struct compiler
+{
+  jit_t *jit;
+  int8_t host[SLOT_COUNT];         // host register each guest register is kept in, IN_MEMORY for none
+  uint32_t dirty;                  // bit per slot whose host register was written since it was last stored
+  size_t exits[JIT_MAX_EXITS];     // buffer offsets of the rel32s of the linkable exits
+  uint16_t exit_pc[JIT_MAX_EXITS]; // where each linkable exit goes
+  uint8_t exit_count;              // linkable exits emitted
+} compiler_t;
+
+// host registers handed out to guest registers, in this order. rax and rcx are scratch
+static const int8_t host_registers[] = {RDX, RSI, RDI, 8, 9, 10, 11, 12, 13, 14, 15};
+
+/* --------------------------- forward declaration -------------------------- */
+
+static void emit8(jit_t *jit, uint8_t byte);
+static void emit16(jit_t *jit, uint16_t word);
+static void emit32(jit_t *jit, uint32_t dword);
+static void emit_rel32(jit_t *jit, const uint8_t *target);
+static void patch_rel32(uint8_t *site, const uint8_t *target);
+static void emit_op(jit_t *jit, uint8_t prefix, uint16_t opcode, uint8_t reg, int8_t rm, uint32_t offset, bool bytes);
+static void emit_guest(compiler_t *compiler, uint8_t prefix, uint16_t opcode, uint8_t reg, uint8_t slot);
+static void emit_modrm_rbx_rax(jit_t *jit, uint8_t reg, uint8_t scale, uint32_t offset);
+static void emit_store_pc(jit_t *jit, uint16_t pc);
+static void emit_load_slots(compiler_t *compiler);
+static void emit_store_dirty(compiler_t *compiler);
+static void emit_linked_exit(compiler_t *compiler, uint16_t opcode, uint16_t pc);
+static void emit_dynamic_exit(compiler_t *compiler);
+static void emit_skip(compiler_t *compiler, uint8_t jump_if_no_skip, uint16_t next_pc);
+static void emit_interpret(compiler_t *compiler, uint16_t address);
+static void mark_dirty(compiler_t *compiler, uint8_t slot);
+static void count_uses(const instruction_t *instruction, uint32_t uses[SLOT_COUNT]);
+static void allocate_registers(compiler_t *compiler, const chip8_t *chip8, uint16_t address, uint8_t length);
+static void emit_instruction(compiler_t *compiler, const instruction_t *instruction, uint16_t address, bool *ends_block);
+static void emit_entry(jit_t *jit);
+static void link_block(jit_t *jit, uint8_t *site, uint16_t target);
+
+/* ---------------------------- helper functions ---------------------------- */
+
+static void emit8(jit_t *jit, uint8_t byte)
+{
+  jit->buffer[jit->used++] = byte;
+}
+
+static void emit16(jit_t *jit, uint16_t word)
+{
+  emit8(jit, word & 0xFF);
+  emit8(jit, word >> 8);
+}
+
+static void emit32(jit_t *jit, uint32_t dword)
+{
+  emit16(jit, dword & 0xFFFF);
+  emit16(jit, dword >> 16);
+}
+
+/**
+ * @brief emits a rel32 to `target`, as the last 4 bytes of a jump or `lea`
+ *
+ * @param jit pointer to jit struct
+ * @param target where it points
+ */
+static void emit_rel32(jit_t *jit, const uint8_t *target)
+{
+  emit32(jit, (uint32_t)(int32_t)(target - (jit->buffer + jit->used + 4)));
+}
+
+/**
+ * @brief points a rel32 already in the buffer at `target`, the buffer must be writable
+ *
+ * @param site first byte of the rel32
+ * @param target where it points
+ */
+static void patch_rel32(uint8_t *site, const uint8_t *target)
+{
+  int32_t rel = (int32_t)(target - (site + 4));
+  memcpy(site, &rel, sizeof(rel));
+}
+
+/**
+ * @brief emits an instruction whose ModRM operand is a host register or `[rbx + offset]`
+ *
+ * @param jit pointer to jit struct
+ * @param prefix 0x66 for 16 bit operands, 0 for none
+ * @param opcode one byte, or two as 0x0Fxx
+ * @param reg host register or opcode extension in the reg field
+ * @param rm host register in the r/m field, IN_MEMORY for `[rbx + offset]`
+ * @param offset offset into the chip8 struct when `rm` is IN_MEMORY
+ * @param bytes the operands are byte registers, so sil and dil need a REX prefix to not be dh and bh
+ */
+static void emit_op(jit_t *jit, uint8_t prefix, uint16_t opcode, uint8_t reg, int8_t rm, uint32_t offset, bool bytes)
+{
+  uint8_t rex = 0;
+  if (reg >= 8)
+  {
+    rex |= 0x44; // REX.R
+  }
+  if (rm >= 8)
+  {
+    rex |= 0x41; // REX.B
+  }
+  if (bytes && ((reg >= 4 && reg < 8) || (rm >= 4 && rm < 8)))
+  {
+    rex |= 0x40;
+  }
+
+  if (prefix != 0)
+  {
+    emit8(jit, prefix);
+  }
+  if (rex != 0)
+  {
+    emit8(jit, rex);
+  }
+  if (opcode > 0xFF)
+  {
+    emit8(jit, opcode >> 8);
+  }
+  emit8(jit, opcode & 0xFF);
+
+  if (rm == IN_MEMORY)
+  {
+    emit8(jit, 0x80 | (reg & 7) << 3 | RBX); // mod 10: [rbx + disp32]
+    emit32(jit, offset);
+  }
+  else
+  {
+    emit8(jit, 0xC0 | (reg & 7) << 3 | (rm & 7)); // mod 11: register
+  }
+}
+
+/**
+ * @brief emits an instruction whose r/m operand is a guest register, wherever the block keeps it
+ *
+ * @param compiler the block being compiled
+ * @param prefix 0x66 for 16 bit operands, 0 for none
+ * @param opcode one byte, or two as 0x0Fxx
+ * @param reg scratch register or opcode extension in the reg field
+ * @param slot V0-VF, or INDEX_SLOT
+ */
+static void emit_guest(compiler_t *compiler, uint8_t prefix, uint16_t opcode, uint8_t reg, uint8_t slot)
+{
+  const uint32_t offset = slot == INDEX_SLOT ? INDEX_OFFSET : REGISTER_OFFSET(slot);
+  emit_op(compiler->jit, prefix, opcode, reg, compiler->host[slot], offset, slot != INDEX_SLOT);
+}
+
+/**
+ * @brief emits ModRM, SIB and displacement addressing `[rbx + rax * scale + offset]`
+ *
+ * @param jit pointer to jit struct
+ * @param reg register or opcode extension in the reg field
+ * @param scale 0 for bytes, 1 for 16 bit words
+ * @param offset offset into the chip8 struct
+ */
+static void emit_modrm_rbx_rax(jit_t *jit, uint8_t reg, uint8_t scale, uint32_t offset)
+{
+  emit8(jit, 0x80 | reg << 3 | 0x04); // mod 10, rm 100: SIB follows
+  emit8(jit, scale << 6 | RAX << 3 | RBX);
+  emit32(jit, offset);
+}
+
+/**
+ * @brief emits `mov word [rbx + pc], imm16`
+ *
+ * @param jit pointer to jit struct
+ * @param pc value to store
+ */
+static void emit_store_pc(jit_t *jit, uint16_t pc)
+{
+  emit_op(jit, 0x66, 0xC7, 0, IN_MEMORY, PC_OFFSET, false);
+  emit16(jit, pc);
+}
+
+/**
+ * @brief loads every guest register the block keeps in a host register
+ *
+ * the host registers are zero extended, so 16 and 32 bit operations on them
+ * see the guest register's value
+ *
+ * @param compiler the block being compiled
+ */
+static void emit_load_slots(compiler_t *compiler)
+{
+  for (uint8_t slot = 0; slot < SLOT_COUNT; ++slot)
+  {
+    if (compiler->host[slot] != IN_MEMORY)
+    {
+      const uint32_t offset = slot == INDEX_SLOT ? INDEX_OFFSET : REGISTER_OFFSET(slot);
+      const uint16_t movzx = slot == INDEX_SLOT ? 0x0FB7 : 0x0FB6;
+      emit_op(compiler->jit, 0, movzx, (uint8_t)compiler->host[slot], IN_MEMORY, offset, false);
+    }
+  }
+}
+
+/**
+ * @brief stores the host registers written since they were last stored back into the chip8 struct
+ *
+ * only emits `mov`s, so the flags are still live after it
+ *
+ * @param compiler the block being compiled
+ */
+static void emit_store_dirty(compiler_t *compiler)
+{
+  for (uint8_t slot = 0; slot < SLOT_COUNT; ++slot)
+  {
+    if ((compiler->dirty >> slot & 1) == 0)
+    {
+      continue;
+    }
+    if (slot == INDEX_SLOT)
+    {
+      emit_op(compiler->jit, 0x66, 0x89, (uint8_t)compiler->host[slot], IN_MEMORY, INDEX_OFFSET, false); // mov [index], host16
+    }
+    else
+    {
+      emit_op(compiler->jit, 0, 0x88, (uint8_t)compiler->host[slot], IN_MEMORY, REGISTER_OFFSET(slot), true); // mov [Vx], host8
+    }
+  }
+  compiler->dirty = 0;
+}
+
+/**
+ * @brief emits a jump to the block at `pc`, which leaves native code until jit_run links it
+ *
+ * the jump first goes to a stub emitted after the block, which stores PC and
+ * hands the jump's rel32 to jit_run to be patched
+ *
+ * @param compiler the block being compiled
+ * @param opcode `jmp rel32` as 0xE9, or a `jcc rel32` as 0x0F8x
+ * @param pc where the jump goes
+ */
+static void emit_linked_exit(compiler_t *compiler, uint16_t opcode, uint16_t pc)
+{
+  jit_t *jit = compiler->jit;
+  if (opcode > 0xFF)
+  {
+    emit8(jit, opcode >> 8);
+  }
+  emit8(jit, opcode & 0xFF);
+
+  compiler->exits[compiler->exit_count] = jit->used;
+  compiler->exit_pc[compiler->exit_count] = pc;
+  compiler->exit_count++;
+  emit32(jit, 0); // pointed at the stub once it is emitted
+}
+
+/**
+ * @brief emits a jump back to jit_run for an exit whose PC is only known at run time, already stored
+ *
+ * @param compiler the block being compiled
+ */
+static void emit_dynamic_exit(compiler_t *compiler)
+{
+  jit_t *jit = compiler->jit;
+  emit_store_dirty(compiler);
+  emit8(jit, 0x31); // xor eax, eax: nothing to link
+  emit8(jit, 0xC0);
+  emit8(jit, 0xE9); // jmp exit
+  emit_rel32(jit, jit->exit);
+}
+
+/**
+ * @brief finishes a skip instruction whose comparison was just emitted
+ *
+ * both ways out are linkable exits, to the next instruction and to the one after it
+ *
+ * @param compiler the block being compiled
+ * @param jump_if_no_skip second opcode byte of the `jcc rel32` that is taken when the next instruction runs
+ * @param next_pc address of the next instruction
+ */
+static void emit_skip(compiler_t *compiler, uint8_t jump_if_no_skip, uint16_t next_pc)
+{
+  emit_store_dirty(compiler);
+  emit_linked_exit(compiler, 0x0F00 | jump_if_no_skip, next_pc);
+  emit_linked_exit(compiler, 0xE9, next_pc + 2);
+}
+
+/**
+ * @brief emits a call into the interpreter for the instruction at `address`
+ *
+ * the interpreter works on the chip8 struct, so the guest registers are stored
+ * first. the call clobbers the host registers they were in, so whatever runs
+ * natively after it must load them again
+ *
+ * @param compiler the block being compiled
+ * @param address address of the instruction
+ */
+static void emit_interpret(compiler_t *compiler, uint16_t address)
+{
+  jit_t *jit = compiler->jit;
+  const uint64_t interpret = (uint64_t)(uintptr_t)jit->interpret;
+
+  emit_store_dirty(compiler);
+  emit_store_pc(jit, address + 2); // PC is past the instruction when it runs, like in chip8_cycle
+
+  emit8(jit, 0x48); // mov rdi, rbx
+  emit8(jit, 0x89);
+  emit8(jit, 0xDF);
+  emit8(jit, 0x48); // mov rsi, [code]
+  emit8(jit, 0x8B);
+  emit8(jit, 0x80 | RSI << 3 | RBX);
+  emit32(jit, CODE_OFFSET);
+  emit8(jit, 0x48); // add rsi, decode cache slot
+  emit8(jit, 0x81);
+  emit8(jit, 0xC0 | RSI);
+  emit32(jit, DECODE_CACHE_OFFSET(address));
+  emit8(jit, 0x48); // mov rax, interpret
+  emit8(jit, 0xB8);
+  emit32(jit, (uint32_t)interpret);
+  emit32(jit, (uint32_t)(interpret >> 32));
+  emit8(jit, 0xFF); // call rax
+  emit8(jit, 0xD0);
+}
+
+/**
+ * @brief notes that a guest register was written, so it is stored at the next exit or call
+ *
+ * @param compiler the block being compiled
+ * @param slot V0-VF, or INDEX_SLOT
+ */
+static void mark_dirty(compiler_t *compiler, uint8_t slot)
+{
+  if (compiler->host[slot] != IN_MEMORY)
+  {
+    compiler->dirty |= 1u << slot;
+  }
+}
+
+/**
+ * @brief counts the guest registers the native code of an instruction reads or writes
+ *
+ * instructions left to the interpreter count for nothing, it works on the chip8 struct
+ *
+ * @param instruction the instruction, already decoded
+ * @param uses running count per slot
+ */
+static void count_uses(const instruction_t *instruction, uint32_t uses[SLOT_COUNT])
+{
+  switch (instruction->opcode & 0xF000)
+  {
+  case 0x3000:
+  case 0x4000:
+  case 0x6000:
+  case 0x7000:
+  case 0xE000:
+    uses[instruction->x]++;
+    break;
+  case 0x5000:
+  case 0x9000:
+    uses[instruction->x]++;
+    uses[instruction->y]++;
+    break;
+  case 0x8000:
+    uses[instruction->x]++;
+    uses[instruction->y]++;
+    uses[0xF]++;
+    break;
+  case 0xA000:
+    uses[INDEX_SLOT]++;
+    break;
+  case 0xB000:
+    uses[0]++;
+    break;
+  case 0xF000:
+    switch (instruction->kk)
+    {
+    case 0x07:
+    case 0x15:
+    case 0x18:
+      uses[instruction->x]++;
+      break;
+    case 0x1E:
+    case 0x29:
+      uses[instruction->x]++;
+      uses[INDEX_SLOT]++;
+      break;
+    case 0x65:
+      for (int i = 0; i <= instruction->x; ++i)
+      {
+        uses[i]++;
+        uses[INDEX_SLOT]++;
+      }
+      break;
+    }
+    break;
+  }
+}
+
+/**
+ * @brief gives the guest registers a block uses most a host register each, while there are any left
+ *
+ * @param compiler the block being compiled
+ * @param chip8 pointer to chip8 struct, whose decode cache holds the block
+ * @param address first byte of the block
+ * @param length number of instructions in the block
+ */
+static void allocate_registers(compiler_t *compiler, const chip8_t *chip8, uint16_t address, uint8_t length)
+{
+  uint32_t uses[SLOT_COUNT] = {0};
+  for (uint8_t i = 0; i < length; ++i)
+  {
+    count_uses(&chip8->code->decode_cache[address + 2 * i], uses);
+  }
+
+  memset(compiler->host, IN_MEMORY, sizeof(compiler->host));
+  for (size_t next = 0; next < sizeof(host_registers); ++next)
+  {
+    uint8_t best = 0;
+    for (uint8_t slot = 1; slot < SLOT_COUNT; ++slot)
+    {
+      if (uses[slot] > uses[best])
+      {
+        best = slot;
+      }
+    }
+    if (uses[best] == 0)
+    {
+      break;
+    }
+    compiler->host[best] = host_registers[next];
+    uses[best] = 0;
+  }
+}
+
+/**
+ * @brief emits native code for one instruction
+ *
+ * @param compiler the block being compiled
+ * @param instruction the instruction, already decoded
+ * @param address address of the instruction
+ * @param ends_block set when the instruction left the block
+ */
+static void emit_instruction(compiler_t *compiler, const instruction_t *instruction, uint16_t address, bool *ends_block)
+{
+  jit_t *jit = compiler->jit;
+  const uint8_t x = instruction->x;
+  const uint8_t y = instruction->y;
+  const uint8_t kk = instruction->kk;
+  const uint16_t nnn = instruction->nnn;
+  const uint16_t next_pc = address + 2;
+
+  *ends_block = false;
+
+  switch (instruction->opcode & 0xF000)
+  {
+  case 0x0000:
+    if ((instruction->opcode & 0x00FF) != 0x00EE)
+    {
+      break; // 00E0 touches the display
+    }
+    emit_op(jit, 0, 0xFE, 1, IN_MEMORY, SP_OFFSET, false);     // dec byte [sp]
+    emit_op(jit, 0, 0x0FB6, RAX, IN_MEMORY, SP_OFFSET, false); // movzx eax, byte [sp]
+    emit8(jit, 0x83);                                           // and eax, STACK_DEPTH - 1
+    emit8(jit, 0xE0);
+    emit8(jit, STACK_DEPTH - 1);
+    emit8(jit, 0x66); // mov ax, [stack + rax * 2]
+    emit8(jit, 0x8B);
+    emit_modrm_rbx_rax(jit, RAX, 1, STACK_OFFSET);
+    emit_op(jit, 0x66, 0x89, RAX, IN_MEMORY, PC_OFFSET, false); // mov [pc], ax
+    emit_dynamic_exit(compiler);
+    *ends_block = true;
+    return;
+
+  case 0x1000:
+    emit_store_dirty(compiler);
+    emit_linked_exit(compiler, 0xE9, nnn);
+    *ends_block = true;
+    return;
+
+  case 0x2000:
+    emit_op(jit, 0, 0x0FB6, RAX, IN_MEMORY, SP_OFFSET, false); // movzx eax, byte [sp]
+    emit8(jit, 0x83);                                           // and eax, STACK_DEPTH - 1
+    emit8(jit, 0xE0);
+    emit8(jit, STACK_DEPTH - 1);
+    emit8(jit, 0x66); // mov word [stack + rax * 2], next_pc
+    emit8(jit, 0xC7);
+    emit_modrm_rbx_rax(jit, 0, 1, STACK_OFFSET);
+    emit16(jit, next_pc);
+    emit_op(jit, 0, 0xFE, 0, IN_MEMORY, SP_OFFSET, false); // inc byte [sp]
+    emit_store_dirty(compiler);
+    emit_linked_exit(compiler, 0xE9, nnn);
+    *ends_block = true;
+    return;
+
+  case 0x3000:
+  case 0x4000:
+    emit_guest(compiler, 0, 0x80, 7, x); // cmp Vx, kk
+    emit8(jit, kk);
+    emit_skip(compiler, (instruction->opcode & 0xF000) == 0x3000 ? 0x85 : 0x84, next_pc); // jne : je
+    *ends_block = true;
+    return;
+
+  case 0x5000:
+  case 0x9000:
+    emit_guest(compiler, 0, 0x8A, RAX, x); // mov al, Vx
+    emit_guest(compiler, 0, 0x3A, RAX, y); // cmp al, Vy
+    emit_skip(compiler, (instruction->opcode & 0xF000) == 0x5000 ? 0x85 : 0x84, next_pc); // jne : je
+    *ends_block = true;
+    return;
+
+  case 0x6000:
+    emit_guest(compiler, 0, 0xC6, 0, x); // mov Vx, kk
+    emit8(jit, kk);
+    mark_dirty(compiler, x);
+    return;
+
+  case 0x7000:
+    emit_guest(compiler, 0, 0x80, 0, x); // add Vx, kk
+    emit8(jit, kk);
+    mark_dirty(compiler, x);
+    return;
+
+  case 0x8000:
+    switch (instruction->n)
+    {
+    case 0x0:
+    case 0x1:
+    case 0x2:
+    case 0x3:
+    {
+      static const uint8_t store_ops[] = {0x88, 0x08, 0x20, 0x30}; // mov, or, and, xor Vx, al
+      emit_guest(compiler, 0, 0x8A, RAX, y);                      // mov al, Vy
+      emit_guest(compiler, 0, store_ops[instruction->n], RAX, x);
+      mark_dirty(compiler, x);
+      return;
+    }
+    case 0x4:
+      emit_guest(compiler, 0, 0x8A, RAX, x); // mov al, Vx
+      emit_guest(compiler, 0, 0x02, RAX, y); // add al, Vy
+      emit8(jit, 0x0F);                      // setc cl
+      emit8(jit, 0x92);
+      emit8(jit, 0xC1);
+      emit_guest(compiler, 0, 0x88, RCX, 0xF); // mov VF, cl
+      emit_guest(compiler, 0, 0x88, RAX, x);   // mov Vx, al, after VF like the interpreter
+      mark_dirty(compiler, 0xF);
+      mark_dirty(compiler, x);
+      return;
+    case 0x5:
+    case 0x7:
+    {
+      // 8xy5: VF = Vx > Vy, Vx = Vx - Vy. 8xy7: VF = Vy > Vx, Vx = Vy - Vx
+      const uint8_t minuend = instruction->n == 0x5 ? x : y;
+      const uint8_t subtrahend = instruction->n == 0x5 ? y : x;
+      emit_guest(compiler, 0, 0x8A, RAX, minuend);    // mov al, minuend
+      emit_guest(compiler, 0, 0x3A, RAX, subtrahend); // cmp al, subtrahend
+      emit8(jit, 0x0F);                               // seta cl
+      emit8(jit, 0x97);
+      emit8(jit, 0xC1);
+      emit_guest(compiler, 0, 0x88, RCX, 0xF); // mov VF, cl
+      // operands are read again after VF is written, like the interpreter, in case one of them is VF
+      emit_guest(compiler, 0, 0x8A, RAX, minuend);    // mov al, minuend
+      emit_guest(compiler, 0, 0x2A, RAX, subtrahend); // sub al, subtrahend
+      emit_guest(compiler, 0, 0x88, RAX, x);          // mov Vx, al
+      mark_dirty(compiler, 0xF);
+      mark_dirty(compiler, x);
+      return;
+    }
+    case 0x6:
+      emit_guest(compiler, 0, 0x8A, RAX, x); // mov al, Vx
+      emit8(jit, 0x24);                      // and al, 1
+      emit8(jit, 0x01);
+      emit_guest(compiler, 0, 0x88, RAX, 0xF); // mov VF, al
+      emit_guest(compiler, 0, 0xD0, 5, x);     // shr Vx, 1
+      mark_dirty(compiler, 0xF);
+      mark_dirty(compiler, x);
+      return;
+    case 0xE:
+      emit_guest(compiler, 0, 0x8A, RAX, x); // mov al, Vx
+      emit8(jit, 0xC0);                      // shr al, 7
+      emit8(jit, 0xE8);
+      emit8(jit, 0x07);
+      emit_guest(compiler, 0, 0x88, RAX, 0xF); // mov VF, al
+      emit_guest(compiler, 0, 0xD0, 4, x);     // shl Vx, 1
+      mark_dirty(compiler, 0xF);
+      mark_dirty(compiler, x);
+      return;
+    }
+    break;
+
+  case 0xA000:
+    if (compiler->host[INDEX_SLOT] != IN_MEMORY)
+    {
+      emit_guest(compiler, 0, 0xC7, 0, INDEX_SLOT); // mov index32, nnn, keeping it zero extended
+      emit32(jit, nnn);
+    }
+    else
+    {
+      emit_guest(compiler, 0x66, 0xC7, 0, INDEX_SLOT); // mov word [index], nnn
+      emit16(jit, nnn);
+    }
+    mark_dirty(compiler, INDEX_SLOT);
+    return;
+
+  case 0xB000:
+    emit_guest(compiler, 0, 0x0FB6, RAX, 0); // movzx eax, V0
+    emit8(jit, 0x05);                        // add eax, nnn
+    emit32(jit, nnn);
+    emit_op(jit, 0x66, 0x89, RAX, IN_MEMORY, PC_OFFSET, false); // mov [pc], ax
+    emit_dynamic_exit(compiler);
+    *ends_block = true;
+    return;
+
+  case 0xE000:
+    if (kk != 0x9E && kk != 0xA1)
+    {
+      break;
+    }
+    // keys past the keypad read as released: ecx masks the key's byte to 0 unless Vx < KEY_COUNT
+    emit_guest(compiler, 0, 0x0FB6, RAX, x); // movzx eax, Vx
+    emit8(jit, 0x83);                        // cmp eax, KEY_COUNT
+    emit8(jit, 0xF8);
+    emit8(jit, KEY_COUNT);
+    emit8(jit, 0x19);                        // sbb ecx, ecx
+    emit8(jit, 0xC9);
+    emit8(jit, 0x83);                        // and eax, KEY_COUNT - 1
+    emit8(jit, 0xE0);
+    emit8(jit, KEY_COUNT - 1);
+    emit8(jit, 0x22);                        // and cl, [keypad + rax]
+    emit_modrm_rbx_rax(jit, RCX, 0, KEYPAD_OFFSET);
+    emit_skip(compiler, kk == 0x9E ? 0x84 : 0x85, next_pc); // je : jne
+    *ends_block = true;
+    return;
+
+  case 0xF000:
+    switch (kk)
+    {
+    case 0x07:
+      emit_op(jit, 0, 0x8A, RAX, IN_MEMORY, DELAY_TIMER_OFFSET, false); // mov al, [delay timer]
+      emit_guest(compiler, 0, 0x88, RAX, x);                            // mov Vx, al
+      mark_dirty(compiler, x);
+      return;
+    case 0x15:
+    case 0x18:
+      emit_guest(compiler, 0, 0x8A, RAX, x); // mov al, Vx
+      emit_op(jit, 0, 0x88, RAX, IN_MEMORY, kk == 0x15 ? DELAY_TIMER_OFFSET : SOUND_TIMER_OFFSET, false); // mov [timer], al
+      return;
+    case 0x1E:
+      emit_guest(compiler, 0, 0x0FB6, RAX, x);           // movzx eax, Vx
+      emit_guest(compiler, 0x66, 0x01, RAX, INDEX_SLOT); // add index16, ax
+      mark_dirty(compiler, INDEX_SLOT);
+      return;
+    case 0x29:
+      emit_guest(compiler, 0, 0x0FB6, RAX, x); // movzx eax, Vx
+      emit8(jit, 0x8D);                        // lea eax, [rax + rax * 4 + FONTSET_START_ADDRESS]
+      emit8(jit, 0x44);
+      emit8(jit, 0x80);
+      emit8(jit, FONTSET_START_ADDRESS);
+      emit_guest(compiler, 0x66, 0x89, RAX, INDEX_SLOT); // mov index16, ax
+      mark_dirty(compiler, INDEX_SLOT);
+      return;
+    case 0x65:
+      for (uint8_t i = 0; i <= x; ++i)
+      {
+        emit_guest(compiler, 0, 0x0FB7, RAX, INDEX_SLOT); // movzx eax, index16
+        emit8(jit, 0x83);                                 // add eax, i
+        emit8(jit, 0xC0);
+        emit8(jit, i);
+        emit8(jit, 0x25); // and eax, MEMORY_SIZE - 1, reads wrap around like the interpreter's
+        emit32(jit, MEMORY_SIZE - 1);
+        emit8(jit, 0x8A); // mov cl, [memory + rax]
+        emit_modrm_rbx_rax(jit, RCX, 0, MEMORY_OFFSET);
+        emit_guest(compiler, 0, 0x88, RCX, i); // mov Vi, cl
+        mark_dirty(compiler, i);
+      }
+      return;
+    case 0x0A:
+    case 0x33:
+    case 0x55:
+      // a key wait can rewind PC and a store can overwrite this very block, so both leave native code
+      emit_interpret(compiler, address);
+      emit_dynamic_exit(compiler);
+      *ends_block = true;
+      return;
+    }
+    break;
+  }
+
+  // 00E0, Cxkk, Dxyn and invalid opcodes go through the interpreter, the block carries on after
+  emit_interpret(compiler, address);
+  emit_load_slots(compiler);
+}
+
+/**
+ * @brief emits the code jit_run enters native code through, and native code leaves through
+ *
+ * the entry is a `native_entry_t`. it saves the callee-saved registers the blocks
+ * use, keeps `chip8` in rbx and `cycles` in ebp, and jumps to `code`. blocks jump
+ * to the exit with rax set to the rel32 to link, or 0, and it returns that and
+ * what is left of the cycles
+ *
+ * @param jit pointer to jit struct, whose buffer is writable
+ */
+static void emit_entry(jit_t *jit)
+{
+  static const uint8_t entry[] = {
+      0x53,                   // push rbx
+      0x55,                   // push rbp
+      0x41, 0x54,             // push r12
+      0x41, 0x55,             // push r13
+      0x41, 0x56,             // push r14
+      0x41, 0x57,             // push r15
+      0x48, 0x83, 0xEC, 0x08, // sub rsp, 8: keeps calls into the interpreter 16 byte aligned
+      0x48, 0x89, 0xFB,       // mov rbx, rdi
+      0x89, 0xD5,             // mov ebp, edx
+      0xFF, 0xE6,             // jmp rsi
+  };
+  static const uint8_t exit[] = {
+      0x89, 0xEA,             // mov edx, ebp
+      0x48, 0x83, 0xC4, 0x08, // add rsp, 8
+      0x41, 0x5F,             // pop r15
+      0x41, 0x5E,             // pop r14
+      0x41, 0x5D,             // pop r13
+      0x41, 0x5C,             // pop r12
+      0x5D,                   // pop rbp
+      0x5B,                   // pop rbx
+      0xC3,                   // ret
+  };
+
+  memcpy(jit->buffer, entry, sizeof(entry));
+  memcpy(jit->buffer + sizeof(entry), exit, sizeof(exit));
+  jit->exit = jit->buffer + sizeof(entry);
+  jit->entry_size = sizeof(entry) + sizeof(exit);
+  jit->used = jit->entry_size;
+}
+
+/**
+ * @brief patches an exit to jump straight to the native code of the block it goes to
+ *
+ * the link is recorded against the target, so jit_invalidate can put the exit back
+ *
+ * @param jit pointer to jit struct
+ * @param site rel32 of the exit
+ * @param target address of the block it goes to, already compiled
+ */
+static void link_block(jit_t *jit, uint8_t *site, uint16_t target)
+{
+  if (jit->link_count == JIT_MAX_LINKS)
+  {
+    jit_flush(jit); // out of links, start over
+    return;
+  }
+
+  if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+  {
+    return; // the exit keeps going through jit_run
+  }
+
+  int32_t rel;
+  memcpy(&rel, site, sizeof(rel));
+
+  link_t *link = &jit->links[jit->link_count++];
+  link->site = site;
+  link->stub = site + 4 + rel;
+  link->next = jit->links_to[target];
+  jit->links_to[target] = jit->link_count;
+  patch_rel32(site, jit->code[target]);
+
+  mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+}
+
+/* ----------------------------- jit functions ------------------------------ */
+
+jit_t *jit_create(jit_interpret_t interpret)
+{
+  jit_t *jit = calloc(1, sizeof(jit_t));
+  if (jit == NULL)
+  {
+    LOG_ERROR("Could not allocate the JIT");
+    return NULL;
+  }
+
+  jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->buffer == MAP_FAILED)
+  {
+    LOG_ERROR("Could not map the JIT code buffer");
+    free(jit);
+    return NULL;
+  }
+
+  jit->interpret = interpret;
+  emit_entry(jit);
+
+  if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0)
+  {
+    LOG_ERROR("Could not make the JIT code buffer executable");
+    jit_destroy(jit);
+    return NULL;
+  }
+
+  return jit;
+}
+
+void jit_destroy(jit_t *jit)
+{
+  munmap(jit->buffer, JIT_BUFFER_SIZE);
+  free(jit);
+}
+
+jit_block_t jit_lookup(jit_t *jit, const chip8_t *chip8, uint16_t address, uint8_t length)
+{
+  if (jit->length[address] != 0)
+  {
+    return jit->code[address];
+  }
+
+  if (jit->uncompilable[address])
+  {
+    return NULL;
+  }
+
+  if (jit->used + JIT_MAX_BLOCK_SIZE > JIT_BUFFER_SIZE)
+  {
+    jit_flush(jit); // out of space, start over
+  }
+
+  // W^X: the buffer is only writable while a block is being emitted
+  if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+  {
+    LOG_ERROR("Could not make the JIT code buffer writable");
+    jit->uncompilable[address] = true;
+    return NULL;
+  }
+
+  compiler_t compiler = {.jit = jit};
+  const size_t start = jit->used;
+  allocate_registers(&compiler, chip8, address, length);
+
+  // a block that doesn't fit in what is left of the budget goes back to jit_run, which hands it to the interpreter
+  emit8(jit, 0x81); // cmp ebp, length
+  emit8(jit, 0xF8 | RBP);
+  emit32(jit, length);
+  emit8(jit, 0x73); // jae past the exit
+  emit8(jit, 16);   // length of the exit below
+  emit_store_pc(jit, address);
+  emit_dynamic_exit(&compiler);
+  emit8(jit, 0x81); // sub ebp, length
+  emit8(jit, 0xE8 | RBP);
+  emit32(jit, length);
+  emit_load_slots(&compiler);
+
+  bool ends_block = false;
+  for (uint8_t i = 0; i < length && !ends_block; ++i)
+  {
+    emit_instruction(&compiler, &chip8->code->decode_cache[address + 2 * i], address + 2 * i, &ends_block);
+  }
+
+  if (!ends_block)
+  {
+    // the block was cut at BLOCK_MAX_LENGTH, it falls through to the next one
+    emit_store_dirty(&compiler);
+    emit_linked_exit(&compiler, 0xE9, address + 2 * length);
+  }
+
+  for (uint8_t i = 0; i < compiler.exit_count; ++i)
+  {
+    uint8_t *site = jit->buffer + compiler.exits[i];
+    patch_rel32(site, jit->buffer + jit->used);
+    emit_store_pc(jit, compiler.exit_pc[i]);
+    emit8(jit, 0x48); // lea rax, [rip + rel32]: the exit to link
+    emit8(jit, 0x8D);
+    emit8(jit, 0x05);
+    emit_rel32(jit, site);
+    emit8(jit, 0xE9); // jmp exit
+    emit_rel32(jit, jit->exit);
+  }
+
+  mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+
+  jit->code[address] = jit->buffer + start;
+  jit->length[address] = length;
+  return jit->code[address];
+}
+
+uint32_t jit_run(jit_t *jit, chip8_t *chip8, jit_block_t code, uint32_t cycles)
+{
+  const native_exit_t exit = ((native_entry_t)(uintptr_t)jit->buffer)(chip8, code, cycles);
+
+  // the next block is linked once it has been compiled, by the time the same exit is taken again
+  if (exit.link != NULL && chip8->pc < MEMORY_SIZE && jit->length[chip8->pc] != 0)
+  {
+    link_block(jit, exit.link, chip8->pc);
+  }
+  return (uint32_t)exit.cycles;
+}
+
+void jit_invalidate(jit_t *jit, uint16_t address, uint16_t length)
+{
+  bool writable = false;
+
+  // same reach as the basic blocks: a block can start 2 * BLOCK_MAX_LENGTH - 1 bytes before `address`
+  uint32_t first_block = address >= 2 * BLOCK_MAX_LENGTH ? address - (2 * BLOCK_MAX_LENGTH - 1) : 0;
+  for (uint32_t block = first_block; block < (uint32_t)address + length && block < MEMORY_SIZE; ++block)
+  {
+    // an uncompilable block covers at least 2 bytes
+    if (block + 2 * (jit->length[block] != 0 ? jit->length[block] : 1) <= address)
+    {
+      continue;
+    }
+    jit->length[block] = 0;
+    jit->uncompilable[block] = false;
+
+    // exits linked to the block go back to their stubs
+    if (jit->links_to[block] != 0 && !writable)
+    {
+      if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+      {
+        jit_flush(jit); // the stale links can't be undone, so nothing may reach them
+        return;
+      }
+      writable = true;
+    }
+    for (uint32_t link = jit->links_to[block]; link != 0; link = jit->links[link - 1].next)
+    {
+      patch_rel32(jit->links[link - 1].site, jit->links[link - 1].stub);
+    }
+    jit->links_to[block] = 0;
+  }
+
+  if (writable)
+  {
+    mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+  }
+  // the old code is left in the buffer until the next flush
+}
+
+void jit_flush(jit_t *jit)
+{
+  jit->used = jit->entry_size;
+  jit->link_count = 0;
+  memset(jit->length, 0, sizeof(jit->length));
+  memset(jit->uncompilable, 0, sizeof(jit->uncompilable));
+  memset(jit->links_to, 0, sizeof(jit->links_to));
+}
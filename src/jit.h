@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+  x86-64 dynamic recompiler for basic blocks. only built when CHIP8_JIT is
+  defined, the rest of the core talks to it through chip8_jit_enable and chip8_run
+*/
+
+typedef struct jit jit_t;
+
+typedef const uint8_t *jit_block_t; // native code for the start of a basic block, entered through jit_run
+
+typedef void (*jit_interpret_t)(chip8_t *chip8, const instruction_t *instruction); // runs an instruction, PC already past it
+
+/* --------------------------- function prototypes -------------------------- */
+
+/**
+ * @brief maps an executable code buffer
+ *
+ * @param interpret called by the native code for the instructions it doesn't translate
+ * @return the new jit, `NULL` on failure
+ */
+jit_t *jit_create(jit_interpret_t interpret);
+
+/**
+ * @brief unmaps the code buffer and frees the jit
+ *
+ * @param jit pointer to jit struct
+ */
+void jit_destroy(jit_t *jit);
+
+/**
+ * @brief returns native code for the basic block at an address, compiling it on first use
+ *
+ * @param jit pointer to jit struct
+ * @param chip8 pointer to chip8 struct, whose decode cache holds the block
+ * @param address first byte of the block
+ * @param length number of instructions in the block
+ * @return the native code, `NULL` if it couldn't be compiled
+ */
+jit_block_t jit_lookup(jit_t *jit, const chip8_t *chip8, uint16_t address, uint8_t length);
+
+/**
+ * @brief runs native code from a block on, until a block doesn't fit in what is left of `cycles`
+ *
+ * blocks jump straight to the next one where it is known when they're compiled
+ * and it has been compiled since. anything else, a return, `Bnnn`, a key wait
+ * or a write to memory, comes back here with PC set, so the caller carries on
+ *
+ * @param jit pointer to jit struct
+ * @param chip8 pointer to chip8 struct
+ * @param code native code for the block at PC, from jit_lookup
+ * @param cycles number of instructions to execute at most, at least the block's length
+ * @return what is left of `cycles`
+ */
+uint32_t jit_run(jit_t *jit, chip8_t *chip8, jit_block_t code, uint32_t cycles);
+
+/**
+ * @brief drops native code for blocks that overlap memory which was just written to
+ *
+ * jumps other blocks were patched with to go straight to them are put back
+ *
+ * @param jit pointer to jit struct
+ * @param address first byte written
+ * @param length number of bytes written
+ */
+void jit_invalidate(jit_t *jit, uint16_t address, uint16_t length);
+
+/**
+ * @brief drops all native code
+ *
+ * @param jit pointer to jit struct
+ */
+void jit_flush(jit_t *jit);
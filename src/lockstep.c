@@ -0,0 +1,805 @@
+#include "lockstep.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  every per-lane loop below is written branch free, as a masked blend of the
+  new and the old value, so the compiler can turn it into SIMD code. lanes
+  outside the mask keep their old value. instructions that touch per-lane
+  memory, the stack or the display are done one lane at a time
+*/
+
+#define NO_LANE_PC 0x10000u // larger than any PC, marks lanes that have finished
+
+/* --------------------------- function prototypes -------------------------- */
+
+static void *allocate_lanes(uint32_t lanes, size_t lane_size);
+static void reset_lanes(lockstep_t *lockstep, const chip8_t *initial);
+static inline uint16_t fetch_opcode(const uint8_t *memory, uint32_t address);
+static inline uint8_t select8(uint8_t mask, uint8_t taken, uint8_t kept);
+static inline uint16_t select16(uint8_t mask, uint16_t taken, uint16_t kept);
+static uint32_t build_mask(lockstep_t *lockstep, uint32_t pc);
+static uint32_t retire_step(lockstep_t *lockstep);
+static void execute(lockstep_t *lockstep, uint16_t opcode);
+static void execute_8xyn(lockstep_t *lockstep, uint16_t opcode);
+static void execute_Fxnn(lockstep_t *lockstep, uint16_t opcode);
+static void mark_written(lockstep_t *lockstep, uint16_t address, int length);
+static void draw_sprite(lockstep_t *lockstep, uint32_t lane, uint8_t x, uint8_t y, uint8_t n);
+static void wait_for_key(lockstep_t *lockstep, uint32_t lane, uint8_t x);
+static void trap_invalid(lockstep_t *lockstep, uint16_t opcode);
+
+/* ---------------------------- helper functions ---------------------------- */
+
+/**
+ * @brief allocates a zeroed array with an element per lane
+ *
+ * @param lanes number of lanes
+ * @param lane_size bytes per lane
+ * @return the array, `NULL` on failure
+ */
+static void *allocate_lanes(uint32_t lanes, size_t lane_size)
+{
+  return calloc(lanes, lane_size);
+}
+
+/**
+ * @brief puts every lane in the state of an initialised chip8 struct
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param initial the state every lane starts from
+ */
+static void reset_lanes(lockstep_t *lockstep, const chip8_t *initial)
+{
+  const uint32_t lanes = lockstep->lanes;
+
+  for (int r = 0; r < REGISTER_COUNT; ++r)
+  {
+    memset(lockstep->registers[r], initial->registers[r], lanes);
+  }
+  for (int key = 0; key < KEY_COUNT; ++key)
+  {
+    memset(lockstep->keypad[key], 0, lanes);
+  }
+  memset(lockstep->sp, initial->sp, lanes);
+  memset(lockstep->delay_timer, initial->delay_timer, lanes);
+  memset(lockstep->sound_timer, initial->sound_timer, lanes);
+
+  for (uint32_t lane = 0; lane < lanes; ++lane)
+  {
+    lockstep->index[lane] = initial->index;
+    lockstep->pc[lane] = initial->pc;
+    lockstep->rand_state[lane] = initial->rand_state;
+    memcpy(lockstep->stack[lane], initial->stack, sizeof(initial->stack));
+    memcpy(lockstep->memory[lane], initial->memory, sizeof(initial->memory));
+    memcpy(lockstep->display[lane], initial->display, sizeof(initial->display));
+  }
+
+  memset(lockstep->written, 0, sizeof(lockstep->written));
+  lockstep->invalid_opcodes = 0;
+}
+
+/**
+ * @brief reads the two bytes of the opcode at an address of one lane's memory
+ *
+ * @param memory the lane's memory
+ * @param address address of the first byte
+ * @return the opcode
+ */
+static inline uint16_t fetch_opcode(const uint8_t *memory, uint32_t address)
+{
+  return memory[address & (MEMORY_SIZE - 1)] << 8 | memory[(address + 1) & (MEMORY_SIZE - 1)];
+}
+
+/**
+ * @brief picks `taken` for lanes in the mask and `kept` for the rest, without branching
+ *
+ * @param mask the lane's mask, `0xFF` or `0`
+ * @return the selected value
+ */
+static inline uint8_t select8(uint8_t mask, uint8_t taken, uint8_t kept)
+{
+  return (taken & mask) | (kept & ~mask);
+}
+
+/**
+ * @brief 16 bit version of `select8`
+ *
+ * @param mask the lane's mask, `0xFF` or `0`
+ * @return the selected value
+ */
+static inline uint16_t select16(uint8_t mask, uint16_t taken, uint16_t kept)
+{
+  uint16_t wide = (uint16_t)-(mask & 1);
+  return (taken & wide) | (kept & ~wide);
+}
+
+/**
+ * @brief masks in the lanes that execute the instruction at `pc` this step, and moves their PC past it
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param pc the address being executed
+ * @return the first lane in the mask, whose opcode is executed
+ */
+static uint32_t build_mask(lockstep_t *lockstep, uint32_t pc)
+{
+  const uint32_t lanes = lockstep->lanes;
+  uint8_t *restrict mask = lockstep->mask;
+  uint16_t *restrict lane_pc = lockstep->pc;
+  const uint32_t *restrict remaining = lockstep->remaining;
+
+  for (uint32_t lane = 0; lane < lanes; ++lane)
+  {
+    mask[lane] = (uint8_t)-((remaining[lane] != 0) & (lane_pc[lane] == pc));
+  }
+
+  uint32_t leader = 0;
+  while (mask[leader] == 0)
+  {
+    leader++;
+  }
+
+  if (lockstep->written[pc & (MEMORY_SIZE - 1)] | lockstep->written[(pc + 1) & (MEMORY_SIZE - 1)])
+  {
+    // lanes may have patched their code differently, only those holding the leader's opcode go together
+    uint16_t opcode = fetch_opcode(lockstep->memory[leader], pc);
+    for (uint32_t lane = leader + 1; lane < lanes; ++lane)
+    {
+      if (mask[lane] != 0 && fetch_opcode(lockstep->memory[lane], pc) != opcode)
+      {
+        mask[lane] = 0;
+      }
+    }
+  }
+
+  // same as chip8_cycle, PC moves on before the instruction runs
+  for (uint32_t lane = 0; lane < lanes; ++lane)
+  {
+    lane_pc[lane] += mask[lane] & 2;
+  }
+
+  return leader;
+}
+
+/**
+ * @brief counts the step against the lanes that executed it, and finds the next PC to execute
+ *
+ * @param lockstep pointer to lockstep struct
+ * @return the lowest PC of the lanes that still have instructions to run, `NO_LANE_PC` if none do
+ */
+static uint32_t retire_step(lockstep_t *lockstep)
+{
+  const uint32_t lanes = lockstep->lanes;
+  const uint8_t *restrict mask = lockstep->mask;
+  const uint16_t *restrict lane_pc = lockstep->pc;
+  uint32_t *restrict remaining = lockstep->remaining;
+  uint32_t lowest = NO_LANE_PC;
+
+  for (uint32_t lane = 0; lane < lanes; ++lane)
+  {
+    remaining[lane] -= mask[lane] & 1;
+    uint32_t pc = lane_pc[lane] | ((uint32_t)-(remaining[lane] == 0) & NO_LANE_PC);
+    lowest = pc < lowest ? pc : lowest;
+  }
+
+  return lowest;
+}
+
+/**
+ * @brief executes one opcode for every lane in the mask
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param opcode the opcode
+ */
+static void execute(lockstep_t *lockstep, uint16_t opcode)
+{
+  const uint32_t lanes = lockstep->lanes;
+  const uint8_t *restrict mask = lockstep->mask;
+  uint16_t *restrict pc = lockstep->pc;
+  uint16_t *restrict index = lockstep->index;
+
+  const uint8_t x = (opcode & 0x0F00) >> 8;
+  const uint8_t y = (opcode & 0x00F0) >> 4;
+  const uint8_t n = opcode & 0x000F;
+  const uint8_t kk = opcode & 0x00FF;
+  const uint16_t nnn = opcode & 0x0FFF;
+
+  uint8_t *vx = lockstep->registers[x];
+  const uint8_t *vy = lockstep->registers[y];
+
+  switch (opcode & 0xF000)
+  {
+  case 0x0000:
+    if (kk == 0xE0)
+    {
+      for (uint32_t lane = 0; lane < lanes; ++lane)
+      {
+        if (mask[lane] != 0)
+        {
+          memset(lockstep->display[lane], 0, sizeof(lockstep->display[lane]));
+        }
+      }
+    }
+    else if (kk == 0xEE)
+    {
+      for (uint32_t lane = 0; lane < lanes; ++lane)
+      {
+        if (mask[lane] != 0)
+        {
+          pc[lane] = lockstep->stack[lane][--lockstep->sp[lane] & (STACK_DEPTH - 1)];
+        }
+      }
+    }
+    else
+    {
+      trap_invalid(lockstep, opcode);
+    }
+    break;
+  case 0x1000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      pc[lane] = select16(mask[lane], nnn, pc[lane]);
+    }
+    break;
+  case 0x2000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      if (mask[lane] != 0)
+      {
+        lockstep->stack[lane][lockstep->sp[lane]++ & (STACK_DEPTH - 1)] = pc[lane];
+        pc[lane] = nnn;
+      }
+    }
+    break;
+  case 0x3000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      pc[lane] += (uint16_t)((vx[lane] == kk) & mask[lane]) << 1;
+    }
+    break;
+  case 0x4000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      pc[lane] += (uint16_t)((vx[lane] != kk) & mask[lane]) << 1;
+    }
+    break;
+  case 0x5000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      pc[lane] += (uint16_t)((vx[lane] == vy[lane]) & mask[lane]) << 1;
+    }
+    break;
+  case 0x6000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vx[lane] = select8(mask[lane], kk, vx[lane]);
+    }
+    break;
+  case 0x7000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vx[lane] += kk & mask[lane];
+    }
+    break;
+  case 0x8000:
+    execute_8xyn(lockstep, opcode);
+    break;
+  case 0x9000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      pc[lane] += (uint16_t)((vx[lane] != vy[lane]) & mask[lane]) << 1;
+    }
+    break;
+  case 0xA000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      index[lane] = select16(mask[lane], nnn, index[lane]);
+    }
+    break;
+  case 0xB000:
+  {
+    const uint8_t *v0 = lockstep->registers[0];
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      pc[lane] = select16(mask[lane], nnn + v0[lane], pc[lane]);
+    }
+    break;
+  }
+  case 0xC000:
+  {
+    uint32_t *restrict rand_state = lockstep->rand_state;
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      // the same xorshift as chip8_t, stepped only for lanes in the mask
+      uint32_t next = rand_state[lane];
+      next ^= next << 13;
+      next ^= next >> 17;
+      next ^= next << 5;
+      uint32_t wide = (uint32_t)-(mask[lane] & 1);
+      rand_state[lane] = (next & wide) | (rand_state[lane] & ~wide);
+      vx[lane] = select8(mask[lane], (next >> 24) & kk, vx[lane]);
+    }
+    break;
+  }
+  case 0xD000:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      if (mask[lane] != 0)
+      {
+        draw_sprite(lockstep, lane, x, y, n);
+      }
+    }
+    break;
+  case 0xE000:
+    if (kk == 0x9E || kk == 0xA1)
+    {
+      const uint8_t want = kk == 0x9E;
+      for (uint32_t lane = 0; lane < lanes; ++lane)
+      {
+        // keys past the keypad read as released
+        uint8_t key = vx[lane];
+        uint8_t pressed = key < KEY_COUNT && lockstep->keypad[key][lane] != 0;
+        pc[lane] += (uint16_t)((pressed == want) & mask[lane]) << 1;
+      }
+    }
+    else
+    {
+      trap_invalid(lockstep, opcode);
+    }
+    break;
+  case 0xF000:
+    execute_Fxnn(lockstep, opcode);
+    break;
+  }
+}
+
+/**
+ * @brief executes an 8xyn arithmetic opcode for every lane in the mask
+ *
+ * VF is written before Vx, as in chip8_t, so the result is the same when x or y is F
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param opcode the opcode
+ */
+static void execute_8xyn(lockstep_t *lockstep, uint16_t opcode)
+{
+  const uint32_t lanes = lockstep->lanes;
+  const uint8_t *restrict mask = lockstep->mask;
+  uint8_t *vx = lockstep->registers[(opcode & 0x0F00) >> 8];
+  const uint8_t *vy = lockstep->registers[(opcode & 0x00F0) >> 4];
+  uint8_t *vf = lockstep->registers[0xF];
+
+  switch (opcode & 0x000F)
+  {
+  case 0x0:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vx[lane] = select8(mask[lane], vy[lane], vx[lane]);
+    }
+    break;
+  case 0x1:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vx[lane] |= vy[lane] & mask[lane];
+    }
+    break;
+  case 0x2:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vx[lane] &= vy[lane] | ~mask[lane];
+    }
+    break;
+  case 0x3:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vx[lane] ^= vy[lane] & mask[lane];
+    }
+    break;
+  case 0x4:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      uint16_t sum = vx[lane] + vy[lane];
+      vf[lane] = select8(mask[lane], sum >> 8, vf[lane]);
+      vx[lane] = select8(mask[lane], (uint8_t)sum, vx[lane]);
+    }
+    break;
+  case 0x5:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vf[lane] = select8(mask[lane], vx[lane] > vy[lane], vf[lane]);
+      vx[lane] = select8(mask[lane], vx[lane] - vy[lane], vx[lane]);
+    }
+    break;
+  case 0x6:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vf[lane] = select8(mask[lane], vx[lane] & 0x01, vf[lane]);
+      vx[lane] = select8(mask[lane], vx[lane] >> 1, vx[lane]);
+    }
+    break;
+  case 0x7:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vf[lane] = select8(mask[lane], vy[lane] > vx[lane], vf[lane]);
+      vx[lane] = select8(mask[lane], vy[lane] - vx[lane], vx[lane]);
+    }
+    break;
+  case 0xE:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vf[lane] = select8(mask[lane], vx[lane] >> 7, vf[lane]);
+      vx[lane] = select8(mask[lane], vx[lane] << 1, vx[lane]);
+    }
+    break;
+  default:
+    trap_invalid(lockstep, opcode);
+    break;
+  }
+}
+
+/**
+ * @brief executes an Fxnn opcode for every lane in the mask
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param opcode the opcode
+ */
+static void execute_Fxnn(lockstep_t *lockstep, uint16_t opcode)
+{
+  const uint32_t lanes = lockstep->lanes;
+  const uint8_t *restrict mask = lockstep->mask;
+  uint16_t *restrict index = lockstep->index;
+  uint8_t *restrict delay_timer = lockstep->delay_timer;
+  uint8_t *restrict sound_timer = lockstep->sound_timer;
+  const uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t *vx = lockstep->registers[x];
+
+  switch (opcode & 0x00FF)
+  {
+  case 0x07:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      vx[lane] = select8(mask[lane], delay_timer[lane], vx[lane]);
+    }
+    break;
+  case 0x0A:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      if (mask[lane] != 0)
+      {
+        wait_for_key(lockstep, lane, x);
+      }
+    }
+    break;
+  case 0x15:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      delay_timer[lane] = select8(mask[lane], vx[lane], delay_timer[lane]);
+    }
+    break;
+  case 0x18:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      sound_timer[lane] = select8(mask[lane], vx[lane], sound_timer[lane]);
+    }
+    break;
+  case 0x1E:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      index[lane] += vx[lane] & mask[lane];
+    }
+    break;
+  case 0x29:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      index[lane] = select16(mask[lane], FONTSET_START_ADDRESS + vx[lane] * 5, index[lane]);
+    }
+    break;
+  case 0x33:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      if (mask[lane] != 0)
+      {
+        uint8_t *memory = lockstep->memory[lane];
+        uint8_t value = vx[lane];
+        memory[index[lane] & (MEMORY_SIZE - 1)] = value / 100;
+        memory[(index[lane] + 1) & (MEMORY_SIZE - 1)] = (value / 10) % 10;
+        memory[(index[lane] + 2) & (MEMORY_SIZE - 1)] = value % 10;
+        mark_written(lockstep, index[lane], 3);
+      }
+    }
+    break;
+  case 0x55:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      if (mask[lane] != 0)
+      {
+        for (int i = 0; i <= x; ++i)
+        {
+          lockstep->memory[lane][(index[lane] + i) & (MEMORY_SIZE - 1)] = lockstep->registers[i][lane];
+        }
+        mark_written(lockstep, index[lane], x + 1);
+      }
+    }
+    break;
+  case 0x65:
+    for (uint32_t lane = 0; lane < lanes; ++lane)
+    {
+      if (mask[lane] != 0)
+      {
+        for (int i = 0; i <= x; ++i)
+        {
+          lockstep->registers[i][lane] = lockstep->memory[lane][(index[lane] + i) & (MEMORY_SIZE - 1)];
+        }
+      }
+    }
+    break;
+  default:
+    trap_invalid(lockstep, opcode);
+    break;
+  }
+}
+
+/**
+ * @brief records that a lane stored to some addresses, so they are no longer known to match between lanes
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param address first address stored to
+ * @param length number of bytes stored
+ */
+static void mark_written(lockstep_t *lockstep, uint16_t address, int length)
+{
+  for (int i = 0; i < length; ++i)
+  {
+    lockstep->written[(address + i) & (MEMORY_SIZE - 1)] = 1;
+  }
+}
+
+/**
+ * @brief Dxyn for one lane, the same as chip8_t's
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param lane the lane drawing
+ * @param x register holding the sprite's column
+ * @param y register holding the sprite's row
+ * @param n height of the sprite
+ */
+static void draw_sprite(lockstep_t *lockstep, uint32_t lane, uint8_t x, uint8_t y, uint8_t n)
+{
+  const uint8_t *memory = lockstep->memory[lane];
+  uint64_t *display = lockstep->display[lane];
+  uint8_t pos_x = lockstep->registers[x][lane] % DISPLAY_WIDTH;
+  uint8_t pos_y = lockstep->registers[y][lane] % DISPLAY_HEIGHT;
+  uint8_t collision = 0;
+
+  for (int row = 0; row < n && pos_y + row < DISPLAY_HEIGHT; ++row)
+  {
+    uint8_t sprite = memory[(lockstep->index[lane] + row) & (MEMORY_SIZE - 1)];
+    uint64_t sprite_row = ((uint64_t)sprite << (DISPLAY_WIDTH - 8)) >> pos_x;
+
+    collision |= (display[pos_y + row] & sprite_row) != 0;
+    display[pos_y + row] ^= sprite_row;
+  }
+
+  lockstep->registers[0xF][lane] = collision;
+}
+
+/**
+ * @brief Fx0A for one lane, holds the lane's PC on the instruction until a key is down
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param lane the lane waiting
+ * @param x register to store the key in
+ */
+static void wait_for_key(lockstep_t *lockstep, uint32_t lane, uint8_t x)
+{
+  for (int key = 0; key < KEY_COUNT; ++key)
+  {
+    if (lockstep->keypad[key][lane] != 0)
+    {
+      lockstep->registers[x][lane] = key;
+      return;
+    }
+  }
+
+  lockstep->pc[lane] -= 2;
+}
+
+/**
+ * @brief counts an opcode that isn't a CHIP-8 instruction for every lane in the mask
+ *
+ * only the first one is logged, like chip8_t's trap
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param opcode the opcode
+ */
+static void trap_invalid(lockstep_t *lockstep, uint16_t opcode)
+{
+  if (lockstep->invalid_opcodes == 0)
+  {
+    LOG_ERROR("Invalid opcode: 0x%X, any more are only counted", opcode);
+  }
+  for (uint32_t lane = 0; lane < lockstep->lanes; ++lane)
+  {
+    lockstep->invalid_opcodes += lockstep->mask[lane] != 0;
+  }
+}
+
+/* ---------------------------- public functions ---------------------------- */
+
+lockstep_t *lockstep_create(uint32_t lanes)
+{
+  lockstep_t *lockstep = calloc(1, sizeof(lockstep_t));
+  chip8_t *initial = malloc(sizeof(chip8_t));
+
+  if (lockstep == NULL || initial == NULL || lanes == 0)
+  {
+    LOG_ERROR("Could not allocate the lockstep engine");
+    free(lockstep);
+    free(initial);
+    return NULL;
+  }
+
+  lockstep->lanes = lanes;
+
+  bool allocated = true;
+  for (int r = 0; r < REGISTER_COUNT; ++r)
+  {
+    allocated &= (lockstep->registers[r] = allocate_lanes(lanes, sizeof(uint8_t))) != NULL;
+  }
+  for (int key = 0; key < KEY_COUNT; ++key)
+  {
+    allocated &= (lockstep->keypad[key] = allocate_lanes(lanes, sizeof(uint8_t))) != NULL;
+  }
+  allocated &= (lockstep->index = allocate_lanes(lanes, sizeof(uint16_t))) != NULL;
+  allocated &= (lockstep->pc = allocate_lanes(lanes, sizeof(uint16_t))) != NULL;
+  allocated &= (lockstep->sp = allocate_lanes(lanes, sizeof(uint8_t))) != NULL;
+  allocated &= (lockstep->delay_timer = allocate_lanes(lanes, sizeof(uint8_t))) != NULL;
+  allocated &= (lockstep->sound_timer = allocate_lanes(lanes, sizeof(uint8_t))) != NULL;
+  allocated &= (lockstep->rand_state = allocate_lanes(lanes, sizeof(uint32_t))) != NULL;
+  allocated &= (lockstep->remaining = allocate_lanes(lanes, sizeof(uint32_t))) != NULL;
+  allocated &= (lockstep->mask = allocate_lanes(lanes, sizeof(uint8_t))) != NULL;
+  allocated &= (lockstep->stack = allocate_lanes(lanes, sizeof(lockstep->stack[0]))) != NULL;
+  allocated &= (lockstep->memory = allocate_lanes(lanes, sizeof(lockstep->memory[0]))) != NULL;
+  allocated &= (lockstep->display = allocate_lanes(lanes, sizeof(lockstep->display[0]))) != NULL;
+
+  if (!allocated)
+  {
+    LOG_ERROR("Could not allocate %u lockstep lanes", lanes);
+    lockstep_destroy(lockstep);
+    free(initial);
+    return NULL;
+  }
+
+  if (chip8_initialise(initial, NULL) != 0)
+  {
+    lockstep_destroy(lockstep);
+    free(initial);
+    return NULL;
+  }
+  reset_lanes(lockstep, initial);
+  chip8_release(initial);
+  free(initial);
+
+  return lockstep;
+}
+
+void lockstep_destroy(lockstep_t *lockstep)
+{
+  if (lockstep == NULL)
+  {
+    return;
+  }
+
+  for (int r = 0; r < REGISTER_COUNT; ++r)
+  {
+    free(lockstep->registers[r]);
+  }
+  for (int key = 0; key < KEY_COUNT; ++key)
+  {
+    free(lockstep->keypad[key]);
+  }
+  free(lockstep->index);
+  free(lockstep->pc);
+  free(lockstep->sp);
+  free(lockstep->delay_timer);
+  free(lockstep->sound_timer);
+  free(lockstep->rand_state);
+  free(lockstep->remaining);
+  free(lockstep->mask);
+  free(lockstep->stack);
+  free(lockstep->memory);
+  free(lockstep->display);
+  free(lockstep);
+}
+
+int lockstep_load_rom(lockstep_t *lockstep, const uint8_t *rom, size_t rom_size)
+{
+  chip8_t *initial = malloc(sizeof(chip8_t));
+
+  if (initial == NULL)
+  {
+    LOG_ERROR("Could not allocate the lockstep engine");
+    return 1;
+  }
+
+  if (chip8_initialise(initial, NULL) != 0)
+  {
+    free(initial);
+    return 1;
+  }
+  if (chip8_load_rom_data(initial, rom, rom_size) != 0)
+  {
+    chip8_release(initial);
+    free(initial);
+    return 1;
+  }
+
+  reset_lanes(lockstep, initial);
+  chip8_release(initial);
+  free(initial);
+  return 0;
+}
+
+void lockstep_run(lockstep_t *lockstep, uint32_t cycles)
+{
+  if (cycles == 0)
+  {
+    return;
+  }
+
+  const uint32_t lanes = lockstep->lanes;
+  uint32_t *restrict remaining = lockstep->remaining;
+  const uint16_t *restrict pc = lockstep->pc;
+  uint32_t lowest = NO_LANE_PC;
+
+  for (uint32_t lane = 0; lane < lanes; ++lane)
+  {
+    remaining[lane] = cycles;
+    lowest = pc[lane] < lowest ? pc[lane] : lowest;
+  }
+
+  // the lanes at the lowest PC go first, so lanes that fell behind catch up with the rest
+  while (lowest != NO_LANE_PC)
+  {
+    uint32_t leader = build_mask(lockstep, lowest);
+    execute(lockstep, fetch_opcode(lockstep->memory[leader], lowest));
+    lowest = retire_step(lockstep);
+  }
+}
+
+void lockstep_tick_timers(lockstep_t *lockstep)
+{
+  uint8_t *restrict delay_timer = lockstep->delay_timer;
+  uint8_t *restrict sound_timer = lockstep->sound_timer;
+  const uint32_t lanes = lockstep->lanes;
+
+  for (uint32_t lane = 0; lane < lanes; ++lane)
+  {
+    delay_timer[lane] -= delay_timer[lane] != 0;
+    sound_timer[lane] -= sound_timer[lane] != 0;
+  }
+}
+
+void lockstep_get_lane(const lockstep_t *lockstep, uint32_t lane, chip8_t *chip8)
+{
+  for (int r = 0; r < REGISTER_COUNT; ++r)
+  {
+    chip8->registers[r] = lockstep->registers[r][lane];
+  }
+  for (int key = 0; key < KEY_COUNT; ++key)
+  {
+    chip8->keypad[key] = lockstep->keypad[key][lane];
+  }
+  chip8->index = lockstep->index[lane];
+  chip8->pc = lockstep->pc[lane];
+  chip8->sp = lockstep->sp[lane];
+  chip8->delay_timer = lockstep->delay_timer[lane];
+  chip8->sound_timer = lockstep->sound_timer[lane];
+  chip8->rand_state = lockstep->rand_state[lane];
+  memcpy(chip8->stack, lockstep->stack[lane], sizeof(chip8->stack));
+  memcpy(chip8->display, lockstep->display[lane], sizeof(chip8->display));
+
+  // the memory is new to this struct, so nothing it decoded before still holds
+  chip8_write_memory(chip8, 0, lockstep->memory[lane], MEMORY_SIZE);
+  chip8->dirty_rows = ALL_ROWS_DIRTY;
+}
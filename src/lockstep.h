@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "cpu.h"
+
+/*
+  struct-of-arrays engine that steps many instances ("lanes") of the same ROM
+  together. each register, the index register, PC, SP and the timers are kept
+  as one contiguous array with an entry per lane, so an instruction is
+  executed for every lane by one loop the compiler can vectorise
+
+  each step picks the lowest PC among lanes that still have instructions to
+  run, and executes that instruction for every lane at that PC, masking the
+  rest. lanes that diverge (eg. after a skip that only some lanes take) are
+  stepped group by group, and the lowest PC first rule tends to bring them back
+  together at the next join point. every lane behaves exactly as if it were a
+  chip8_t run through `chip8_run`
+*/
+
+typedef struct lockstep
+{
+  uint32_t lanes;
+  uint8_t *registers[REGISTER_COUNT];   // registers[r][lane]
+  uint16_t *index;                      // index register of each lane
+  uint16_t *pc;                         // program counter of each lane
+  uint8_t *sp;                          // stack pointer of each lane
+  uint8_t *delay_timer;                 // delay timer of each lane
+  uint8_t *sound_timer;                 // sound timer of each lane
+  uint32_t *rand_state;                 // Cxkk generator of each lane
+  uint8_t *keypad[KEY_COUNT];           // keypad[key][lane], set by the caller like chip8_t.keypad
+  uint32_t *remaining;                  // instructions each lane still has to run in `lockstep_run`
+  uint8_t *mask;                        // 0xFF for lanes executing the current step, 0 otherwise
+  uint16_t (*stack)[STACK_DEPTH];       // call stack of each lane
+  uint8_t (*memory)[MEMORY_SIZE];       // memory of each lane
+  uint64_t (*display)[DISPLAY_HEIGHT];  // display of each lane, laid out like chip8_t.display
+  uint8_t written[MEMORY_SIZE];         // addresses some lane stored to, where lanes may hold different code
+  uint64_t invalid_opcodes;             // invalid opcodes executed, counted per lane, only the first one is logged
+} lockstep_t;
+
+/* --------------------------- function prototypes -------------------------- */
+
+/**
+ * @brief allocates an engine with every lane initialised, as by `chip8_initialise`
+ *
+ * @param lanes number of instances
+ * @return the new engine, `NULL` on failure
+ */
+lockstep_t *lockstep_create(uint32_t lanes);
+
+/**
+ * @brief frees an engine
+ *
+ * @param lockstep pointer to lockstep struct
+ */
+void lockstep_destroy(lockstep_t *lockstep);
+
+/**
+ * @brief resets every lane and loads the same ROM into all of them
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param rom the ROM's bytes
+ * @param rom_size number of bytes in `rom`
+ * @return `0` on success, `1` on failure
+ */
+int lockstep_load_rom(lockstep_t *lockstep, const uint8_t *rom, size_t rom_size);
+
+/**
+ * @brief executes `cycles` instructions on every lane
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param cycles number of instructions each lane executes
+ */
+void lockstep_run(lockstep_t *lockstep, uint32_t cycles);
+
+/**
+ * @brief decrements the delay and sound timers of every lane, once per 60Hz frame
+ *
+ * @param lockstep pointer to lockstep struct
+ */
+void lockstep_tick_timers(lockstep_t *lockstep);
+
+/**
+ * @brief copies one lane into a chip8 struct, eg. to inspect or keep running it alone
+ *
+ * @param lockstep pointer to lockstep struct
+ * @param lane lane to copy
+ * @param chip8 pointer to chip8 struct, initialised
+ */
+void lockstep_get_lane(const lockstep_t *lockstep, uint32_t lane, chip8_t *chip8);
@@ -1,6 +1,5 @@
 #pragma once
 #include <stdio.h>
-#include "config.h"
 
 #define LOG_RESET "\x1b[0m"
 #define LOG_RED "\x1b[31m"
@@ -8,30 +7,72 @@
 #define LOG_BLUE "\x1b[34m"
 
 /**
- * @brief informational log message, only executes if verbose logging is enabled
+ * @brief informational log message, only executes if `verbose` is true
+ *
+ * @param verbose whether to log, eg. `chip8->config.verbose_logging`
  * @param fmt the format string
  * @param ... arguments following the format string
  */
-#define LOG_INFO(fmt, ...)                                                  \
+#define LOG_INFO_IF(verbose, fmt, ...)                                      \
   do                                                                        \
   {                                                                         \
-    if (g_config.verbose_logging)                                           \
+    if (verbose)                                                            \
       fprintf(stdout, LOG_BLUE "[INFO] " LOG_RESET fmt "\n", ##__VA_ARGS__); \
   } while (0)
 
 /**
- * @brief success log message, only executes if verbose logging is enabled
+ * @brief success log message, only executes if `verbose` is true
  *
+ * @param verbose whether to log, eg. `chip8->config.verbose_logging`
  * @param fmt the format string.
  * @param ... arguments following the format string
  */
-#define LOG_OK(fmt, ...)                                                   \
+#define LOG_OK_IF(verbose, fmt, ...)                                       \
   do                                                                       \
   {                                                                        \
-    if (g_config.verbose_logging)                                          \
+    if (verbose)                                                           \
       fprintf(stdout, LOG_GREEN "[OK] " LOG_RESET fmt "\n", ##__VA_ARGS__); \
   } while (0)
 
+/**
+ * @brief informational log message, only executes if verbose logging is enabled
+ *
+ * reads `g_config`, so only the programs built around the core use it, after
+ * including config.h. the core logs with its instance's own flag instead
+ *
+ * @param fmt the format string
+ * @param ... arguments following the format string
+ */
+#define LOG_INFO(fmt, ...) LOG_INFO_IF(g_config.verbose_logging, fmt, ##__VA_ARGS__)
+
+/**
+ * @brief success log message, only executes if verbose logging is enabled
+ *
+ * @param fmt the format string.
+ * @param ... arguments following the format string
+ */
+#define LOG_OK(fmt, ...) LOG_OK_IF(g_config.verbose_logging, fmt, ##__VA_ARGS__)
+
+/**
+ * @brief per-instruction log message, compiled in only when CHIP8_TRACE_LOG is defined
+ *
+ * without it the call and its arguments disappear entirely, so the hot path
+ * doesn't even check `verbose_logging`. use the binary tracer (trace.h) to see
+ * what a release build executes
+ *
+ * @param chip8 pointer to the chip8 struct executing, whose config says whether to log
+ * @param fmt the format string
+ * @param ... arguments following the format string
+ */
+#ifdef CHIP8_TRACE_LOG
+#define LOG_TRACE(chip8, fmt, ...) LOG_INFO_IF((chip8)->config.verbose_logging, fmt, ##__VA_ARGS__)
+#else
+#define LOG_TRACE(chip8, fmt, ...) \
+  do                        \
+  {                         \
+  } while (0)
+#endif
+
 /**
  * @brief error log message, executes regardless of whether verbose logging is enabled
  *
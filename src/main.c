@@ -1,25 +1,107 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <math.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
 #include "cpu.h"
 #include "logger.h"
 #include "config.h"
+#include "trace.h"
+#include "rewind.h"
+#include "movie.h"
 #include <SDL.h>
 
 #define WINDOW_TITLE "CHIP-8"
 
+#define FRAME_RATE 60 // timers, input and rendering all run at 60Hz
+
 #define SAMPLE_RATE 48000 // number of samples computer takes per second to represent the wave
 #define AMPLITUDE 2000
 #define FREQUENCY 440 // "440Hz is a middle C and pleasant as well" ~ https://forum.allaboutcircuits.com/threads/frequency-for-a-nice-beep-sound.116284/
+#define SAMPLES_PER_FRAME (SAMPLE_RATE / FRAME_RATE) // the buzzer can only change once per frame, on a multiple of this
+#define BUZZER_QUEUE_SIZE 8                          // frames of buzzer state in flight to the audio thread, a power of 2
+#define MAX_FRAMES_BEHIND 4                          // after a longer stall (eg. the window being dragged) the missed frames are dropped
+#define INPUT_QUEUE_SIZE 256                         // key changes in flight to the emulation thread, a power of 2
+#define FRAME_FRESH 4u                               // set in `frame_buffer_t.shared` until the render thread takes that frame
+
+typedef struct audio
+{
+  _Atomic uint32_t head;            // frames pushed by the emulation thread
+  _Atomic uint32_t tail;            // frames taken by the audio callback
+  bool queue[BUZZER_QUEUE_SIZE];    // whether the buzzer sounds during each frame
+  bool buzzing;                     // audio thread only: state of the frame being played
+  uint32_t frame_samples_left;      // audio thread only: samples until the next frame's state is taken
+  uint32_t phase;                   // audio thread only: position in the wave's cycle, a full cycle is 2^32
+} audio_t;
+
+typedef struct pacer
+{
+  uint64_t frequency; // performance counter ticks per second
+  uint64_t start;     // performance counter at frame 0
+  uint64_t frame;     // frames run since `start`
+} pacer_t;
+
+typedef struct frame_buffer
+{
+  uint64_t frames[3][DISPLAY_HEIGHT]; // one being written, one being drawn and the newest finished one between them
+  _Atomic uint32_t shared;            // index of the frame between the threads, with FRAME_FRESH until it's taken
+  uint32_t back;                      // emulation thread only: frame being written
+  uint32_t front;                     // render thread only: frame being drawn
+} frame_buffer_t;
+
+typedef enum input_type
+{
+  INPUT_KEY,    // a keypad key went down or up
+  INPUT_REWIND, // the rewind key went down or up
+  INPUT_TURBO,  // the turbo key went down or up
+} input_type_t;
+
+typedef struct input
+{
+  uint8_t type; // an input_type_t
+  uint8_t key;  // keypad key, for INPUT_KEY
+  bool down;
+} input_t;
+
+typedef struct input_queue
+{
+  _Atomic uint32_t head;          // changes pushed by the render thread
+  _Atomic uint32_t tail;          // changes taken by the emulation thread
+  input_t queue[INPUT_QUEUE_SIZE];
+} input_queue_t;
+
+typedef struct emulation
+{
+  chip8_t *chip8;             // owned by the emulation thread while it runs
+  audio_t *audio;             // where the buzzer state of every frame goes
+  rewind_buffer_t *history;   // the last frames, NULL when rewinding is off
+  movie_recorder_t *recorder; // where key changes are recorded, NULL when not recording
+  frame_buffer_t frames;      // finished displays, handed to the render thread
+  input_queue_t input;        // key changes, handed to the emulation thread
+  SDL_sem *wake;              // posted whenever input is queued or the thread is stopped, to cut its sleep short
+  _Atomic bool running;       // cleared by the render thread to stop the emulation thread
+  pacer_t pacer;              // emulation thread only: the 60Hz frame clock the cpu runs on
+  uint64_t instructions;      // emulation thread only: executed so far, what recorded key changes are keyed by
+  bool rewinding;             // emulation thread only: the rewind key is held, frames are stepped back instead of run
+  bool turbo;                 // emulation thread only: the turbo key is held, frames run back to back
+} emulation_t;
 
 typedef struct Emulator
 {
   SDL_Window *window;
   SDL_Renderer *renderer;
+  SDL_Texture *texture; // native 64x32 copy of the display, scaled to the window when presented
   SDL_AudioDeviceID audio_device;
+  audio_t audio; // buzzer state handed to the audio thread, which reads it from the device's userdata
   color_t bg_color;
   color_t fg_color;
+  bool vsync;                        // presenting waits for the display's refresh, so it paces the render loop
+  uint64_t shown[DISPLAY_HEIGHT];    // the display as last uploaded to the texture
+  bool redraw;                       // the window's contents were lost, upload every row again
+  emulation_t emulation;             // the cpu, on its own thread
 } emulator_t;
 
 /* --------------------------- forward declaration -------------------------- */
@@ -27,15 +109,35 @@ typedef struct Emulator
 static void print_usage(FILE *out, const char *program);
 
 static color_t hex_to_rgba(const char *hex);
+static uint32_t color_to_argb(color_t color);
 
 static int initialise_sdl(emulator_t *emulator);
 static void cleanup_sdl(emulator_t *emulator, int exit_status);
 
+static long long parse_number(const char *program, const char *text, long long min, long long max, const char *name);
 static void parse_arguments(int argc, char **argv, char **rom_path);
 
-static void handle_input(chip8_t *chip8, bool *running);
-static void draw_display(chip8_t *chip8, emulator_t *emulator);
+static int keypad_index(SDL_Scancode scancode);
+static void handle_input(emulator_t *emulator, bool *running);
+static void draw_display(emulator_t *emulator);
 static void audio_callback(void *userdata, uint8_t *stream, int len);
+static void push_buzzer(audio_t *audio, bool buzzing);
+
+static void publish_frame(frame_buffer_t *frames, const uint64_t *display);
+static const uint64_t *take_frame(frame_buffer_t *frames);
+static void push_input(emulation_t *emulation, input_type_t type, uint8_t key, bool down);
+static void take_input(emulation_t *emulation);
+static int emulation_thread(void *data);
+
+static void pacer_start(pacer_t *pacer);
+static uint64_t pacer_deadline(const pacer_t *pacer);
+static uint32_t pacer_frames_due(pacer_t *pacer);
+static void pacer_wait(const pacer_t *pacer, SDL_sem *wake);
+
+static void run_headless(chip8_t *chip8, const movie_t *movie);
+static uint64_t display_hash(const chip8_t *chip8);
+static void save_trace(chip8_t *chip8);
+static void report_profile(chip8_t *chip8);
 
 /* ---------------------------- helper functions ---------------------------- */
 
@@ -47,7 +149,7 @@ static void audio_callback(void *userdata, uint8_t *stream, int len);
  */
 static void print_usage(FILE *out, const char *program)
 {
-  fprintf(out, "Usage: %s [-v] [-s <scale>] [-d <delay>] [-c <bg_color> <fg_color>] -r <rom_path>\n", program);
+  fprintf(out, "Usage: %s [-v] [-s <scale>] [-d <delay> | --ipf <n> | --hz <n>] [-c <bg_color> <fg_color>] [--headless [--cycles <n>] [--frames <n>]] [--jit] [--seed <n>] [--trace <trace_path>] [--profile <json_path> [--profile-time]] [--rewind-mb <n>] [--record <movie_path> | --replay <movie_path>] [--audio-buffer <samples>] [--vsync] -r <rom_path>\n", program);
 }
 
 /**
@@ -88,6 +190,17 @@ static color_t hex_to_rgba(const char *hex)
   return color;
 }
 
+/**
+ * @brief packs a color into a `SDL_PIXELFORMAT_ARGB8888` pixel
+ *
+ * @param color color to pack
+ * @return the packed pixel
+ */
+static uint32_t color_to_argb(color_t color)
+{
+  return (uint32_t)color.a << 24 | (uint32_t)color.r << 16 | (uint32_t)color.g << 8 | color.b;
+}
+
 /**
  * @brief initialise SDL
  *
@@ -105,7 +218,7 @@ static int initialise_sdl(emulator_t *emulator)
   const int window_width = DISPLAY_WIDTH * g_config.window_scale;
   const int window_height = DISPLAY_HEIGHT * g_config.window_scale;
 
-  emulator->window = SDL_CreateWindow(WINDOW_TITLE, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, window_width, window_height, 0);
+  emulator->window = SDL_CreateWindow(WINDOW_TITLE, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, window_width, window_height, SDL_WINDOW_RESIZABLE);
 
   if (!emulator->window)
   {
@@ -113,7 +226,7 @@ static int initialise_sdl(emulator_t *emulator)
     return 1;
   }
 
-  emulator->renderer = SDL_CreateRenderer(emulator->window, -1, 0);
+  emulator->renderer = SDL_CreateRenderer(emulator->window, -1, g_config.vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
 
   if (!emulator->renderer)
   {
@@ -121,13 +234,33 @@ static int initialise_sdl(emulator_t *emulator)
     return 1;
   }
 
+  SDL_RendererInfo renderer_info;
+  emulator->vsync = g_config.vsync && SDL_GetRendererInfo(emulator->renderer, &renderer_info) == 0 &&
+                    (renderer_info.flags & SDL_RENDERER_PRESENTVSYNC);
+  if (g_config.vsync && !emulator->vsync)
+  {
+    LOG_INFO("The renderer can't wait for vsync, sleeping between frames instead");
+  }
+
+  // keep the 2:1 aspect ratio when the window is resized, letterboxing with the bg color
+  SDL_RenderSetLogicalSize(emulator->renderer, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+
+  emulator->texture = SDL_CreateTexture(emulator->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+
+  if (!emulator->texture)
+  {
+    LOG_ERROR("SDL_CreateTexture failed: %s", SDL_GetError());
+    return 1;
+  }
+
   SDL_AudioSpec want, have;
   SDL_zero(want);
   want.freq = SAMPLE_RATE;
   want.format = AUDIO_S16SYS;
   want.channels = 1;
-  want.samples = 4096;
+  want.samples = (uint16_t)g_config.audio_buffer;
   want.callback = audio_callback;
+  want.userdata = &emulator->audio;
 
   emulator->audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
   if (!emulator->audio_device)
@@ -136,6 +269,11 @@ static int initialise_sdl(emulator_t *emulator)
     return 1;
   }
 
+  LOG_INFO("Audio buffer: %d samples (%.1f ms)", have.samples, 1000.0 * have.samples / have.freq);
+
+  // the device plays silence between beeps instead of being paused and resumed, so the buzzer follows the frames exactly
+  SDL_PauseAudioDevice(emulator->audio_device, 0);
+
   return 0;
 }
 
@@ -147,13 +285,44 @@ static int initialise_sdl(emulator_t *emulator)
  */
 static void cleanup_sdl(emulator_t *emulator, int exit_status)
 {
+  rewind_destroy(emulator->emulation.history);
+  if (emulator->emulation.wake != NULL)
+  {
+    SDL_DestroySemaphore(emulator->emulation.wake);
+  }
   SDL_CloseAudioDevice(emulator->audio_device);
+  SDL_DestroyTexture(emulator->texture);
   SDL_DestroyRenderer(emulator->renderer);
   SDL_DestroyWindow(emulator->window);
   SDL_Quit();
   exit(exit_status);
 }
 
+/**
+ * @brief parses a whole number argument, exiting with a usage error unless it is all digits and in range
+ *
+ * @param program program name, which is `argv[0]`
+ * @param text the argument
+ * @param min smallest value accepted
+ * @param max largest value accepted
+ * @param name what the number is, for the error message
+ * @return the number
+ */
+static long long parse_number(const char *program, const char *text, long long min, long long max, const char *name)
+{
+  char *end;
+  errno = 0;
+  long long value = strtoll(text, &end, 10);
+
+  if (end == text || *end != '\0' || errno == ERANGE || value < min || value > max)
+  {
+    fprintf(stderr, "%s must be a whole number from %lld to %lld\n", name, min, max);
+    print_usage(stderr, program);
+    exit(EXIT_FAILURE);
+  }
+  return value;
+}
+
 /**
  * @brief parses cli arguments
  *
@@ -207,7 +376,9 @@ static void parse_arguments(int argc, char **argv, char **rom_path)
     {
       if (i + 1 < argc)
       {
-        g_config.cycle_delay = atoi(argv[++i]);
+        // kept for compatibility, a delay of d ms per instruction is 1000 / d instructions per second
+        long cycle_delay = (long)parse_number(program, argv[++i], 1, 1000 / CHIP8_TIMER_HZ, "Cycle delay");
+        g_config.cpu_hz = (int)(1000 / cycle_delay);
       }
       else
       {
@@ -218,6 +389,36 @@ static void parse_arguments(int argc, char **argv, char **rom_path)
       continue;
     }
 
+    if (strcmp(argv[i], "--ipf") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.cpu_hz = (int)parse_number(program, argv[++i], 1, INT_MAX / FRAME_RATE, "Instructions per frame") * FRAME_RATE;
+      }
+      else
+      {
+        fprintf(stderr, "Instructions per frame not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--hz") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.cpu_hz = (int)parse_number(program, argv[++i], CHIP8_TIMER_HZ, INT_MAX, "Instruction rate");
+      }
+      else
+      {
+        fprintf(stderr, "Instruction rate not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
     if (strcmp(argv[i], "-c") == 0)
     {
       if (i + 2 < argc)
@@ -234,19 +435,255 @@ static void parse_arguments(int argc, char **argv, char **rom_path)
       continue;
     }
 
+    if (strcmp(argv[i], "--headless") == 0)
+    {
+      g_config.headless = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--cycles") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.max_cycles = (uint64_t)parse_number(program, argv[++i], 1, LLONG_MAX, "Cycle count");
+      }
+      else
+      {
+        fprintf(stderr, "Cycle count not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--frames") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.max_frames = (uint64_t)parse_number(program, argv[++i], 1, LLONG_MAX, "Frame count");
+      }
+      else
+      {
+        fprintf(stderr, "Frame count not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--jit") == 0)
+    {
+      g_config.jit = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--seed") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.seeded = true;
+        g_config.seed = (uint32_t)parse_number(program, argv[++i], 0, UINT32_MAX, "Seed");
+      }
+      else
+      {
+        fprintf(stderr, "Seed not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--trace") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.trace_path = argv[++i];
+      }
+      else
+      {
+        fprintf(stderr, "Trace path not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--profile") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.profile_path = argv[++i];
+      }
+      else
+      {
+        fprintf(stderr, "Profile path not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--profile-time") == 0)
+    {
+      g_config.profile_timed = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--record") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.record_path = argv[++i];
+      }
+      else
+      {
+        fprintf(stderr, "Movie path not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--replay") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.replay_path = argv[++i];
+        g_config.headless = true;
+      }
+      else
+      {
+        fprintf(stderr, "Movie path not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--vsync") == 0)
+    {
+      g_config.vsync = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--audio-buffer") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        g_config.audio_buffer = atoi(argv[++i]);
+      }
+      else
+      {
+        fprintf(stderr, "Audio buffer size not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+
+      // SDL only takes powers of 2
+      if (g_config.audio_buffer < 64 || g_config.audio_buffer > 8192 ||
+          (g_config.audio_buffer & (g_config.audio_buffer - 1)) != 0)
+      {
+        fprintf(stderr, "Audio buffer size must be a power of 2 from 64 to 8192\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strcmp(argv[i], "--rewind-mb") == 0)
+    {
+      if (i + 1 < argc)
+      {
+        const char *text = argv[++i];
+        char *end;
+        double megabytes = strtod(text, &end);
+
+        // written so that NaN fails too
+        if (end == text || *end != '\0' || !(megabytes >= 0 && megabytes <= REWIND_MAX_BUDGET_MB))
+        {
+          fprintf(stderr, "Rewind budget must be a number of megabytes from 0 to %u\n", REWIND_MAX_BUDGET_MB);
+          print_usage(stderr, program);
+          exit(EXIT_FAILURE);
+        }
+        g_config.rewind_budget = (size_t)(megabytes * (1 << 20));
+      }
+      else
+      {
+        fprintf(stderr, "Rewind budget not provided\n");
+        print_usage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
     fprintf(stderr, "Unknown argument: %s\n", argv[i]);
     print_usage(stderr, program);
     exit(EXIT_FAILURE);
   }
 }
 
+/**
+ * @brief maps a keyboard key to the chip8 keypad key in the same spot
+ *
+ * 1 2 3 4     1 2 3 C
+ * Q W E R  →  4 5 6 D
+ * A S D F     7 8 9 E
+ * Z X C V     A 0 B F
+ *
+ * @param scancode the keyboard key
+ * @return keypad key, or `-1` for a key off the keypad
+ */
+static int keypad_index(SDL_Scancode scancode)
+{
+  switch (scancode)
+  {
+  case SDL_SCANCODE_1:
+    return 0x1;
+  case SDL_SCANCODE_2:
+    return 0x2;
+  case SDL_SCANCODE_3:
+    return 0x3;
+  case SDL_SCANCODE_4:
+    return 0xC;
+  case SDL_SCANCODE_Q:
+    return 0x4;
+  case SDL_SCANCODE_W:
+    return 0x5;
+  case SDL_SCANCODE_E:
+    return 0x6;
+  case SDL_SCANCODE_R:
+    return 0xD;
+  case SDL_SCANCODE_A:
+    return 0x7;
+  case SDL_SCANCODE_S:
+    return 0x8;
+  case SDL_SCANCODE_D:
+    return 0x9;
+  case SDL_SCANCODE_F:
+    return 0xE;
+  case SDL_SCANCODE_Z:
+    return 0xA;
+  case SDL_SCANCODE_X:
+    return 0x0;
+  case SDL_SCANCODE_C:
+    return 0xB;
+  case SDL_SCANCODE_V:
+    return 0xF;
+  default:
+    return -1;
+  }
+}
+
 /**
  * @brief processes user input by handling SDL events
  *
- * @param chip8
- * @param running
+ * runs on the render thread, which SDL requires events to be polled on. key
+ * changes aren't applied here but queued for the emulation thread
+ *
+ * @param emulator pointer to emulator struct
+ * @param running cleared when the window is closed or escape is pressed
  */
-static void handle_input(chip8_t *chip8, bool *running)
+static void handle_input(emulator_t *emulator, bool *running)
 {
   SDL_Event event;
 
@@ -257,192 +694,599 @@ static void handle_input(chip8_t *chip8, bool *running)
     case SDL_QUIT:
       *running = false;
       break;
+    case SDL_WINDOWEVENT:
+      if (event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+      {
+        emulator->redraw = true; // window contents were lost, draw everything again
+      }
+      break;
     case SDL_KEYDOWN:
+    case SDL_KEYUP:
+    {
+      const bool down = event.type == SDL_KEYDOWN;
+      if (event.key.repeat)
+      {
+        break;
+      }
+
       switch (event.key.keysym.scancode)
       {
       case SDL_SCANCODE_ESCAPE:
         *running = false;
         break;
-      case SDL_SCANCODE_1:
-        chip8->keypad[0x1] = 1;
-        break;
-      case SDL_SCANCODE_2:
-        chip8->keypad[0x2] = 1;
+      case SDL_SCANCODE_BACKSPACE:
+        push_input(&emulator->emulation, INPUT_REWIND, 0, down);
         break;
-      case SDL_SCANCODE_3:
-        chip8->keypad[0x3] = 1;
-        break;
-      case SDL_SCANCODE_4:
-        chip8->keypad[0xC] = 1;
-        break;
-      case SDL_SCANCODE_Q:
-        chip8->keypad[0x4] = 1;
-        break;
-      case SDL_SCANCODE_W:
-        chip8->keypad[0x5] = 1;
-        break;
-      case SDL_SCANCODE_E:
-        chip8->keypad[0x6] = 1;
-        break;
-      case SDL_SCANCODE_R:
-        chip8->keypad[0xD] = 1;
-        break;
-      case SDL_SCANCODE_A:
-        chip8->keypad[0x7] = 1;
-        break;
-      case SDL_SCANCODE_S:
-        chip8->keypad[0x8] = 1;
-        break;
-      case SDL_SCANCODE_D:
-        chip8->keypad[0x9] = 1;
-        break;
-      case SDL_SCANCODE_F:
-        chip8->keypad[0xE] = 1;
-        break;
-      case SDL_SCANCODE_Z:
-        chip8->keypad[0xA] = 1;
-        break;
-      case SDL_SCANCODE_X:
-        chip8->keypad[0x0] = 1;
-        break;
-      case SDL_SCANCODE_C:
-        chip8->keypad[0xB] = 1;
-        break;
-      case SDL_SCANCODE_V:
-        chip8->keypad[0xF] = 1;
+      case SDL_SCANCODE_TAB:
+        push_input(&emulator->emulation, INPUT_TURBO, 0, down);
         break;
       default:
+      {
+        int key = keypad_index(event.key.keysym.scancode);
+        if (key >= 0)
+        {
+          push_input(&emulator->emulation, INPUT_KEY, (uint8_t)key, down);
+        }
         break;
       }
+      }
+      break;
+    }
+    default:
       break;
-
-    case SDL_KEYUP:
-      switch (event.key.keysym.scancode)
-      {
-      case SDL_SCANCODE_1:
-        chip8->keypad[0x1] = 0;
-        break;
-      case SDL_SCANCODE_2:
-        chip8->keypad[0x2] = 0;
-        break;
-      case SDL_SCANCODE_3:
-        chip8->keypad[0x3] = 0;
-        break;
-      case SDL_SCANCODE_4:
-        chip8->keypad[0xC] = 0;
-        break;
-      case SDL_SCANCODE_Q:
-        chip8->keypad[0x4] = 0;
-        break;
-      case SDL_SCANCODE_W:
-        chip8->keypad[0x5] = 0;
-        break;
-      case SDL_SCANCODE_E:
-        chip8->keypad[0x6] = 0;
-        break;
-      case SDL_SCANCODE_R:
-        chip8->keypad[0xD] = 0;
-        break;
-      case SDL_SCANCODE_A:
-        chip8->keypad[0x7] = 0;
-        break;
-      case SDL_SCANCODE_S:
-        chip8->keypad[0x8] = 0;
-        break;
-      case SDL_SCANCODE_D:
-        chip8->keypad[0x9] = 0;
-        break;
-      case SDL_SCANCODE_F:
-        chip8->keypad[0xE] = 0;
-        break;
-      case SDL_SCANCODE_Z:
-        chip8->keypad[0xA] = 0;
-        break;
-      case SDL_SCANCODE_X:
-        chip8->keypad[0x0] = 0;
-        break;
-      case SDL_SCANCODE_C:
-        chip8->keypad[0xB] = 0;
-        break;
-      case SDL_SCANCODE_V:
-        chip8->keypad[0xF] = 0;
-        break;
-      default:
-        break;
-      }
-      break;
-    default:
-      break;
-    }
-  }
-}
+    }
+  }
+}
 
 /**
- * @brief draws pixels from the display buffer to the screen
+ * @brief draws the newest display the emulation thread finished to the screen
+ *
+ * the rows that differ from the last upload are expanded to colors in a streaming
+ * texture at the native 64x32 resolution, which a single `SDL_RenderCopy` then
+ * scales to the window. nothing is uploaded unless a row changed since the last
+ * call, and nothing is presented either unless presenting is what waits for the
+ * display's refresh (`--vsync`)
  *
  * @param emulator pointer to emulator struct
- * @param chip8 pointer to chip8 struct
  */
-static void draw_display(chip8_t *chip8, emulator_t *emulator)
+static void draw_display(emulator_t *emulator)
 {
-  // bg color
-  SDL_SetRenderDrawColor(emulator->renderer, emulator->bg_color.r, emulator->bg_color.g, emulator->bg_color.b, emulator->bg_color.a);
-  SDL_RenderClear(emulator->renderer);
+  uint32_t dirty_rows = emulator->redraw ? ALL_ROWS_DIRTY : 0;
+  const uint64_t *display = take_frame(&emulator->emulation.frames);
 
-  // fg color
-  SDL_SetRenderDrawColor(emulator->renderer, emulator->fg_color.r, emulator->fg_color.g, emulator->fg_color.b, emulator->fg_color.a);
+  emulator->redraw = false;
+  for (int row = 0; display != NULL && row < DISPLAY_HEIGHT; ++row)
+  {
+    if (display[row] != emulator->shown[row])
+    {
+      emulator->shown[row] = display[row];
+      dirty_rows |= 1u << row;
+    }
+  }
 
-  for (int row = 0; row < DISPLAY_HEIGHT; ++row)
+  if (dirty_rows == 0 && !emulator->vsync)
   {
-    for (int col = 0; col < DISPLAY_WIDTH; ++col)
+    return;
+  }
+
+  if (dirty_rows != 0)
+  {
+    // only the span from the first to the last dirty row is uploaded
+    int first_row = 0;
+    int last_row = DISPLAY_HEIGHT - 1;
+    while (!(dirty_rows & (1u << first_row)))
     {
+      first_row++;
+    }
+    while (!(dirty_rows & (1u << last_row)))
+    {
+      last_row--;
+    }
 
-      if (chip8->display[row * DISPLAY_WIDTH + col])
+    SDL_Rect dirty_rect = {
+        .x = 0,
+        .y = first_row,
+        .w = DISPLAY_WIDTH,
+        .h = last_row - first_row + 1,
+    };
+
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(emulator->texture, &dirty_rect, &pixels, &pitch) != 0)
+    {
+      LOG_ERROR("SDL_LockTexture failed: %s", SDL_GetError());
+      return;
+    }
+
+    const uint32_t bg = color_to_argb(emulator->bg_color);
+    const uint32_t fg = color_to_argb(emulator->fg_color);
+
+    for (int row = first_row; row <= last_row; ++row)
+    {
+      uint32_t *texture_row = (uint32_t *)((uint8_t *)pixels + (row - first_row) * pitch);
+      uint64_t display_row = emulator->shown[row];
+
+      for (int col = 0; col < DISPLAY_WIDTH; ++col)
       {
-        SDL_Rect rect = {
-            .x = col * g_config.window_scale,
-            .y = row * g_config.window_scale,
-            .w = g_config.window_scale,
-            .h = g_config.window_scale,
-        };
-        SDL_RenderFillRect(emulator->renderer, &rect);
+        texture_row[col] = (display_row >> (DISPLAY_WIDTH - 1 - col)) & 1 ? fg : bg;
       }
     }
+
+    SDL_UnlockTexture(emulator->texture);
   }
+
+  // bg color, for the letterbox bars around the display
+  SDL_SetRenderDrawColor(emulator->renderer, emulator->bg_color.r, emulator->bg_color.g, emulator->bg_color.b, emulator->bg_color.a);
+  SDL_RenderClear(emulator->renderer);
+  SDL_RenderCopy(emulator->renderer, emulator->texture, NULL, NULL);
   SDL_RenderPresent(emulator->renderer);
 }
 
 /**
  * @brief audio callback function to generate square wave
  *
- * @param userdata unused
+ * runs on SDL's audio thread. every SAMPLES_PER_FRAME samples it takes the
+ * next frame's buzzer state from the queue, so the sound starts and stops on
+ * the exact sample that frame begins, however large the device buffer is. if
+ * the emulation thread falls behind, the last state is held; if it gets ahead, the
+ * oldest states are skipped so the delay stays under half the queue
+ *
+ * @param userdata pointer to audio struct
  * @param stream buffer to write audio data to
  * @param len length of the stream buffer in bytes
  */
 void audio_callback(void *userdata, uint8_t *stream, int len)
 {
-  // waves are represented in computers by a series of numbers called samples
-  static double phase = 0.0; // Φ -- is the position of a point in time on a waveform cycle
+  audio_t *audio = userdata;
   int16_t *buffer = (int16_t *)stream;
   int length = len / 2; // 2 bytes per sample
 
-  // fₛ is the sample rate
-  // f is number of cycles/s
-  // time taken for one sample = Δt = 1 / fₛ
-  // ΔΦ = f * Δt = f / fₛ
+  // waves are represented in computers by a series of numbers called samples.
+  // Φ, the phase, is the position of a point in time on a waveform cycle. with a
+  // cycle mapped onto the full range of a uint32_t, ΔΦ = f / fₛ * 2^32 per sample
+  // and the phase wraps around on its own at the end of every cycle
+  const uint32_t delta_phase = (uint32_t)(((uint64_t)FREQUENCY << 32) / SAMPLE_RATE);
+
+  int i = 0;
+  while (i < length)
+  {
+    if (audio->frame_samples_left == 0)
+    {
+      uint32_t tail = atomic_load_explicit(&audio->tail, memory_order_relaxed);
+      uint32_t head = atomic_load_explicit(&audio->head, memory_order_acquire);
+
+      if (head - tail > BUZZER_QUEUE_SIZE / 2)
+      {
+        tail = head - BUZZER_QUEUE_SIZE / 2;
+      }
+      if (head != tail)
+      {
+        bool buzzing = audio->queue[tail & (BUZZER_QUEUE_SIZE - 1)];
+        atomic_store_explicit(&audio->tail, tail + 1, memory_order_release);
+        if (buzzing && !audio->buzzing)
+        {
+          audio->phase = 0; // every beep starts on the same edge
+        }
+        audio->buzzing = buzzing;
+      }
+      audio->frame_samples_left = SAMPLES_PER_FRAME;
+    }
+
+    int run = length - i < (int)audio->frame_samples_left ? length - i : (int)audio->frame_samples_left;
+    audio->frame_samples_left -= run;
+
+    if (!audio->buzzing)
+    {
+      memset(&buffer[i], 0, run * sizeof(int16_t));
+      i += run;
+      continue;
+    }
+
+    for (int end = i + run; i < end; ++i)
+    {
+      // square wave, high for the first half of the cycle and low for the second
+      buffer[i] = audio->phase < 0x80000000u ? AMPLITUDE : -AMPLITUDE;
+      audio->phase += delta_phase;
+    }
+  }
+}
+
+/**
+ * @brief hands the buzzer state of the frame just run to the audio thread
+ *
+ * lock free: the emulation thread only writes `head` and the queue slot past it,
+ * the audio thread only writes `tail`. a state that finds the queue full is
+ * dropped, the audio thread holds the last one it took instead
+ *
+ * @param audio pointer to audio struct
+ * @param buzzing whether the buzzer sounds during the frame
+ */
+static void push_buzzer(audio_t *audio, bool buzzing)
+{
+  uint32_t head = atomic_load_explicit(&audio->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&audio->tail, memory_order_acquire);
+
+  if (head - tail == BUZZER_QUEUE_SIZE)
+  {
+    return;
+  }
+
+  audio->queue[head & (BUZZER_QUEUE_SIZE - 1)] = buzzing;
+  atomic_store_explicit(&audio->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief hands a finished display to the render thread
+ *
+ * lock free triple buffering: the display is copied into the back frame, which
+ * is then swapped with the one between the threads. the emulation thread never
+ * waits for the render thread, and a frame the render thread didn't get to is
+ * simply replaced by the newer one
+ *
+ * @param frames pointer to frame buffer struct
+ * @param display the display, one word per row
+ */
+static void publish_frame(frame_buffer_t *frames, const uint64_t *display)
+{
+  memcpy(frames->frames[frames->back], display, sizeof(frames->frames[0]));
+
+  uint32_t previous = atomic_exchange_explicit(&frames->shared, frames->back | FRAME_FRESH, memory_order_acq_rel);
+  frames->back = previous & ~FRAME_FRESH;
+}
+
+/**
+ * @brief takes the newest display the emulation thread finished
+ *
+ * @param frames pointer to frame buffer struct
+ * @return the display, which stays valid until the next call, or `NULL` if none was finished since the last call
+ */
+static const uint64_t *take_frame(frame_buffer_t *frames)
+{
+  if (!(atomic_load_explicit(&frames->shared, memory_order_relaxed) & FRAME_FRESH))
+  {
+    return NULL;
+  }
+
+  uint32_t previous = atomic_exchange_explicit(&frames->shared, frames->front, memory_order_acq_rel);
+  frames->front = previous & ~FRAME_FRESH;
+  return frames->frames[frames->front];
+}
+
+/**
+ * @brief queues a key change for the emulation thread and wakes it
+ *
+ * lock free, the same way as the buzzer queue. a change that finds the queue
+ * full is dropped, which only happens if the emulation thread has stalled for
+ * hundreds of key presses
+ *
+ * @param emulation pointer to emulation struct
+ * @param type what changed
+ * @param key keypad key, for INPUT_KEY
+ * @param down whether the key went down or up
+ */
+static void push_input(emulation_t *emulation, input_type_t type, uint8_t key, bool down)
+{
+  input_queue_t *input = &emulation->input;
+  uint32_t head = atomic_load_explicit(&input->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&input->tail, memory_order_acquire);
+
+  if (head - tail == INPUT_QUEUE_SIZE)
+  {
+    return;
+  }
 
-  double delta_phase = (double)FREQUENCY / SAMPLE_RATE;
+  input->queue[head & (INPUT_QUEUE_SIZE - 1)] = (input_t){.type = (uint8_t)type, .key = key, .down = down};
+  atomic_store_explicit(&input->head, head + 1, memory_order_release);
+  SDL_SemPost(emulation->wake);
+}
+
+/**
+ * @brief applies the key changes queued since the last call, in order
+ *
+ * @param emulation pointer to emulation struct
+ */
+static void take_input(emulation_t *emulation)
+{
+  input_queue_t *input = &emulation->input;
+  chip8_t *chip8 = emulation->chip8;
+  uint32_t tail = atomic_load_explicit(&input->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&input->head, memory_order_acquire);
 
-  for (int i = 0; i < length; ++i)
+  for (; tail != head; ++tail)
   {
-    // square wave
-    buffer[i] = (sin(phase * 2.0 * M_PI) > 0 ? 1 : -1) * AMPLITUDE; // makes a square wave -- only alters between 2 values, 1 and -1
-    phase += delta_phase;
-    if (phase >= 1.0)
+    const input_t *change = &input->queue[tail & (INPUT_QUEUE_SIZE - 1)];
+
+    switch (change->type)
     {
-      phase -= 1.0; // one cycle over, reset to beginning of next cycle
+    case INPUT_KEY:
+      if (chip8->keypad[change->key] != change->down)
+      {
+        chip8->keypad[change->key] = change->down;
+        if (emulation->recorder != NULL)
+        {
+          movie_record_key(emulation->recorder, emulation->instructions, change->key, change->down);
+        }
+      }
+      break;
+    case INPUT_REWIND:
+      emulation->rewinding = change->down && emulation->history != NULL;
+      break;
+    case INPUT_TURBO:
+      if (emulation->turbo && !change->down)
+      {
+        pacer_start(&emulation->pacer); // back to 60Hz from now, rather than catching up with the clock
+      }
+      emulation->turbo = change->down;
+      break;
     }
   }
+
+  atomic_store_explicit(&input->tail, tail, memory_order_release);
+}
+
+/**
+ * @brief runs the cpu until the render thread clears `running`
+ *
+ * the emulation thread owns the chip8 while it runs. it runs a frame whenever
+ * one is due on its own 60Hz clock, or back to back while turbo is held, and
+ * hands each changed display to the render thread, so a slow present or a
+ * vsync wait never holds up the cpu or the timers. while the ROM waits on
+ * `Fx0A` with the timers run out, it sleeps until a key is pressed
+ *
+ * @param data pointer to emulation struct
+ * @return `0`
+ */
+static int emulation_thread(void *data)
+{
+  emulation_t *emulation = data;
+  chip8_t *chip8 = emulation->chip8;
+
+  pacer_start(&emulation->pacer);
+
+  while (atomic_load_explicit(&emulation->running, memory_order_acquire))
+  {
+    take_input(emulation);
+
+    const bool turbo = emulation->turbo && !emulation->rewinding;
+    for (uint32_t due = turbo ? 1 : pacer_frames_due(&emulation->pacer); due > 0; --due)
+    {
+      if (emulation->rewinding)
+      {
+        rewind_step_back(emulation->history, chip8); // one frame back per frame held, stays put at the oldest
+      }
+      else
+      {
+        emulation->instructions += chip8_run_frame(chip8);
+        if (emulation->history != NULL)
+        {
+          rewind_capture(emulation->history, chip8);
+        }
+      }
+      push_buzzer(emulation->audio, chip8->sound_timer > 0 && !emulation->rewinding);
+    }
+
+    if (chip8->dirty_rows != 0)
+    {
+      publish_frame(&emulation->frames, chip8->display);
+      chip8->dirty_rows = 0;
+    }
+
+    if (chip8_waiting_for_key(chip8) && !emulation->rewinding)
+    {
+      // frames would change nothing until a key goes down, so sleep until input arrives rather than running them
+      SDL_SemWait(emulation->wake);
+      pacer_start(&emulation->pacer);
+    }
+    else if (!turbo)
+    {
+      pacer_wait(&emulation->pacer, emulation->wake);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief starts the frame clock, with frame 0 due now
+ *
+ * @param pacer pointer to pacer struct
+ */
+static void pacer_start(pacer_t *pacer)
+{
+  pacer->frequency = SDL_GetPerformanceFrequency();
+  pacer->start = SDL_GetPerformanceCounter();
+  pacer->frame = 0;
+}
+
+/**
+ * @brief works out when the next frame is due
+ *
+ * every deadline is computed from the start rather than added to the previous
+ * one, so the fraction of a tick in 1/60 s is never rounded away and the clock
+ * doesn't drift
+ *
+ * @param pacer pointer to pacer struct
+ * @return performance counter value the next frame is due at
+ */
+static uint64_t pacer_deadline(const pacer_t *pacer)
+{
+  return pacer->start + pacer->frame * pacer->frequency / FRAME_RATE;
+}
+
+/**
+ * @brief counts the frames whose deadline has passed and moves the clock past them
+ *
+ * @param pacer pointer to pacer struct
+ * @return number of frames to run now, usually 0 or 1
+ */
+static uint32_t pacer_frames_due(pacer_t *pacer)
+{
+  const uint64_t now = SDL_GetPerformanceCounter();
+  uint32_t due = 0;
+
+  while (pacer_deadline(pacer) <= now)
+  {
+    pacer->frame++;
+    if (++due > MAX_FRAMES_BEHIND)
+    {
+      // too far behind to catch up without a burst of speed, start the clock again from now
+      pacer->start = now;
+      pacer->frame = 1;
+      return MAX_FRAMES_BEHIND;
+    }
+  }
+  return due;
+}
+
+/**
+ * @brief sleeps until the next frame is due, or until input arrives
+ *
+ * the wait is rounded up to whole milliseconds, so the process is asleep
+ * rather than spinning and a frame runs at most a millisecond late. being late
+ * doesn't add up, since deadlines don't depend on when frames actually ran
+ *
+ * @param pacer pointer to pacer struct
+ * @param wake semaphore that cuts the wait short when posted, `NULL` to wait for SDL events instead
+ */
+static void pacer_wait(const pacer_t *pacer, SDL_sem *wake)
+{
+  const uint64_t now = SDL_GetPerformanceCounter();
+  const uint64_t deadline = pacer_deadline(pacer);
+
+  if (now >= deadline)
+  {
+    return;
+  }
+
+  const uint64_t ms = ((deadline - now) * 1000 + pacer->frequency - 1) / pacer->frequency;
+  if (wake != NULL)
+  {
+    SDL_SemWaitTimeout(wake, (Uint32)ms); // returns early when input is queued, so keys aren't delayed
+  }
+  else
+  {
+    SDL_WaitEventTimeout(NULL, (int)ms); // returns early when an event arrives
+  }
+}
+
+/**
+ * @brief runs the emulator without a window, renderer or audio, as fast as the host allows
+ *
+ * frames are scheduled exactly as they are on screen, only without waiting for
+ * the next 60Hz deadline, so ROMs that wait on the delay timer behave the same.
+ * the instructions skipped in idle loops are counted apart from the ones
+ * executed, so the instructions per second measure the emulator, not the ROM
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param movie keypad changes to feed in, each on exactly the instruction it was recorded at, `NULL` for none
+ */
+static void run_headless(chip8_t *chip8, const movie_t *movie)
+{
+  uint64_t cycles = 0;
+  uint64_t frames = 0;
+  size_t next_event = 0;
+  const uint64_t skipped_before = chip8->idle_skipped;
+
+  const uint64_t start = SDL_GetPerformanceCounter();
+
+  while ((g_config.max_cycles == 0 || cycles < g_config.max_cycles) &&
+         (g_config.max_frames == 0 || frames < g_config.max_frames))
+  {
+    while (movie != NULL && next_event < movie->length && movie->events[next_event].instruction <= cycles)
+    {
+      const movie_event_t *event = &movie->events[next_event++];
+      chip8->keypad[event->key] = event->down;
+    }
+
+    // run up to the next timer tick, stopping early at the next key change or the instruction limit
+    uint64_t stop = cycles + chip8_cycles_to_tick(chip8);
+    if (g_config.max_cycles != 0 && stop > g_config.max_cycles)
+    {
+      stop = g_config.max_cycles;
+    }
+    if (movie != NULL && next_event < movie->length && stop > movie->events[next_event].instruction)
+    {
+      stop = movie->events[next_event].instruction;
+    }
+
+    frames += chip8_run_timed(chip8, stop - cycles);
+    cycles = stop;
+  }
+
+  const uint64_t end = SDL_GetPerformanceCounter();
+  const double seconds = (double)(end - start) / (double)SDL_GetPerformanceFrequency();
+
+  const uint64_t skipped = chip8->idle_skipped - skipped_before;
+  const uint64_t executed = cycles - skipped;
+
+  fprintf(stdout, "Ran %" PRIu64 " instructions (%" PRIu64 " frames) in %.3f s\n", cycles, frames, seconds);
+  fprintf(stdout, "%" PRIu64 " executed, %" PRIu64 " skipped in idle loops\n", executed, skipped);
+  fprintf(stdout, "%.0f instructions executed per second\n", seconds > 0 ? (double)executed / seconds : 0.0);
+
+  if (movie != NULL)
+  {
+    fprintf(stdout, "Display hash %016" PRIX64 ", PC %03X\n", display_hash(chip8), chip8->pc);
+  }
+}
+
+/**
+ * @brief FNV-1a hash of the display, the same one `chip8_batch` prints
+ *
+ * @param chip8 pointer to chip8 struct
+ * @return the hash
+ */
+static uint64_t display_hash(const chip8_t *chip8)
+{
+  uint64_t hash = 14695981039346656037u;
+
+  for (int row = 0; row < DISPLAY_HEIGHT; ++row)
+  {
+    for (int byte = 0; byte < 8; ++byte)
+    {
+      hash = (hash ^ (uint8_t)(chip8->display[row] >> (8 * byte))) * 1099511628211u;
+    }
+  }
+  return hash;
+}
+
+/**
+ * @brief writes the instruction trace to `trace_path` and frees it, if tracing
+ *
+ * @param chip8 pointer to chip8 struct
+ */
+static void save_trace(chip8_t *chip8)
+{
+  if (chip8->trace == NULL)
+  {
+    return;
+  }
+
+  if (trace_save(chip8->trace, g_config.trace_path) == 0)
+  {
+    LOG_OK("Trace written to %s", g_config.trace_path);
+  }
+
+  trace_destroy(chip8->trace);
+  chip8->trace = NULL;
+}
+
+/**
+ * @brief prints the profile, writes it to `profile_path` and frees it, if profiling
+ *
+ * @param chip8 pointer to chip8 struct
+ */
+static void report_profile(chip8_t *chip8)
+{
+  if (chip8->profile == NULL)
+  {
+    return;
+  }
+
+  if (chip8_profile_report(chip8, g_config.profile_path) == 0)
+  {
+    LOG_OK("Profile written to %s", g_config.profile_path);
+  }
+
+  chip8_profile_disable(chip8);
 }
 
 /* ---------------------------------- main ---------------------------------- */
@@ -465,76 +1309,216 @@ int main(int argc, char **argv)
   LOG_INFO("ROM path: %s", rom_path);
   LOG_INFO("Window scale: %d", g_config.window_scale);
 
+  if (g_config.record_path != NULL && g_config.replay_path != NULL)
+  {
+    fprintf(stderr, "--record and --replay can't be combined\n");
+    print_usage(stderr, program);
+    exit(EXIT_FAILURE);
+  }
+
+  if (g_config.record_path != NULL && g_config.headless)
+  {
+    fprintf(stderr, "--record needs the window, a headless run has no keys to record\n");
+    print_usage(stderr, program);
+    exit(EXIT_FAILURE);
+  }
+
+  if (g_config.headless && g_config.replay_path == NULL && g_config.max_cycles == 0 && g_config.max_frames == 0)
+  {
+    fprintf(stderr, "Headless mode needs --cycles or --frames\n");
+    print_usage(stderr, program);
+    exit(EXIT_FAILURE);
+  }
+
+  const chip8_config_t chip8_config = {
+      .verbose_logging = g_config.verbose_logging,
+      .cpu_hz = (uint32_t)g_config.cpu_hz,
+  };
+
   chip8_t chip8;
-  chip8_initialise(&chip8);
-  if (chip8_load_rom(&chip8, rom_path) != 0)
+  if (chip8_initialise(&chip8, &chip8_config) != 0 || chip8_load_rom(&chip8, rom_path) != 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  movie_t *movie = NULL;
+  if (g_config.replay_path != NULL)
+  {
+    if ((movie = movie_load(g_config.replay_path)) == NULL)
+    {
+      exit(EXIT_FAILURE);
+    }
+    if (movie->image_hash != chip8.image_hash)
+    {
+      LOG_ERROR("%s was recorded with a different ROM", g_config.replay_path);
+      exit(EXIT_FAILURE);
+    }
+    if (movie->cpu_hz == 0)
+    {
+      LOG_ERROR("%s is corrupt, it was recorded at 0Hz", g_config.replay_path);
+      exit(EXIT_FAILURE);
+    }
+
+    // the movie only plays back the same way at the seed and speed it was made at
+    g_config.seeded = true;
+    g_config.seed = movie->seed;
+    g_config.cpu_hz = (int)movie->cpu_hz;
+    chip8.config.cpu_hz = movie->cpu_hz;
+    if (g_config.max_cycles == 0 && g_config.max_frames == 0)
+    {
+      if (movie->instructions == 0)
+      {
+        LOG_ERROR("%s ends before the first instruction", g_config.replay_path);
+        exit(EXIT_FAILURE);
+      }
+      g_config.max_cycles = movie->instructions;
+    }
+  }
+
+  if (g_config.record_path != NULL && !g_config.seeded)
+  {
+    g_config.seeded = true; // a seed the movie can store
+    g_config.seed = (uint32_t)time(NULL);
+  }
+
+  if (g_config.seeded)
+  {
+    chip8_seed(&chip8, g_config.seed);
+  }
+
+  if (g_config.jit && chip8_jit_enable(&chip8) != 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  if (g_config.trace_path != NULL && (chip8.trace = trace_create()) == NULL)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  if (g_config.profile_timed && g_config.profile_path == NULL)
+  {
+    fprintf(stderr, "--profile-time needs --profile\n");
+    print_usage(stderr, program);
+    exit(EXIT_FAILURE);
+  }
+
+  if (g_config.profile_path != NULL && chip8_profile_enable(&chip8, g_config.profile_timed) != 0)
   {
     exit(EXIT_FAILURE);
   }
 
+  if (g_config.headless)
+  {
+    run_headless(&chip8, movie);
+    movie_destroy(movie);
+    save_trace(&chip8);
+    report_profile(&chip8);
+    chip8_release(&chip8);
+    return EXIT_SUCCESS;
+  }
+
   emulator_t emulator = {
       .window = NULL,
       .renderer = NULL,
+      .texture = NULL,
       .audio_device = 0,
+      .audio = {0},
+      .vsync = false,
       .bg_color = g_config.bg_color,
       .fg_color = g_config.fg_color,
+      .shown = {0},
+      .redraw = true, // the texture starts out undefined
+      .emulation = {0},
   };
 
+  emulation_t *emulation = &emulator.emulation;
+  emulation->chip8 = &chip8;
+  emulation->audio = &emulator.audio;
+  emulation->frames.back = 0;
+  emulation->frames.shared = 1;
+  emulation->frames.front = 2;
+
   if (initialise_sdl(&emulator) != 0)
   {
     cleanup_sdl(&emulator, EXIT_FAILURE);
   }
 
-  bool running = true;
-  uint32_t last_cycle_time = 0;
-  uint32_t last_timer_time = 0;
+  // stepping back would take the run away from the recorded key changes, so recording turns rewinding off
+  if (g_config.rewind_budget != 0 && g_config.record_path == NULL &&
+      (emulation->history = rewind_create(g_config.rewind_budget)) == NULL)
+  {
+    cleanup_sdl(&emulator, EXIT_FAILURE);
+  }
+
+  if (g_config.record_path != NULL &&
+      (emulation->recorder = movie_record_open(g_config.record_path, g_config.seed, chip8.config.cpu_hz, chip8.image_hash)) == NULL)
+  {
+    cleanup_sdl(&emulator, EXIT_FAILURE);
+  }
+
+  if ((emulation->wake = SDL_CreateSemaphore(0)) == NULL)
+  {
+    LOG_ERROR("SDL_CreateSemaphore failed: %s", SDL_GetError());
+    cleanup_sdl(&emulator, EXIT_FAILURE);
+  }
 
   /*
-    to ensure the timers decrement at a stable 60Hz rate, we
-    cannot simply decrement them on every loop iteration
+    the cpu, the timers and the screen are all driven by 60Hz frame clocks
 
-    instead a time-based approach is required. we measure the
-    real time that has passed since the last timer update. if
-    that elapsed time exceeds the target period for 60Hz (1000ms / 60 ≈ 16.667ms),
-    we decrement the timers and record the current time as the
-    new starting point for the next interval.
+    the emulation thread (see emulation_thread) owns the chip8. once a frame's
+    deadline passes, chip8_run_frame executes a whole batch of instructions and
+    decrements the timers once. the batch size comes from `cpu_hz`, so the cpu
+    speed can be set to any rate independent of the frame rate, and the core
+    counts when the timers are due itself, so a movie or headless run ticks them
+    on the same instructions as a window does
 
     this seperates the timer speed from the cpu's processing speed,
     ensuring consistent behavior on all machines.
+
+    this thread, the render thread, polls SDL's events, queues key changes for
+    the emulation thread and draws the newest display it finished, once per
+    frame. presenting, and with --vsync waiting for the display's refresh, only
+    ever holds up this thread. both threads sleep until their next deadline (see
+    pacer_wait), so an idle emulator costs next to no cpu time
   */
 
+  atomic_store(&emulation->running, true);
+  SDL_Thread *thread = SDL_CreateThread(emulation_thread, "emulation", emulation);
+  if (thread == NULL)
+  {
+    LOG_ERROR("SDL_CreateThread failed: %s", SDL_GetError());
+    cleanup_sdl(&emulator, EXIT_FAILURE);
+  }
+
+  bool running = true;
+  pacer_t pacer;
+  pacer_start(&pacer);
+
   while (running)
   {
-    handle_input(&chip8, &running);
+    handle_input(&emulator, &running);
+    pacer_frames_due(&pacer);
+    draw_display(&emulator);
 
-    uint32_t current_time = SDL_GetTicks();
-    if (current_time - last_cycle_time > g_config.cycle_delay)
+    if (!emulator.vsync)
     {
-      last_cycle_time = current_time;
-      chip8_cycle(&chip8);
-      draw_display(&chip8, &emulator);
-    }
-
-    if (current_time - last_timer_time > (1000 / 60))
-    {
-      last_timer_time = current_time;
-      if (chip8.delay_timer > 0)
-      {
-        chip8.delay_timer--;
-      }
-      if (chip8.sound_timer > 0)
-      {
-        SDL_PauseAudioDevice(emulator.audio_device, 0); // play sound
-        chip8.sound_timer--;
-      }
-      else
-      {
-        SDL_PauseAudioDevice(emulator.audio_device, 1); // pause sound
-      }
+      pacer_wait(&pacer, NULL);
     }
   }
 
+  atomic_store_explicit(&emulation->running, false, memory_order_release);
+  SDL_SemPost(emulation->wake);
+  SDL_WaitThread(thread, NULL);
+
   // cleanup
+  if (emulation->recorder != NULL && movie_record_close(emulation->recorder, emulation->instructions) == 0)
+  {
+    LOG_OK("Movie written to %s", g_config.record_path);
+  }
+  save_trace(&chip8);
+  report_profile(&chip8);
+  chip8_release(&chip8);
   cleanup_sdl(&emulator, EXIT_SUCCESS);
 
   return 0;
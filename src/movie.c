@@ -0,0 +1,233 @@
+#include "movie.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MOVIE_HEADER_SIZE 17 // magic, version, then seed, cpu speed and image hash as little endian uint32_ts
+
+/* --------------------------- function prototypes -------------------------- */
+
+static void put_u32(uint8_t *out, uint32_t value);
+static uint32_t get_u32(const uint8_t *in);
+static void write_record(movie_recorder_t *recorder, uint64_t instruction, uint8_t key_byte);
+static int read_varint(FILE *file, uint64_t *value);
+
+/* ---------------------------- helper functions ---------------------------- */
+
+/**
+ * @brief stores a value as 4 little endian bytes
+ *
+ * @param out where the bytes go
+ * @param value the value
+ */
+static void put_u32(uint8_t *out, uint32_t value)
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+/**
+ * @brief reads 4 little endian bytes
+ *
+ * @param in the bytes
+ * @return the value
+ */
+static uint32_t get_u32(const uint8_t *in)
+{
+  return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+/**
+ * @brief appends one record, the instructions since the previous one then the key byte
+ *
+ * @param recorder pointer to movie recorder struct
+ * @param instruction instructions executed before the record
+ * @param key_byte the key and direction, or MOVIE_END
+ */
+static void write_record(movie_recorder_t *recorder, uint64_t instruction, uint8_t key_byte)
+{
+  uint8_t record[11]; // a 64 bit varint takes at most 10 bytes
+  size_t length = 0;
+  uint64_t delta = instruction - recorder->last;
+
+  do
+  {
+    record[length++] = (uint8_t)(delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+    delta >>= 7;
+  } while (delta != 0);
+  record[length++] = key_byte;
+
+  fwrite(record, 1, length, recorder->file);
+  recorder->last = instruction;
+}
+
+/**
+ * @brief reads a LEB128 varint
+ *
+ * @param file the movie
+ * @param value where the value goes
+ * @return `0` on success, `1` at the end of the file or on a malformed varint
+ */
+static int read_varint(FILE *file, uint64_t *value)
+{
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    int byte = fgetc(file);
+    if (byte == EOF)
+    {
+      return 1;
+    }
+
+    *value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* ---------------------------- public functions ---------------------------- */
+
+movie_recorder_t *movie_record_open(const char *path, uint32_t seed, uint32_t cpu_hz, uint32_t image_hash)
+{
+  movie_recorder_t *recorder = calloc(1, sizeof(movie_recorder_t));
+
+  if (recorder == NULL)
+  {
+    LOG_ERROR("Could not allocate the movie recorder");
+    return NULL;
+  }
+
+  recorder->file = fopen(path, "wb");
+  if (recorder->file == NULL)
+  {
+    LOG_ERROR("Could not open %s for writing", path);
+    free(recorder);
+    return NULL;
+  }
+
+  uint8_t header[MOVIE_HEADER_SIZE];
+  memcpy(header, MOVIE_MAGIC, 4);
+  header[4] = MOVIE_VERSION;
+  put_u32(&header[5], seed);
+  put_u32(&header[9], cpu_hz);
+  put_u32(&header[13], image_hash);
+  fwrite(header, 1, sizeof(header), recorder->file);
+
+  return recorder;
+}
+
+void movie_record_key(movie_recorder_t *recorder, uint64_t instruction, uint8_t key, bool down)
+{
+  write_record(recorder, instruction, (uint8_t)(key & 0xF) | (down ? 0x10 : 0));
+}
+
+int movie_record_close(movie_recorder_t *recorder, uint64_t instructions)
+{
+  write_record(recorder, instructions, MOVIE_END);
+
+  bool failed = ferror(recorder->file) != 0;
+  failed |= fclose(recorder->file) != 0;
+  free(recorder);
+
+  if (failed)
+  {
+    LOG_ERROR("Could not write the movie");
+    return 1;
+  }
+  return 0;
+}
+
+movie_t *movie_load(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+
+  if (file == NULL)
+  {
+    LOG_ERROR("Could not open %s", path);
+    return NULL;
+  }
+
+  uint8_t header[MOVIE_HEADER_SIZE];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, MOVIE_MAGIC, 4) != 0 || header[4] != MOVIE_VERSION)
+  {
+    LOG_ERROR("%s is not a version %d movie file", path, MOVIE_VERSION);
+    fclose(file);
+    return NULL;
+  }
+
+  movie_t *movie = calloc(1, sizeof(movie_t));
+  if (movie == NULL)
+  {
+    LOG_ERROR("Could not allocate the movie");
+    fclose(file);
+    return NULL;
+  }
+
+  movie->seed = get_u32(&header[5]);
+  movie->cpu_hz = get_u32(&header[9]);
+  movie->image_hash = get_u32(&header[13]);
+
+  size_t capacity = 0;
+  uint64_t instruction = 0;
+
+  for (;;)
+  {
+    uint64_t delta;
+    int key_byte;
+    if (read_varint(file, &delta) != 0 || (key_byte = fgetc(file)) == EOF ||
+        (key_byte != MOVIE_END && key_byte > 0x1F) || delta > UINT64_MAX - instruction)
+    {
+      LOG_ERROR("%s is truncated or corrupt", path);
+      movie_destroy(movie);
+      fclose(file);
+      return NULL;
+    }
+
+    instruction += delta;
+    if (key_byte == MOVIE_END)
+    {
+      break;
+    }
+
+    if (movie->length == capacity)
+    {
+      capacity = capacity != 0 ? capacity * 2 : 256;
+      movie_event_t *events = realloc(movie->events, capacity * sizeof(movie_event_t));
+      if (events == NULL)
+      {
+        LOG_ERROR("Could not allocate %zu movie events", capacity);
+        movie_destroy(movie);
+        fclose(file);
+        return NULL;
+      }
+      movie->events = events;
+    }
+
+    movie->events[movie->length++] = (movie_event_t){
+        .instruction = instruction,
+        .key = (uint8_t)(key_byte & 0xF),
+        .down = (key_byte & 0x10) != 0,
+    };
+  }
+
+  fclose(file);
+  movie->instructions = instruction;
+  return movie;
+}
+
+void movie_destroy(movie_t *movie)
+{
+  if (movie == NULL)
+  {
+    return;
+  }
+
+  free(movie->events);
+  free(movie);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+  input movies. a movie holds what a run needs to be repeated exactly: the
+  seed of the random number generator, the cpu speed (which decides when the
+  timers tick) and every keypad change, keyed by how many instructions had
+  run when it happened. the file starts with a fixed header, followed by one
+  record per change: the instructions since the previous change as a LEB128
+  varint, then a byte with the key in the low nibble and bit 4 set when the
+  key went down. a record with the byte MOVIE_END gives the instruction count
+  the run ended at
+*/
+
+#define MOVIE_MAGIC "C8MV" // first 4 bytes of a movie file
+#define MOVIE_VERSION 1
+#define MOVIE_END 0xFF     // key byte of the last record
+
+typedef struct movie_event
+{
+  uint64_t instruction; // instructions executed before the change
+  uint8_t key;          // which key changed
+  bool down;            // `true` when it went down, `false` when it went up
+} movie_event_t;
+
+typedef struct movie
+{
+  uint32_t seed;          // what the run's generator was seeded with, see `chip8_seed`
+  uint32_t cpu_hz;        // instructions per second the run was made at
+  uint32_t image_hash;    // `chip8_t.image_hash` of the ROM it was made with
+  uint64_t instructions;  // instructions executed by the end of the run
+  movie_event_t *events;  // keypad changes in instruction order
+  size_t length;          // entries in `events`
+} movie_t;
+
+typedef struct movie_recorder
+{
+  FILE *file;
+  uint64_t last; // instruction count of the previous record
+} movie_recorder_t;
+
+/* --------------------------- function prototypes -------------------------- */
+
+/**
+ * @brief creates a movie file and writes its header
+ *
+ * @param path where the movie goes
+ * @param seed seed of the run being recorded
+ * @param cpu_hz cpu speed of the run being recorded
+ * @param image_hash `chip8_t.image_hash` of the ROM being run
+ * @return the new recorder, `NULL` on failure
+ */
+movie_recorder_t *movie_record_open(const char *path, uint32_t seed, uint32_t cpu_hz, uint32_t image_hash);
+
+/**
+ * @brief appends a keypad change
+ *
+ * @param recorder pointer to movie recorder struct
+ * @param instruction instructions executed before the change, never less than for the previous one
+ * @param key which key changed
+ * @param down `true` when it went down
+ */
+void movie_record_key(movie_recorder_t *recorder, uint64_t instruction, uint8_t key, bool down);
+
+/**
+ * @brief writes the end record, closes the file and frees the recorder
+ *
+ * @param recorder pointer to movie recorder struct
+ * @param instructions instructions executed by the end of the run
+ * @return `0` on success, `1` on failure
+ */
+int movie_record_close(movie_recorder_t *recorder, uint64_t instructions);
+
+/**
+ * @brief reads a whole movie file
+ *
+ * @param path path to the movie
+ * @return the movie, `NULL` on failure
+ */
+movie_t *movie_load(const char *path);
+
+/**
+ * @brief frees a movie
+ *
+ * @param movie pointer to movie struct
+ */
+void movie_destroy(movie_t *movie);
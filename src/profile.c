@@ -0,0 +1,184 @@
+#include "profile.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
+
+#define PROFILE_TOP_PCS 20 // addresses listed in the text report, the JSON report has all of them
+
+typedef struct profile_row
+{
+  int key;        // opcode id or address
+  uint64_t count; // executions
+} profile_row_t;
+
+/* --------------------------- function prototypes -------------------------- */
+
+static int compare_rows(const void *a, const void *b);
+static int collect_rows(const uint64_t *counts, int length, profile_row_t *rows);
+static int write_json(const profile_t *profile, const char *const *op_names, const profile_row_t *ops, int ops_length,
+                      const profile_row_t *pcs, int pcs_length, const uint8_t *memory, const char *json_path);
+
+/* ---------------------------- helper functions ---------------------------- */
+
+/**
+ * @brief orders rows by descending count, then ascending key
+ */
+static int compare_rows(const void *a, const void *b)
+{
+  const profile_row_t *row_a = a;
+  const profile_row_t *row_b = b;
+
+  if (row_a->count != row_b->count)
+  {
+    return row_a->count < row_b->count ? 1 : -1;
+  }
+  return row_a->key - row_b->key;
+}
+
+/**
+ * @brief gathers the non-zero counters and sorts them
+ *
+ * @param counts counters, indexed by key
+ * @param length number of counters
+ * @param rows filled with one row per non-zero counter, needs room for `length`
+ * @return number of rows
+ */
+static int collect_rows(const uint64_t *counts, int length, profile_row_t *rows)
+{
+  int rows_length = 0;
+
+  for (int key = 0; key < length; ++key)
+  {
+    if (counts[key] != 0)
+    {
+      rows[rows_length++] = (profile_row_t){.key = key, .count = counts[key]};
+    }
+  }
+
+  qsort(rows, rows_length, sizeof(profile_row_t), compare_rows);
+  return rows_length;
+}
+
+/**
+ * @brief writes the sorted counters as JSON
+ *
+ * @return `0` on success, `1` on failure
+ */
+static int write_json(const profile_t *profile, const char *const *op_names, const profile_row_t *ops, int ops_length,
+                      const profile_row_t *pcs, int pcs_length, const uint8_t *memory, const char *json_path)
+{
+  FILE *json = fopen(json_path, "w");
+
+  if (json == NULL)
+  {
+    LOG_ERROR("Could not open %s for writing", json_path);
+    return 1;
+  }
+
+  fprintf(json, "{\n  \"instructions\": %" PRIu64 ",\n  \"timed\": %s,\n  \"ops\": [", profile->instructions,
+          profile->timed ? "true" : "false");
+  for (int i = 0; i < ops_length; ++i)
+  {
+    fprintf(json, "%s\n    {\"op\": \"%s\", \"count\": %" PRIu64, i == 0 ? "" : ",", op_names[ops[i].key], ops[i].count);
+    if (profile->timed)
+    {
+      fprintf(json, ", \"ns\": %" PRIu64, profile->op_ns[ops[i].key]);
+    }
+    fprintf(json, "}");
+  }
+
+  fprintf(json, "\n  ],\n  \"pcs\": [");
+  for (int i = 0; i < pcs_length; ++i)
+  {
+    uint16_t pc = pcs[i].key;
+    fprintf(json, "%s\n    {\"pc\": %d, \"opcode\": %d, \"count\": %" PRIu64 "}", i == 0 ? "" : ",", pc,
+            memory[pc] << 8 | memory[(pc + 1) & (MEMORY_SIZE - 1)], pcs[i].count);
+  }
+  fprintf(json, "\n  ]\n}\n");
+
+  bool failed = ferror(json) != 0;
+  if (fclose(json) != 0 || failed)
+  {
+    LOG_ERROR("Could not write %s", json_path);
+    return 1;
+  }
+  return 0;
+}
+
+/* ---------------------------- public functions ---------------------------- */
+
+profile_t *profile_create(bool timed)
+{
+  profile_t *profile = calloc(1, sizeof(profile_t));
+
+  if (profile == NULL)
+  {
+    LOG_ERROR("Could not allocate the profiler");
+    return NULL;
+  }
+
+  profile->timed = timed;
+  return profile;
+}
+
+void profile_destroy(profile_t *profile)
+{
+  free(profile);
+}
+
+uint64_t profile_now_ns(void)
+{
+  struct timespec now;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+  timespec_get(&now, TIME_UTC);
+#endif
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+int profile_report(const profile_t *profile, const char *const *op_names, int op_count, const uint8_t *memory,
+                   FILE *text, const char *json_path)
+{
+  profile_row_t ops[PROFILE_MAX_OPS];
+  static profile_row_t pcs[MEMORY_SIZE];
+
+  int ops_length = collect_rows(profile->op_count, op_count, ops);
+  int pcs_length = collect_rows(profile->pc_count, MEMORY_SIZE, pcs);
+  double total = profile->instructions != 0 ? (double)profile->instructions : 1.0;
+
+  fprintf(text, "Profile of %" PRIu64 " instructions\n\n", profile->instructions);
+
+  fprintf(text, "%-8s %14s %7s", "opcode", "count", "share");
+  if (profile->timed)
+  {
+    fprintf(text, " %12s %9s", "total ms", "ns/instr");
+  }
+  fprintf(text, "\n");
+
+  for (int i = 0; i < ops_length; ++i)
+  {
+    int id = ops[i].key;
+    fprintf(text, "%-8s %14" PRIu64 " %6.2f%%", op_names[id], ops[i].count, 100.0 * ops[i].count / total);
+    if (profile->timed)
+    {
+      fprintf(text, " %12.3f %9.1f", profile->op_ns[id] / 1e6, (double)profile->op_ns[id] / ops[i].count);
+    }
+    fprintf(text, "\n");
+  }
+
+  fprintf(text, "\n%-8s %-8s %14s %7s\n", "address", "opcode", "count", "share");
+  for (int i = 0; i < pcs_length && i < PROFILE_TOP_PCS; ++i)
+  {
+    uint16_t pc = pcs[i].key;
+    fprintf(text, "0x%03X    %04X     %14" PRIu64 " %6.2f%%\n", pc,
+            memory[pc] << 8 | memory[(pc + 1) & (MEMORY_SIZE - 1)], pcs[i].count, 100.0 * pcs[i].count / total);
+  }
+
+  if (json_path == NULL)
+  {
+    return 0;
+  }
+  return write_json(profile, op_names, ops, ops_length, pcs, pcs_length, memory, json_path);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+/*
+  execution profiler. only built when CHIP8_PROFILE is defined, the rest of the
+  core talks to it through chip8_profile_enable and chip8_run
+*/
+
+#define PROFILE_MAX_OPS 64 // room for every opcode id in cpu.c
+
+typedef struct profile
+{
+  bool timed;                        // also measure how long each handler takes
+  uint64_t instructions;             // instructions executed while profiling
+  uint64_t op_count[PROFILE_MAX_OPS]; // executions per opcode id
+  uint64_t op_ns[PROFILE_MAX_OPS];    // nanoseconds spent per opcode id, only when `timed`
+  uint64_t pc_count[MEMORY_SIZE];     // executions per address
+} profile_t;
+
+/* --------------------------- function prototypes -------------------------- */
+
+/**
+ * @brief allocates an empty profile
+ *
+ * @param timed whether handlers will be timed as well as counted
+ * @return the new profile, `NULL` on failure
+ */
+profile_t *profile_create(bool timed);
+
+/**
+ * @brief frees a profile
+ *
+ * @param profile pointer to profile struct
+ */
+void profile_destroy(profile_t *profile);
+
+/**
+ * @brief reads a monotonic clock for timing handlers
+ *
+ * @return the time in nanoseconds
+ */
+uint64_t profile_now_ns(void);
+
+/**
+ * @brief prints a report sorted by execution count, and optionally writes it as JSON
+ *
+ * @param profile pointer to profile struct
+ * @param op_names name of each opcode id, `NULL` for ids that are never executed
+ * @param op_count number of entries in `op_names`
+ * @param memory the memory the profile was taken from, to show the opcode at each address
+ * @param text where the text report goes, eg. `stdout`
+ * @param json_path path to the JSON report, `NULL` for none
+ * @return `0` on success, `1` on failure
+ */
+int profile_report(const profile_t *profile, const char *const *op_names, int op_count, const uint8_t *memory,
+                   FILE *text, const char *json_path);
@@ -0,0 +1,313 @@
+#include "rewind.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  a delta is a list of groups, each a uint16_t count of unchanged words to
+  skip, a uint16_t count of changed words, then those words XORed with the
+  previous frame. in the ring every delta is framed by its length in bytes as
+  a uint32_t on both sides, so it can be walked from either end
+*/
+
+#define DELTA_MAX_SIZE (REWIND_FRAME_WORDS * (2 * sizeof(uint16_t) + sizeof(uint64_t))) // every other word changed
+#define RECORD_OVERHEAD (2 * sizeof(uint32_t))
+
+_Static_assert(sizeof(rewind_frame_t) % sizeof(uint64_t) == 0, "rewind frames are XORed a word at a time");
+
+/* --------------------------- function prototypes -------------------------- */
+
+static void flatten(const chip8_t *chip8, rewind_frame_t *frame);
+static size_t encode_delta(const rewind_frame_t *previous, const rewind_frame_t *next, uint8_t *out);
+static void apply_delta(rewind_frame_t *frame, const uint8_t *delta, size_t length);
+static void ring_write(rewind_buffer_t *history, size_t offset, const void *bytes, size_t length);
+static void ring_read(const rewind_buffer_t *history, size_t offset, void *bytes, size_t length);
+static void drop_oldest(rewind_buffer_t *history);
+static void restore(const rewind_frame_t *frame, chip8_t *chip8);
+
+/* ---------------------------- helper functions ---------------------------- */
+
+/**
+ * @brief copies the parts of the machine a frame records
+ *
+ * @param chip8 pointer to chip8 struct
+ * @param frame where they go, its padding left as it was
+ */
+static void flatten(const chip8_t *chip8, rewind_frame_t *frame)
+{
+  memcpy(frame->memory, chip8->memory, sizeof(frame->memory));
+  memcpy(frame->display, chip8->display, sizeof(frame->display));
+  memcpy(frame->stack, chip8->stack, sizeof(frame->stack));
+  frame->index = chip8->index;
+  frame->pc = chip8->pc;
+  frame->rand_state = chip8->rand_state;
+  frame->frame_cycles = chip8->frame_cycles;
+  frame->tick_remainder = chip8->tick_remainder;
+  memcpy(frame->registers, chip8->registers, sizeof(frame->registers));
+  frame->sp = chip8->sp;
+  frame->delay_timer = chip8->delay_timer;
+  frame->sound_timer = chip8->sound_timer;
+}
+
+/**
+ * @brief encodes the XOR of two frames, leaving out runs of words that are the same in both
+ *
+ * @param previous the earlier frame
+ * @param next the later frame
+ * @param out where the delta goes, needs DELTA_MAX_SIZE bytes
+ * @return length of the delta in bytes
+ */
+static size_t encode_delta(const rewind_frame_t *previous, const rewind_frame_t *next, uint8_t *out)
+{
+  const uint8_t *previous_bytes = (const uint8_t *)previous;
+  const uint8_t *next_bytes = (const uint8_t *)next;
+  uint8_t *start = out;
+  size_t word = 0;
+
+  while (word < REWIND_FRAME_WORDS)
+  {
+    uint64_t a, b;
+    size_t skip = word;
+    for (; word < REWIND_FRAME_WORDS; ++word)
+    {
+      memcpy(&a, previous_bytes + word * 8, 8);
+      memcpy(&b, next_bytes + word * 8, 8);
+      if (a != b)
+      {
+        break;
+      }
+    }
+    if (word == REWIND_FRAME_WORDS)
+    {
+      break; // the rest is unchanged
+    }
+
+    uint16_t header[2] = {(uint16_t)(word - skip), 0};
+    uint8_t *header_at = out;
+    out += sizeof(header);
+
+    for (; word < REWIND_FRAME_WORDS; ++word)
+    {
+      memcpy(&a, previous_bytes + word * 8, 8);
+      memcpy(&b, next_bytes + word * 8, 8);
+      if (a == b)
+      {
+        break;
+      }
+      uint64_t changed = a ^ b;
+      memcpy(out, &changed, 8);
+      out += 8;
+      header[1]++;
+    }
+
+    memcpy(header_at, header, sizeof(header));
+  }
+
+  return out - start;
+}
+
+/**
+ * @brief XORs a delta into a frame, which turns either of the two frames it was made from into the other
+ *
+ * @param frame the frame to change
+ * @param delta the delta
+ * @param length length of the delta in bytes
+ */
+static void apply_delta(rewind_frame_t *frame, const uint8_t *delta, size_t length)
+{
+  uint8_t *frame_bytes = (uint8_t *)frame;
+  const uint8_t *end = delta + length;
+  size_t word = 0;
+
+  while (delta < end)
+  {
+    uint16_t header[2];
+    memcpy(header, delta, sizeof(header));
+    delta += sizeof(header);
+    word += header[0];
+
+    for (uint16_t i = 0; i < header[1]; ++i, ++word)
+    {
+      uint64_t value, changed;
+      memcpy(&value, frame_bytes + word * 8, 8);
+      memcpy(&changed, delta, 8);
+      value ^= changed;
+      memcpy(frame_bytes + word * 8, &value, 8);
+      delta += 8;
+    }
+  }
+}
+
+/**
+ * @brief copies bytes into the ring, wrapping around its end
+ *
+ * @param history pointer to rewind buffer struct
+ * @param offset where in the ring they go
+ * @param bytes the bytes
+ * @param length number of bytes
+ */
+static void ring_write(rewind_buffer_t *history, size_t offset, const void *bytes, size_t length)
+{
+  size_t first_part = length < history->capacity - offset ? length : history->capacity - offset;
+  memcpy(&history->ring[offset], bytes, first_part);
+  memcpy(history->ring, (const uint8_t *)bytes + first_part, length - first_part);
+}
+
+/**
+ * @brief copies bytes out of the ring, wrapping around its end
+ *
+ * @param history pointer to rewind buffer struct
+ * @param offset where in the ring they are
+ * @param bytes where they go
+ * @param length number of bytes
+ */
+static void ring_read(const rewind_buffer_t *history, size_t offset, void *bytes, size_t length)
+{
+  size_t first_part = length < history->capacity - offset ? length : history->capacity - offset;
+  memcpy(bytes, &history->ring[offset], first_part);
+  memcpy((uint8_t *)bytes + first_part, history->ring, length - first_part);
+}
+
+/**
+ * @brief frees the room taken by the oldest delta
+ *
+ * @param history pointer to rewind buffer struct
+ */
+static void drop_oldest(rewind_buffer_t *history)
+{
+  size_t oldest = (history->head + history->capacity - history->used) % history->capacity;
+  uint32_t length;
+
+  ring_read(history, oldest, &length, sizeof(length));
+  history->used -= length + RECORD_OVERHEAD;
+  history->frames--;
+}
+
+/**
+ * @brief puts a frame back into the machine
+ *
+ * memory is only written where it differs, so decoded code elsewhere is kept
+ *
+ * @param frame the frame
+ * @param chip8 pointer to chip8 struct
+ */
+static void restore(const rewind_frame_t *frame, chip8_t *chip8)
+{
+  uint32_t address = 0;
+  while (address < MEMORY_SIZE)
+  {
+    if (frame->memory[address] == chip8->memory[address])
+    {
+      address++;
+      continue;
+    }
+
+    uint32_t end = address + 1;
+    while (end < MEMORY_SIZE && frame->memory[end] != chip8->memory[end])
+    {
+      end++;
+    }
+    chip8_write_memory(chip8, address, &frame->memory[address], end - address);
+    address = end;
+  }
+
+  memcpy(chip8->display, frame->display, sizeof(chip8->display));
+  memcpy(chip8->stack, frame->stack, sizeof(chip8->stack));
+  chip8->index = frame->index;
+  chip8->pc = frame->pc;
+  chip8->rand_state = frame->rand_state;
+  chip8->frame_cycles = frame->frame_cycles;
+  chip8->tick_remainder = frame->tick_remainder;
+  memcpy(chip8->registers, frame->registers, sizeof(chip8->registers));
+  chip8->sp = frame->sp;
+  chip8->delay_timer = frame->delay_timer;
+  chip8->sound_timer = frame->sound_timer;
+  chip8->dirty_rows = ALL_ROWS_DIRTY;
+}
+
+/* ---------------------------- public functions ---------------------------- */
+
+rewind_buffer_t *rewind_create(size_t budget)
+{
+  if (budget < 2 * (DELTA_MAX_SIZE + RECORD_OVERHEAD))
+  {
+    LOG_ERROR("A rewind budget of %zu bytes is too small, it needs at least %zu",
+              budget, 2 * (DELTA_MAX_SIZE + RECORD_OVERHEAD));
+    return NULL;
+  }
+
+  rewind_buffer_t *history = calloc(1, sizeof(rewind_buffer_t)); // zeroes the frames' padding once and for all
+
+  if (history == NULL || (history->ring = malloc(budget)) == NULL ||
+      (history->scratch = malloc(DELTA_MAX_SIZE)) == NULL)
+  {
+    LOG_ERROR("Could not allocate %zu bytes of rewind history", budget);
+    rewind_destroy(history);
+    return NULL;
+  }
+
+  history->capacity = budget;
+  return history;
+}
+
+void rewind_destroy(rewind_buffer_t *history)
+{
+  if (history == NULL)
+  {
+    return;
+  }
+
+  free(history->ring);
+  free(history->scratch);
+  free(history);
+}
+
+void rewind_capture(rewind_buffer_t *history, const chip8_t *chip8)
+{
+  if (!history->captured)
+  {
+    flatten(chip8, &history->current);
+    history->captured = true;
+    return;
+  }
+
+  flatten(chip8, &history->next);
+  uint32_t length = (uint32_t)encode_delta(&history->current, &history->next, history->scratch);
+
+  while (history->capacity - history->used < length + RECORD_OVERHEAD)
+  {
+    drop_oldest(history);
+  }
+
+  ring_write(history, history->head, &length, sizeof(length));
+  ring_write(history, (history->head + sizeof(length)) % history->capacity, history->scratch, length);
+  ring_write(history, (history->head + sizeof(length) + length) % history->capacity, &length, sizeof(length));
+  history->head = (history->head + length + RECORD_OVERHEAD) % history->capacity;
+  history->used += length + RECORD_OVERHEAD;
+  history->frames++;
+
+  memcpy(&history->current, &history->next, sizeof(rewind_frame_t));
+}
+
+int rewind_step_back(rewind_buffer_t *history, chip8_t *chip8)
+{
+  if (history->frames == 0)
+  {
+    return 1;
+  }
+
+  uint32_t length;
+  size_t trailer = (history->head + history->capacity - sizeof(length)) % history->capacity;
+  ring_read(history, trailer, &length, sizeof(length));
+
+  size_t delta = (trailer + history->capacity - length) % history->capacity;
+  ring_read(history, delta, history->scratch, length);
+  apply_delta(&history->current, history->scratch, length);
+
+  history->head = (delta + history->capacity - sizeof(length)) % history->capacity;
+  history->used -= length + RECORD_OVERHEAD;
+  history->frames--;
+
+  restore(&history->current, chip8);
+  return 0;
+}
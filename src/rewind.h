@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "cpu.h"
+
+/*
+  rewind history. the frontend captures the machine after every frame, and
+  only what changed since the previous capture is kept: the two frames are
+  XORed word by word and the runs of unchanged (zero) words are left out.
+  deltas go into a ring buffer of a fixed number of bytes, dropping the oldest
+  frames to make room. stepping back XORs the newest delta into the frame
+  captured last, which gives the frame before it
+*/
+
+#define REWIND_DEFAULT_BUDGET (4u << 20) // bytes of history, minutes of a typical ROM at 60 frames a second
+#define REWIND_MAX_BUDGET_MB 1024u       // largest `--rewind-mb`, so the budget in bytes fits a 32 bit size_t
+
+typedef struct rewind_frame
+{
+  uint8_t memory[MEMORY_SIZE];
+  uint64_t display[DISPLAY_HEIGHT];
+  uint16_t stack[STACK_DEPTH];
+  uint16_t index;
+  uint16_t pc;
+  uint32_t rand_state;
+  uint32_t frame_cycles;
+  uint8_t registers[REGISTER_COUNT];
+  uint8_t sp;
+  uint8_t delay_timer;
+  uint8_t sound_timer;
+  uint8_t tick_remainder;
+} rewind_frame_t; // everything a frame changes but the keypad, which stays with the player
+
+#define REWIND_FRAME_WORDS (sizeof(rewind_frame_t) / sizeof(uint64_t))
+
+typedef struct rewind_buffer
+{
+  uint8_t *ring;          // deltas, oldest first, each with its length before and after it
+  size_t capacity;        // bytes in `ring`
+  size_t head;            // offset just past the newest delta
+  size_t used;            // bytes of `ring` holding deltas
+  uint32_t frames;        // deltas in the ring, ie. how many frames can be stepped back
+  bool captured;          // `current` holds a frame
+  rewind_frame_t current; // the frame captured last, or the one last stepped back to
+  rewind_frame_t next;    // the frame being captured
+  uint8_t *scratch;       // room to encode or decode one delta
+} rewind_buffer_t;
+
+/* --------------------------- function prototypes -------------------------- */
+
+/**
+ * @brief allocates an empty history
+ *
+ * @param budget bytes the deltas may take up
+ * @return the new history, `NULL` on failure
+ */
+rewind_buffer_t *rewind_create(size_t budget);
+
+/**
+ * @brief frees a history
+ *
+ * @param history pointer to rewind buffer struct
+ */
+void rewind_destroy(rewind_buffer_t *history);
+
+/**
+ * @brief records the machine as it is now, once per frame
+ *
+ * @param history pointer to rewind buffer struct
+ * @param chip8 pointer to chip8 struct
+ */
+void rewind_capture(rewind_buffer_t *history, const chip8_t *chip8);
+
+/**
+ * @brief puts the machine back to the frame before the last one captured or stepped back to
+ *
+ * the frame stepped back to becomes the newest, so capturing again carries on from it
+ *
+ * @param history pointer to rewind buffer struct
+ * @param chip8 pointer to chip8 struct
+ * @return `0` on success, `1` when there is no older frame
+ */
+int rewind_step_back(rewind_buffer_t *history, chip8_t *chip8);
@@ -0,0 +1,93 @@
+#include "trace.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+trace_t *trace_create(void)
+{
+  trace_t *trace = calloc(1, sizeof(trace_t));
+
+  if (trace == NULL)
+  {
+    LOG_ERROR("Could not allocate the trace buffer");
+  }
+  return trace;
+}
+
+void trace_destroy(trace_t *trace)
+{
+  free(trace);
+}
+
+int trace_save(const trace_t *trace, const char *path)
+{
+  FILE *file = fopen(path, "wb");
+
+  if (file == NULL)
+  {
+    LOG_ERROR("Could not open %s for writing", path);
+    return 1;
+  }
+
+  uint32_t version = TRACE_VERSION;
+  uint64_t count = trace->count;
+  uint32_t length = count < TRACE_CAPACITY ? (uint32_t)count : TRACE_CAPACITY;
+  uint32_t oldest = (uint32_t)((count - length) & (TRACE_CAPACITY - 1));
+
+  fwrite(TRACE_MAGIC, 1, 4, file);
+  fwrite(&version, sizeof(version), 1, file);
+  fwrite(&count, sizeof(count), 1, file);
+  fwrite(&length, sizeof(length), 1, file);
+
+  // the ring buffer wraps, so the oldest entries may be in the middle of it
+  uint32_t first_part = length < TRACE_CAPACITY - oldest ? length : TRACE_CAPACITY - oldest;
+  fwrite(&trace->entries[oldest], sizeof(trace_entry_t), first_part, file);
+  fwrite(&trace->entries[0], sizeof(trace_entry_t), length - first_part, file);
+
+  bool failed = ferror(file) != 0;
+  if (fclose(file) != 0 || failed)
+  {
+    LOG_ERROR("Could not write %s", path);
+    return 1;
+  }
+  return 0;
+}
+
+int trace_load(trace_t *trace, const char *path, uint32_t *length)
+{
+  FILE *file = fopen(path, "rb");
+
+  if (file == NULL)
+  {
+    LOG_ERROR("Could not open %s", path);
+    return 1;
+  }
+
+  char magic[4];
+  uint32_t version;
+  uint64_t count;
+
+  if (fread(magic, 1, 4, file) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0 ||
+      fread(&version, sizeof(version), 1, file) != 1 || version != TRACE_VERSION ||
+      fread(&count, sizeof(count), 1, file) != 1 ||
+      fread(length, sizeof(*length), 1, file) != 1 || *length > TRACE_CAPACITY)
+  {
+    LOG_ERROR("%s is not a version %d trace file", path, TRACE_VERSION);
+    fclose(file);
+    return 1;
+  }
+
+  if (fread(trace->entries, sizeof(trace_entry_t), *length, file) != *length)
+  {
+    LOG_ERROR("%s is truncated", path);
+    fclose(file);
+    return 1;
+  }
+
+  fclose(file);
+
+  trace->count = count;
+  return 0;
+}
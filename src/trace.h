@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+  binary instruction tracer. while a trace is attached to a chip8 struct,
+  chip8_run records one fixed-size entry per instruction into a ring buffer
+  instead of printing anything. the buffer is written to a file on exit and
+  turned back into text by the chip8_trace tool, so tracing costs a store
+  per instruction rather than a formatted write
+*/
+
+#define TRACE_CAPACITY 65536  // entries kept, the oldest are overwritten first. must be a power of 2
+#define TRACE_MAGIC "C8TR"    // first 4 bytes of a trace file
+#define TRACE_VERSION 1
+#define TRACE_NO_REGISTER 0xFF // `reg` when the instruction changed no V register
+
+typedef struct trace_entry
+{
+  uint16_t pc;     // address the instruction was fetched from
+  uint16_t opcode; // raw opcode
+  uint16_t index;  // index register after the instruction
+  uint8_t reg;     // lowest V register the instruction changed, TRACE_NO_REGISTER if none
+  uint8_t value;   // new value of that register
+} trace_entry_t;
+
+typedef struct trace
+{
+  trace_entry_t entries[TRACE_CAPACITY];
+  uint64_t count; // instructions recorded so far, including overwritten ones
+} trace_t;
+
+/* --------------------------- function prototypes -------------------------- */
+
+/**
+ * @brief allocates an empty trace
+ *
+ * @return the new trace, `NULL` on failure
+ */
+trace_t *trace_create(void);
+
+/**
+ * @brief frees a trace
+ *
+ * @param trace pointer to trace struct
+ */
+void trace_destroy(trace_t *trace);
+
+/**
+ * @brief appends an entry, overwriting the oldest one once the buffer is full
+ *
+ * @param trace pointer to trace struct
+ * @param entry entry to record
+ */
+static inline void trace_record(trace_t *trace, const trace_entry_t *entry)
+{
+  trace->entries[trace->count++ & (TRACE_CAPACITY - 1)] = *entry;
+}
+
+/**
+ * @brief writes the entries still in the buffer to a file, oldest first
+ *
+ * the file is a header (TRACE_MAGIC, TRACE_VERSION as a uint32_t, the total
+ * count as a uint64_t and the number of entries as a uint32_t) followed by the
+ * entries, all in host byte order
+ *
+ * @param trace pointer to trace struct
+ * @param path path to trace file
+ * @return `0` on success, `1` on failure
+ */
+int trace_save(const trace_t *trace, const char *path);
+
+/**
+ * @brief reads a file written by `trace_save`
+ *
+ * @param trace pointer to trace struct, filled with the entries oldest first
+ * @param path path to trace file
+ * @param length set to the number of entries read
+ * @return `0` on success, `1` on failure
+ */
+int trace_load(trace_t *trace, const char *path, uint32_t *length);
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "trace.h"
+#include "logger.h"
+
+/*
+  prints a trace file written by `chip8 --trace`, one instruction per line
+*/
+
+/* --------------------------- function prototypes -------------------------- */
+
+static void print_usage(FILE *out, const char *program);
+static void disassemble(uint16_t opcode, char *text, size_t size);
+
+/* ---------------------------- helper functions ---------------------------- */
+
+/**
+ * @brief prints available flags
+ *
+ * @param out `stdout` or `stderr`
+ * @param program program name, which is `argv[0]`
+ */
+static void print_usage(FILE *out, const char *program)
+{
+  fprintf(out, "Usage: %s <trace_path>\n", program);
+}
+
+/**
+ * @brief turns an opcode into its mnemonic, using the same names as the verbose log
+ *
+ * @param opcode raw opcode
+ * @param text buffer for the mnemonic
+ * @param size size of `text`
+ */
+static void disassemble(uint16_t opcode, char *text, size_t size)
+{
+  uint16_t nnn = opcode & 0x0FFF;
+  uint8_t x = (opcode & 0x0F00) >> 8;
+  uint8_t y = (opcode & 0x00F0) >> 4;
+  uint8_t n = opcode & 0x000F;
+  uint8_t kk = opcode & 0x00FF;
+
+  static const char *const alu[16] = {
+      [0x0] = "LD", [0x1] = "OR", [0x2] = "AND", [0x3] = "XOR", [0x4] = "ADD",
+      [0x5] = "SUB", [0x6] = "SHR", [0x7] = "SUBN", [0xE] = "SHL"};
+
+  switch (opcode & 0xF000)
+  {
+  case 0x0000:
+    if (opcode == 0x00E0)
+    {
+      snprintf(text, size, "CLS");
+      return;
+    }
+    if (opcode == 0x00EE)
+    {
+      snprintf(text, size, "RET");
+      return;
+    }
+    break;
+  case 0x1000:
+    snprintf(text, size, "JP 0x%03X", nnn);
+    return;
+  case 0x2000:
+    snprintf(text, size, "CALL 0x%03X", nnn);
+    return;
+  case 0x3000:
+    snprintf(text, size, "SE V%X, 0x%02X", x, kk);
+    return;
+  case 0x4000:
+    snprintf(text, size, "SNE V%X, 0x%02X", x, kk);
+    return;
+  case 0x5000:
+    snprintf(text, size, "SE V%X, V%X", x, y);
+    return;
+  case 0x6000:
+    snprintf(text, size, "LD V%X, 0x%02X", x, kk);
+    return;
+  case 0x7000:
+    snprintf(text, size, "ADD V%X, 0x%02X", x, kk);
+    return;
+  case 0x8000:
+    if (n == 0x6 || n == 0xE)
+    {
+      snprintf(text, size, "%s V%X", alu[n], x);
+      return;
+    }
+    if (alu[n] != NULL)
+    {
+      snprintf(text, size, "%s V%X, V%X", alu[n], x, y);
+      return;
+    }
+    break;
+  case 0x9000:
+    snprintf(text, size, "SNE V%X, V%X", x, y);
+    return;
+  case 0xA000:
+    snprintf(text, size, "LD I, 0x%03X", nnn);
+    return;
+  case 0xB000:
+    snprintf(text, size, "JP V0, 0x%03X", nnn);
+    return;
+  case 0xC000:
+    snprintf(text, size, "RND V%X, 0x%02X", x, kk);
+    return;
+  case 0xD000:
+    snprintf(text, size, "DRW V%X, V%X, %d", x, y, n);
+    return;
+  case 0xE000:
+    if (kk == 0x9E)
+    {
+      snprintf(text, size, "SKP V%X", x);
+      return;
+    }
+    if (kk == 0xA1)
+    {
+      snprintf(text, size, "SKNP V%X", x);
+      return;
+    }
+    break;
+  case 0xF000:
+    switch (kk)
+    {
+    case 0x07:
+      snprintf(text, size, "LD V%X, DT", x);
+      return;
+    case 0x0A:
+      snprintf(text, size, "LD V%X, K", x);
+      return;
+    case 0x15:
+      snprintf(text, size, "LD DT, V%X", x);
+      return;
+    case 0x18:
+      snprintf(text, size, "LD ST, V%X", x);
+      return;
+    case 0x1E:
+      snprintf(text, size, "ADD I, V%X", x);
+      return;
+    case 0x29:
+      snprintf(text, size, "LD F, V%X", x);
+      return;
+    case 0x33:
+      snprintf(text, size, "LD B, V%X", x);
+      return;
+    case 0x55:
+      snprintf(text, size, "LD [I], V%X", x);
+      return;
+    case 0x65:
+      snprintf(text, size, "LD V%X, [I]", x);
+      return;
+    }
+    break;
+  }
+
+  snprintf(text, size, "???");
+}
+
+/* ---------------------------------- main ---------------------------------- */
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    print_usage(stderr, argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  trace_t *trace = trace_create();
+  uint32_t length;
+
+  if (trace == NULL || trace_load(trace, argv[1], &length) != 0)
+  {
+    trace_destroy(trace);
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t first = trace->count - length; // instructions before these were overwritten
+  printf("%" PRIu64 " instructions traced, showing the last %" PRIu32 "\n", trace->count, length);
+
+  for (uint32_t i = 0; i < length; ++i)
+  {
+    const trace_entry_t *entry = &trace->entries[i];
+    char text[32];
+
+    disassemble(entry->opcode, text, sizeof(text));
+    printf("%10" PRIu64 "  %03X  %04X  %-16s I=%03X", first + i, entry->pc, entry->opcode, text, entry->index);
+    if (entry->reg != TRACE_NO_REGISTER)
+    {
+      printf("  V%X=%02X", entry->reg, entry->value);
+    }
+    printf("\n");
+  }
+
+  trace_destroy(trace);
+  return EXIT_SUCCESS;
+}